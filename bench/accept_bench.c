@@ -0,0 +1,113 @@
+/*
+ * Accept rate: one acceptor versus several SO_REUSEPORT acceptors.
+ *
+ * Usage: accept_bench [<connections>] [<clients>] [<acceptors>]
+ *
+ * The acceptors run in this process on a loopback port.  Each accepted
+ * connection is counted and closed straight away, so that what is
+ * measured is the cost of getting connections through accept() rather
+ * than of serving them.  A number of client threads connect as fast as
+ * they can until the total number of connections has been accepted.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "acceptor.h"
+
+static long nconns = 200000; 
+static int nclients = 8; 
+static int nacceptors = 4; 
+
+static struct sockaddr_in addr; 
+static long accepted; 
+static long issued; 
+
+static double now(void) {
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts); 
+    return ts.tv_sec + ts.tv_nsec / 1e9; 
+}
+
+static void handoff(int fd) {
+    close(fd); 
+    __atomic_add_fetch(&accepted, 1, __ATOMIC_RELAXED); 
+}
+
+static void *client(void *arg) {
+    while(__atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED) < nconns) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0); 
+        // Reset rather than linger in TIME_WAIT, so a long run does not
+        // exhaust the ephemeral ports.
+        struct linger lg = {.l_onoff = 1, .l_linger = 0}; 
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)); 
+        while(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd); 
+            fd = socket(AF_INET, SOCK_STREAM, 0); 
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)); 
+        }
+        close(fd); 
+    }
+    return NULL; 
+}
+
+/*
+ * Pick a free loopback port.  The port is released again before the
+ * acceptors bind it.
+ */
+static int free_port(void) {
+    struct sockaddr_in a = {0}; 
+    socklen_t len = sizeof(a); 
+    a.sin_family = AF_INET; 
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK); 
+    int fd = socket(AF_INET, SOCK_STREAM, 0); 
+    bind(fd, (struct sockaddr *)&a, sizeof(a)); 
+    getsockname(fd, (struct sockaddr *)&a, &len); 
+    close(fd); 
+    return ntohs(a.sin_port); 
+}
+
+static void bench(int n) {
+    char port[16]; 
+    snprintf(port, sizeof(port), "%d", free_port()); 
+    addr.sin_family = AF_INET; 
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); 
+    addr.sin_port = htons(atoi(port)); 
+    accepted = issued = 0; 
+    if(acc_start(port, n, handoff) < 0) {
+        fprintf(stderr, "Failed to start %d acceptors on port %s\n", n, port); 
+        exit(EXIT_FAILURE); 
+    }
+
+    pthread_t *tids = malloc(nclients * sizeof(pthread_t)); 
+    double start = now(); 
+    for(int i = 0; i < nclients; ++i)
+        pthread_create(&tids[i], NULL, client, NULL); 
+    for(int i = 0; i < nclients; ++i)
+        pthread_join(tids[i], NULL); 
+    while(__atomic_load_n(&accepted, __ATOMIC_RELAXED) < nconns)
+        usleep(100); 
+    double elapsed = now() - start; 
+    acc_stop(); 
+    free(tids); 
+
+    printf("%-10d %12ld %12.0f\n", n, nconns, nconns / elapsed); 
+}
+
+int main(int argc, char *argv[]) {
+    if(argc > 1)
+        nconns = atol(argv[1]); 
+    if(argc > 2)
+        nclients = atoi(argv[2]); 
+    if(argc > 3)
+        nacceptors = atoi(argv[3]); 
+    printf("%-10s %12s %12s\n", "acceptors", "connections", "accepts/s"); 
+    bench(1); 
+    bench(nacceptors); 
+    return EXIT_SUCCESS; 
+}
@@ -0,0 +1,128 @@
+/*
+ * Connection churn: thread per connection versus the worker pool.
+ *
+ * Usage: churn_bench [<connections>] [<workers>]
+ *
+ * The server runs in this process, accepting on a loopback port and
+ * handing each connection either to a new thread (as main() does by
+ * default) or to the worker pool (as with -w).  A client opens one
+ * connection at a time, sends LOGIN and measures the time from connect()
+ * until the ACK arrives, then closes the connection.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "server.h"
+#include "server_ext.h"
+#include "client_registry.h"
+#include "player_registry.h"
+#include "jeux_globals.h"
+#include "protocol.h"
+#include "worker_pool.h"
+
+static long nconns = 20000; 
+static int nworkers = 4; 
+
+static double now(void) {
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts); 
+    return ts.tv_sec + ts.tv_nsec / 1e9; 
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(double *)a, y = *(double *)b; 
+    return x < y ? -1 : x > y; 
+}
+
+static void *acceptor(void *arg) {
+    int listenfd = ((int *)arg)[0]; 
+    int pooled = ((int *)arg)[1]; 
+    pthread_t tid; 
+    while(1) {
+        int fd = accept(listenfd, NULL, NULL); 
+        if(fd < 0)
+            break; 
+        if(pooled) {
+            wpool_submit(fd); 
+            continue; 
+        }
+        int *fdp = malloc(sizeof(int)); 
+        *fdp = fd; 
+        pthread_create(&tid, NULL, jeux_client_service, fdp); 
+    }
+    return NULL; 
+}
+
+static void bench(int pooled) {
+    static int args[2][2]; 
+    struct sockaddr_in addr = {0}; 
+    socklen_t addrlen = sizeof(addr); 
+    pthread_t tid; 
+    addr.sin_family = AF_INET; 
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); 
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0); 
+    bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)); 
+    listen(listenfd, 1024); 
+    getsockname(listenfd, (struct sockaddr *)&addr, &addrlen); 
+    args[pooled][0] = listenfd; 
+    args[pooled][1] = pooled; 
+    pthread_create(&tid, NULL, acceptor, args[pooled]); 
+
+    double *lat = malloc(nconns * sizeof(double)); 
+    double start = now(); 
+    for(long i = 0; i < nconns; ++i) {
+        char buf[sizeof(JEUX_PACKET_HEADER) + 16]; 
+        JEUX_PACKET_HEADER *hdr = (JEUX_PACKET_HEADER *)buf; 
+        int len = snprintf(buf + sizeof(JEUX_PACKET_HEADER), 16, "churn%ld", i % 64); 
+        memset(hdr, 0, sizeof(JEUX_PACKET_HEADER)); 
+        hdr->type = JEUX_LOGIN_PKT; 
+        hdr->size = htons(len); 
+
+        double t = now(); 
+        int fd = socket(AF_INET, SOCK_STREAM, 0); 
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)); 
+        write(fd, buf, sizeof(JEUX_PACKET_HEADER) + len); 
+        size_t got = 0; 
+        while(got < sizeof(JEUX_PACKET_HEADER)) {
+            ssize_t n = read(fd, buf + got, sizeof(JEUX_PACKET_HEADER) - got); 
+            if(n <= 0)
+                break; 
+            got += n; 
+        }
+        lat[i] = now() - t; 
+        close(fd); 
+    }
+    double elapsed = now() - start; 
+
+    qsort(lat, nconns, sizeof(double), cmp_double); 
+    double sum = 0; 
+    for(long i = 0; i < nconns; ++i)
+        sum += lat[i]; 
+    printf("%-20s %10.0f %10.1f %10.1f %10.1f\n", pooled ? "worker pool" : "thread per conn",
+        nconns / elapsed, sum / nconns * 1e6, lat[nconns / 2] * 1e6, lat[nconns * 99 / 100] * 1e6); 
+    free(lat); 
+    shutdown(listenfd, SHUT_RDWR); 
+    close(listenfd); 
+    pthread_join(tid, NULL); 
+}
+
+int main(int argc, char *argv[]) {
+    if(argc > 1)
+        nconns = atol(argv[1]); 
+    if(argc > 2)
+        nworkers = atoi(argv[2]); 
+    client_registry = creg_init(); 
+    player_registry = preg_init(); 
+    wpool_init(nworkers, 0); 
+    printf("%-20s %10s %10s %10s %10s\n", "server", "conn/s", "mean us", "p50 us", "p99 us"); 
+    bench(0); 
+    bench(1); 
+    return EXIT_SUCCESS; 
+}
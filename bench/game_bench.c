@@ -0,0 +1,86 @@
+/*
+ * Cost of applying a move and testing for the end of the game.
+ *
+ * Usage: game_bench [<games>]
+ *
+ * A set of random games, each played until it is won or drawn, is
+ * generated up front and then replayed over and over, through
+ * game_apply_move() followed by game_is_over() (and game_get_winner()
+ * once the game is over), as client_make_move() does.  Games are created
+ * outside the timed section.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "game.h"
+#include "game_ext.h"
+
+#define NSCRIPTS 1024
+
+static long ngames = 2000000; 
+
+typedef struct script {
+    int nmoves; 
+    GAME_MOVE moves[9]; 
+} SCRIPT; 
+
+static SCRIPT scripts[NSCRIPTS]; 
+
+static double now(void) {
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts); 
+    return ts.tv_sec + ts.tv_nsec / 1e9; 
+}
+
+/*
+ * Play random games to the end, recording their moves.
+ */
+static void make_scripts(void) {
+    unsigned int seed = 1; 
+    for(int i = 0; i < NSCRIPTS; ++i) {
+        SCRIPT *s = &scripts[i]; 
+        GAME *game = game_create(); 
+        int cells[9] = {1, 2, 3, 4, 5, 6, 7, 8, 9}, ncells = 9; 
+        GAME_ROLE role = FIRST_PLAYER_ROLE; 
+        while(!game_is_over(game)) {
+            int j = rand_r(&seed) % ncells; 
+            GAME_MOVE *move = &s->moves[s->nmoves++]; 
+            move->role = role; 
+            move->pos = cells[j]; 
+            cells[j] = cells[--ncells]; 
+            game_apply_move(game, move); 
+            role = role % 2 + 1; 
+        }
+        game_unref(game, "because the game is over"); 
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if(argc > 1)
+        ngames = atol(argv[1]); 
+    make_scripts(); 
+    GAME *games[NSCRIPTS]; 
+    long nmoves = 0, nwins = 0; 
+    double elapsed = 0; 
+    for(long g = 0; g < ngames; g += NSCRIPTS) {
+        for(int i = 0; i < NSCRIPTS; ++i)
+            games[i] = game_create(); 
+        double start = now(); 
+        for(int i = 0; i < NSCRIPTS; ++i) {
+            SCRIPT *s = &scripts[i]; 
+            for(int m = 0; m < s->nmoves; ++m) {
+                game_apply_move(games[i], &s->moves[m]); 
+                if(game_is_over(games[i]))
+                    nwins += game_get_winner(games[i]) != NULL_ROLE; 
+            }
+            nmoves += s->nmoves; 
+        }
+        elapsed += now() - start; 
+        for(int i = 0; i < NSCRIPTS; ++i)
+            game_unref(games[i], "because the game is over"); 
+    }
+    printf("%ld moves in %ld games (%ld won): %.1f ns per move\n",
+        nmoves, ngames / NSCRIPTS * NSCRIPTS, nwins, elapsed / nmoves * 1e9); 
+    return EXIT_SUCCESS; 
+}
@@ -0,0 +1,85 @@
+/*
+ * Login throughput of the player registry as the population grows.
+ *
+ * Usage: login_bench [<threads>] [<max players>]
+ *
+ * For each population size (a power of ten up to the maximum), a fresh
+ * registry is filled with that many players, and then the threads look
+ * up players that exist, as LOGIN does for a returning player, and add
+ * new ones, as LOGIN does for a first-time player.  Both rates should
+ * stay flat as the population grows.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "player_registry.h"
+
+#define OPS_PER_THREAD 200000
+
+static int nthreads = 4; 
+static long maxplayers = 1000000; 
+
+static PLAYER_REGISTRY *preg; 
+static long population; 
+static int adding; 
+static pthread_barrier_t barrier; 
+
+static double now(void) {
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts); 
+    return ts.tv_sec + ts.tv_nsec / 1e9; 
+}
+
+static void *worker(void *arg) {
+    long id = (long)arg; 
+    unsigned int seed = id + 1; 
+    char name[32]; 
+    pthread_barrier_wait(&barrier); 
+    for(long i = 0; i < OPS_PER_THREAD; ++i) {
+        if(adding)
+            snprintf(name, sizeof(name), "new%ld.%ld", id, i); 
+        else
+            snprintf(name, sizeof(name), "player%ld", (long)rand_r(&seed) % population); 
+        player_unref(preg_register(preg, name), "for reference discarded by benchmark"); 
+    }
+    pthread_barrier_wait(&barrier); 
+    return NULL; 
+}
+
+static double run(int add) {
+    pthread_t tids[nthreads]; 
+    adding = add; 
+    for(long i = 0; i < nthreads; ++i)
+        pthread_create(&tids[i], NULL, worker, (void *)i); 
+    pthread_barrier_wait(&barrier); 
+    double start = now(); 
+    pthread_barrier_wait(&barrier); 
+    double elapsed = now() - start; 
+    for(int i = 0; i < nthreads; ++i)
+        pthread_join(tids[i], NULL); 
+    return (double)nthreads * OPS_PER_THREAD / elapsed; 
+}
+
+int main(int argc, char *argv[]) {
+    char name[32]; 
+    if(argc > 1)
+        nthreads = atoi(argv[1]); 
+    if(argc > 2)
+        maxplayers = atol(argv[2]); 
+    pthread_barrier_init(&barrier, NULL, nthreads + 1); 
+    printf("%-12s %14s %14s\n", "players", "existing/s", "new/s"); 
+    for(population = 1000; population <= maxplayers; population *= 10) {
+        preg = preg_init(); 
+        for(long i = 0; i < population; ++i) {
+            snprintf(name, sizeof(name), "player%ld", i); 
+            player_unref(preg_register(preg, name), "for reference discarded by benchmark"); 
+        }
+        double existing = run(0); 
+        double added = run(1); 
+        printf("%-12ld %14.0f %14.0f\n", population, existing, added); 
+        preg_fini(preg); 
+    }
+    return EXIT_SUCCESS; 
+}
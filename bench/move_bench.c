@@ -0,0 +1,171 @@
+/*
+ * Heap allocations and throughput of the MOVE path.
+ *
+ * Usage: move_bench [<games>]
+ *
+ * Two clients, each connected through a UNIX stream socketpair whose other
+ * end is drained by a thread, play the same game over and over through
+ * client_make_move(), which parses and applies the move, renders the new
+ * state and queues MOVED for the opponent.  Output is flushed after every
+ * move, as the server does after every request.  The first four moves of
+ * each game cannot end it and are measured; the rest of the game and the
+ * setup of the next one are not.  The game layer is also measured on its
+ * own, through the allocating API and through the _into() variants.
+ *
+ * malloc() and friends are defined here, so that the calls made by the
+ * benchmarking thread can be counted.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "client_registry.h"
+#include "player_registry.h"
+#include "client_ext.h"
+#include "game_ext.h"
+
+static long ngames = 100000; 
+
+static __thread long nallocs; 
+
+extern void *__libc_malloc(size_t size); 
+extern void *__libc_calloc(size_t nmemb, size_t size); 
+extern void *__libc_realloc(void *ptr, size_t size); 
+
+void *malloc(size_t size) {
+    nallocs++; 
+    return __libc_malloc(size); 
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    nallocs++; 
+    return __libc_calloc(nmemb, size); 
+}
+
+void *realloc(void *ptr, size_t size) {
+    nallocs++; 
+    return __libc_realloc(ptr, size); 
+}
+
+static double now(void) {
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts); 
+    return ts.tv_sec + ts.tv_nsec / 1e9; 
+}
+
+static void *drainer(void *arg) {
+    int fd = *(int *)arg; 
+    char buf[65536]; 
+    while(read(fd, buf, sizeof(buf)) > 0)
+        ; 
+    return NULL; 
+}
+
+static void no_wakeup(void *arg) {
+}
+
+static void flush(CLIENT *client) {
+    while(client_flush_output(client) > 0)
+        ; 
+}
+
+// X takes 1, 3, 4, 7 and O takes 2, 5, 6: X wins on the seventh move.
+static char *moves[] = {"1", "2", "3", "5", "4", "6", "7"}; 
+#define MEASURED 4
+
+static void bench_client(void) {
+    CLIENT_REGISTRY *creg = creg_init(); 
+    PLAYER_REGISTRY *preg = preg_init(); 
+    int sv[2][2]; 
+    pthread_t tid[2]; 
+    CLIENT *client[2]; 
+    char *names[] = {"alice", "bob"}; 
+    for(int i = 0; i < 2; ++i) {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]); 
+        pthread_create(&tid[i], NULL, drainer, &sv[i][1]); 
+        client[i] = creg_register(creg, sv[i][0]); 
+        client_set_wakeup(client[i], no_wakeup, NULL); 
+        client_login(client[i], preg_register(preg, names[i])); 
+    }
+
+    long allocs = 0, nmoves = 0; 
+    double elapsed = 0; 
+    for(long g = 0; g < ngames; ++g) {
+        char state[GAME_STATE_BUFSIZE]; 
+        int id[2]; 
+        id[0] = client_make_invitation(client[0], client[1], FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE); 
+        id[1] = 0; 
+        client_accept_invitation_into(client[1], id[1], state); 
+        flush(client[0]); 
+        flush(client[1]); 
+        for(int m = 0; m < sizeof(moves) / sizeof(moves[0]); ++m) {
+            CLIENT *mover = client[m % 2]; 
+            long before = nallocs; 
+            double start = now(); 
+            client_make_move(mover, id[m % 2], moves[m]); 
+            flush(client[0]); 
+            flush(client[1]); 
+            if(m < MEASURED) {
+                elapsed += now() - start; 
+                allocs += nallocs - before; 
+                nmoves++; 
+            }
+        }
+    }
+    printf("%-22s %12.0f %14.3f\n", "client_make_move", nmoves / elapsed, (double)allocs / nmoves); 
+
+    for(int i = 0; i < 2; ++i) {
+        creg_unregister(creg, client[i]); 
+        shutdown(sv[i][0], SHUT_WR); 
+        pthread_join(tid[i], NULL); 
+        close(sv[i][0]); 
+        close(sv[i][1]); 
+    }
+    creg_fini(creg); 
+    preg_fini(preg); 
+}
+
+static void bench_game(int into) {
+    long allocs = 0, nmoves = 0; 
+    double start = now(); 
+    for(long g = 0; g < ngames; ++g) {
+        GAME *game = game_create(); 
+        for(int m = 0; m < MEASURED; ++m) {
+            GAME_ROLE role = m % 2 ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE; 
+            long before = nallocs; 
+            if(into) {
+                GAME_MOVE move; 
+                char state[GAME_STATE_BUFSIZE]; 
+                game_parse_move_into(game, role, moves[m], &move); 
+                game_apply_move(game, &move); 
+                game_unparse_state_into(game, state); 
+            }
+            else {
+                GAME_MOVE *move = game_parse_move(game, role, moves[m]); 
+                game_apply_move(game, move); 
+                free(move); 
+                free(game_unparse_state(game)); 
+            }
+            allocs += nallocs - before; 
+            nmoves++; 
+        }
+        game_unref(game, "because the game is over"); 
+    }
+    double elapsed = now() - start; 
+    printf("%-22s %12.0f %14.3f\n", into ? "game (_into)" : "game (allocating)",
+        nmoves / elapsed, (double)allocs / nmoves); 
+}
+
+int main(int argc, char *argv[]) {
+    if(argc > 1)
+        ngames = atol(argv[1]); 
+    printf("%-22s %12s %14s\n", "path", "moves/s", "allocs/move"); 
+    bench_game(0); 
+    bench_game(1); 
+    bench_client(); 
+    return EXIT_SUCCESS; 
+}
@@ -0,0 +1,74 @@
+/*
+ * Object churn: creating and freeing CLIENTs, INVITATIONs and GAMEs.
+ *
+ * Usage: pool_bench [<threads>] [<games per thread>]
+ *
+ * Each thread repeatedly plays out the life of a short game as far as
+ * object allocation goes: two clients are created, one invites the other,
+ * the invitation is accepted (which creates the game), the game is
+ * resigned, and everything is released again.  The occupancy of the
+ * object pools is shown afterwards.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "client_registry.h"
+#include "invitation.h"
+#include "game.h"
+#include "obj_pool.h"
+
+static int nthreads = 4; 
+static long ngames = 1000000; 
+static pthread_barrier_t barrier; 
+
+static double now(void) {
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts); 
+    return ts.tv_sec + ts.tv_nsec / 1e9; 
+}
+
+static void *worker(void *arg) {
+    pthread_barrier_wait(&barrier); 
+    for(long i = 0; i < ngames; ++i) {
+        CLIENT *source = client_create(NULL, -1); 
+        CLIENT *target = client_create(NULL, -1); 
+        INVITATION *inv = inv_create(source, target, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE); 
+        inv_accept(inv); 
+        inv_close(inv, FIRST_PLAYER_ROLE); 
+        inv_unref(inv, "for reference discarded by benchmark"); 
+        client_unref(source, "for reference discarded by benchmark"); 
+        client_unref(target, "for reference discarded by benchmark"); 
+    }
+    pthread_barrier_wait(&barrier); 
+    return NULL; 
+}
+
+int main(int argc, char *argv[]) {
+    if(argc > 1)
+        nthreads = atoi(argv[1]); 
+    if(argc > 2)
+        ngames = atol(argv[2]); 
+    pthread_t tids[nthreads]; 
+    pthread_barrier_init(&barrier, NULL, nthreads + 1); 
+    for(long i = 0; i < nthreads; ++i)
+        pthread_create(&tids[i], NULL, worker, NULL); 
+    pthread_barrier_wait(&barrier); 
+    double start = now(); 
+    pthread_barrier_wait(&barrier); 
+    double elapsed = now() - start; 
+    for(int i = 0; i < nthreads; ++i)
+        pthread_join(tids[i], NULL); 
+    printf("%d threads: %.0f games/s (%.1f ns per game)\n", nthreads,
+        nthreads * ngames / elapsed, elapsed / (nthreads * ngames) * 1e9); 
+    OBJ_POOL *pools[] = {&client_pool, &inv_pool, &game_pool}; 
+    for(int i = 0; i < 3; ++i) {
+        OPOOL_STATS stats; 
+        opool_get_stats(pools[i], &stats); 
+        printf("%-10s pool: %lu allocs, %lu cache hits, %lu depot hits, %lu created, %lu in use, %lu idle\n",
+            pools[i]->name, stats.allocs, stats.cache_hits, stats.depot_hits, stats.mallocs,
+            stats.in_use, stats.idle); 
+    }
+    return EXIT_SUCCESS; 
+}
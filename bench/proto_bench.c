@@ -0,0 +1,176 @@
+/*
+ * Throughput comparison of the blocking and io_uring packet I/O paths.
+ *
+ * Usage: proto_bench [<packets>]
+ *
+ * Packets are pushed through a UNIX stream socketpair.  For the receive
+ * test a writer thread sends packets in bursts (as a pipelining client
+ * would) while the main thread receives them one at a time with each
+ * backend, counting the read()/recv() calls it makes along the way.  For the send test the main thread sends packets one at a time
+ * with each backend while a reader thread drains the other end.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "proto_uring.h"
+#include "payload_pool.h"
+
+#define BURST 32
+
+static long npackets = 1000000; 
+
+enum { BLOCKING, READER, URING }; 
+static char *backend_name[] = {"blocking", "reader", "io_uring"}; 
+
+/*
+ * The receive paths are linked into this program, so defining read() and
+ * recv() here lets us count the system calls they make.
+ */
+static __thread long nreads; 
+
+ssize_t read(int fd, void *buf, size_t count) {
+    nreads++; 
+    return syscall(SYS_read, fd, buf, count); 
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+    nreads++; 
+    return syscall(SYS_recvfrom, fd, buf, len, flags, NULL, 0); 
+}
+
+static double now(void) {
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts); 
+    return ts.tv_sec + ts.tv_nsec / 1e9; 
+}
+
+static void make_packet(JEUX_PACKET_HEADER *hdr, char *payload) {
+    memset(hdr, 0, sizeof(JEUX_PACKET_HEADER)); 
+    hdr->type = JEUX_MOVE_PKT; 
+    hdr->size = htons(1); 
+    payload[0] = '5'; 
+}
+
+static void *burst_writer(void *arg) {
+    int fd = *(int *)arg; 
+    size_t pktlen = sizeof(JEUX_PACKET_HEADER) + 1; 
+    char *buf = malloc(BURST * pktlen); 
+    for(int i = 0; i < BURST; ++i)
+        make_packet((JEUX_PACKET_HEADER *)(buf + i * pktlen), buf + i * pktlen + sizeof(JEUX_PACKET_HEADER)); 
+    for(long sent = 0; sent < npackets; sent += BURST) {
+        size_t len = BURST * pktlen; 
+        char *ptr = buf; 
+        while(len) {
+            ssize_t n = write(fd, ptr, len); 
+            if(n <= 0)
+                goto done; 
+            ptr += n; 
+            len -= n; 
+        }
+    }
+done:
+    free(buf); 
+    return NULL; 
+}
+
+static void *drainer(void *arg) {
+    int fd = *(int *)arg; 
+    char buf[65536]; 
+    while(read(fd, buf, sizeof(buf)) > 0)
+        ; 
+    return NULL; 
+}
+
+static void bench_recv(int backend) {
+    int sv[2]; 
+    pthread_t tid; 
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv); 
+    PROTO_URING *pu = backend == URING ? proto_uring_create(sv[0]) : NULL; 
+    PROTO_READER *rp = backend == READER ? proto_reader_create(sv[0]) : NULL; 
+    pthread_create(&tid, NULL, burst_writer, &sv[1]); 
+    long reads = nreads; 
+    double start = now(); 
+    JEUX_PACKET_HEADER hdr; 
+    void *data; 
+    long n; 
+    for(n = 0; n < npackets; ++n) {
+        if(backend == READER) {
+            if(proto_reader_next(rp, &hdr, &data) == -1)
+                break; 
+            continue; 
+        }
+        if((pu ? proto_uring_recv_packet(pu, &hdr, &data) :
+                proto_recv_packet(sv[0], &hdr, &data)) == -1)
+            break; 
+        if(pu)
+            ppool_free(data); 
+        else
+            free(data); 
+    }
+    double elapsed = now() - start; 
+    reads = nreads - reads; 
+    pthread_join(tid, NULL); 
+    if(pu)
+        proto_uring_destroy(pu); 
+    if(rp)
+        proto_reader_destroy(rp); 
+    close(sv[0]); 
+    close(sv[1]); 
+    if(backend == URING) {
+        PPOOL_STATS stats; 
+        ppool_get_stats(&stats); 
+        printf("%-8s %-10s %14.0f %12s\n", "recv", backend_name[backend], n / elapsed, "n/a"); 
+        printf("         payload pool: %lu allocs, %lu cache hits, %lu mallocs\n",
+            stats.allocs, stats.cache_hits, stats.mallocs); 
+    }
+    else
+        printf("%-8s %-10s %14.0f %12.3f\n", "recv", backend_name[backend], n / elapsed, (double)reads / n); 
+}
+
+static void bench_send(int backend) {
+    int sv[2]; 
+    pthread_t tid; 
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv); 
+    pthread_create(&tid, NULL, drainer, &sv[1]); 
+    JEUX_PACKET_HEADER hdr; 
+    char payload[1]; 
+    double start = now(); 
+    for(long n = 0; n < npackets; ++n) {
+        make_packet(&hdr, payload); 
+        if(backend == URING)
+            proto_uring_send_packet(sv[0], &hdr, payload); 
+        else
+            proto_send_packet(sv[0], &hdr, payload); 
+    }
+    double elapsed = now() - start; 
+    shutdown(sv[0], SHUT_WR); 
+    pthread_join(tid, NULL); 
+    close(sv[0]); 
+    close(sv[1]); 
+    printf("%-8s %-10s %14.0f\n", "send", backend_name[backend], npackets / elapsed); 
+}
+
+int main(int argc, char *argv[]) {
+    if(argc > 1)
+        npackets = atol(argv[1]); 
+    int uring = proto_uring_init() == 0; 
+    printf("%-8s %-10s %14s %12s\n", "test", "backend", "packets/s", "reads/packet"); 
+    bench_recv(BLOCKING); 
+    bench_recv(READER); 
+    if(uring)
+        bench_recv(URING); 
+    bench_send(BLOCKING); 
+    if(uring)
+        bench_send(URING); 
+    else
+        printf("io_uring is not available on this kernel\n"); 
+    return EXIT_SUCCESS; 
+}
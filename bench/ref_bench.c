@@ -0,0 +1,155 @@
+/*
+ * Cost of a reference count increment and decrement.
+ *
+ * Usage: ref_bench [<threads>]
+ *
+ * For each of CLIENT, PLAYER, GAME and INVITATION, this times a ref
+ * followed by an unref of the same object: first on one thread, then on
+ * several threads at once, each with an object of its own, and then on
+ * several threads that share one object, as when many sessions hold
+ * references to the same player.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "client_registry.h"
+#include "player.h"
+#include "game.h"
+#include "invitation.h"
+
+#define PAIRS 10000000
+#define MAX_THREADS 64
+
+static int nthreads = 4; 
+
+typedef struct kind {
+    char *name; 
+    void *(*create)(void); 
+    void (*destroy)(void *obj); 
+    void (*pair)(void *obj, long n); 
+} KIND; 
+
+static void *create_client(void) {
+    return client_create(NULL, -1); 
+}
+
+static void destroy_client(void *obj) {
+    client_unref(obj, "for reference discarded by benchmark"); 
+}
+
+static void pair_client(void *obj, long n) {
+    for(long i = 0; i < n; ++i)
+        client_unref(client_ref(obj, "for benchmark"), "for benchmark"); 
+}
+
+static void *create_player(void) {
+    return player_create("player"); 
+}
+
+static void destroy_player(void *obj) {
+    player_unref(obj, "for reference discarded by benchmark"); 
+}
+
+static void pair_player(void *obj, long n) {
+    for(long i = 0; i < n; ++i)
+        player_unref(player_ref(obj, "for benchmark"), "for benchmark"); 
+}
+
+static void *create_game(void) {
+    return game_create(); 
+}
+
+static void destroy_game(void *obj) {
+    game_unref(obj, "for reference discarded by benchmark"); 
+}
+
+static void pair_game(void *obj, long n) {
+    for(long i = 0; i < n; ++i)
+        game_unref(game_ref(obj, "for benchmark"), "for benchmark"); 
+}
+
+static void *create_inv(void) {
+    CLIENT *source = client_create(NULL, -1); 
+    CLIENT *target = client_create(NULL, -1); 
+    INVITATION *inv = inv_create(source, target, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE); 
+    client_unref(source, "for reference discarded by benchmark"); 
+    client_unref(target, "for reference discarded by benchmark"); 
+    return inv; 
+}
+
+static void destroy_inv(void *obj) {
+    inv_unref(obj, "for reference discarded by benchmark"); 
+}
+
+static void pair_inv(void *obj, long n) {
+    for(long i = 0; i < n; ++i)
+        inv_unref(inv_ref(obj, "for benchmark"), "for benchmark"); 
+}
+
+static KIND kinds[] = {
+    {"CLIENT", create_client, destroy_client, pair_client},
+    {"PLAYER", create_player, destroy_player, pair_player},
+    {"GAME", create_game, destroy_game, pair_game},
+    {"INVITATION", create_inv, destroy_inv, pair_inv}
+}; 
+
+static KIND *kind; 
+static void *objs[MAX_THREADS]; 
+static pthread_barrier_t barrier; 
+
+static double now(void) {
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts); 
+    return ts.tv_sec + ts.tv_nsec / 1e9; 
+}
+
+static void *worker(void *arg) {
+    void *obj = arg; 
+    pthread_barrier_wait(&barrier); 
+    kind->pair(obj, PAIRS / nthreads); 
+    pthread_barrier_wait(&barrier); 
+    return NULL; 
+}
+
+/*
+ * Run the threads and return the elapsed time per pair, in nanoseconds,
+ * over all the pairs made by all the threads.
+ */
+static double run(int shared) {
+    pthread_t tids[nthreads]; 
+    for(int i = 0; i < nthreads; ++i)
+        pthread_create(&tids[i], NULL, worker, objs[shared ? 0 : i]); 
+    pthread_barrier_wait(&barrier); 
+    double start = now(); 
+    pthread_barrier_wait(&barrier); 
+    double elapsed = now() - start; 
+    for(int i = 0; i < nthreads; ++i)
+        pthread_join(tids[i], NULL); 
+    return elapsed / (PAIRS / nthreads * nthreads) * 1e9; 
+}
+
+int main(int argc, char *argv[]) {
+    if(argc > 1)
+        nthreads = atoi(argv[1]); 
+    if(nthreads < 1 || nthreads > MAX_THREADS)
+        nthreads = 4; 
+    pthread_barrier_init(&barrier, NULL, nthreads + 1); 
+    printf("%-12s %12s %12s %12s   (ns per ref/unref pair, %d threads)\n",
+        "", "1 thread", "private", "shared", nthreads); 
+    for(size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); ++k) {
+        kind = &kinds[k]; 
+        for(int i = 0; i < nthreads; ++i)
+            objs[i] = kind->create(); 
+        double start = now(); 
+        kind->pair(objs[0], PAIRS); 
+        double single = (now() - start) / PAIRS * 1e9; 
+        double private = run(0); 
+        double shared = run(1); 
+        printf("%-12s %12.2f %12.2f %12.2f\n", kind->name, single, private, shared); 
+        for(int i = 0; i < nthreads; ++i)
+            kind->destroy(objs[i]); 
+    }
+    return EXIT_SUCCESS; 
+}
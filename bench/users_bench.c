@@ -0,0 +1,90 @@
+/*
+ * Cost of USERS queries as the population grows.
+ *
+ * Usage: users_bench [<page size>] [<max players>]
+ *
+ * For each population size (a power of ten up to the maximum), that many
+ * clients are logged in to a fresh registry, and then pages of players
+ * are fetched with creg_find_players(), by prefix and by offset, as a
+ * USERS query does, and the whole list with creg_all_players(), as the
+ * cached list does when it is rebuilt.  The time per page should stay
+ * about flat as the population grows, while that for the whole list grows
+ * with it.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "client_registry.h"
+#include "client_registry_ext.h"
+#include "player_registry.h"
+#include "jeux_globals.h"
+
+#define PAGES 20000
+#define LISTS 20
+
+static long pagesize = 20; 
+static long maxplayers = 100000; 
+
+static double now(void) {
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts); 
+    return ts.tv_sec + ts.tv_nsec / 1e9; 
+}
+
+static void discard(PLAYER **players) {
+    for(PLAYER **pp = players; *pp; ++pp)
+        player_unref(*pp, "for reference discarded by benchmark"); 
+    free(players); 
+}
+
+int main(int argc, char *argv[]) {
+    char name[32]; 
+    if(argc > 1)
+        pagesize = atol(argv[1]); 
+    if(argc > 2)
+        maxplayers = atol(argv[2]); 
+    unsigned int seed = 1; 
+    printf("%-12s %14s %14s %14s\n", "players", "prefix us", "offset us", "all us"); 
+    for(long population = 1000; population <= maxplayers; population *= 10) {
+        client_registry = creg_init(); 
+        player_registry = preg_init(); 
+        CLIENT **clients = (CLIENT **)malloc(population * sizeof(CLIENT *)); 
+        for(long i = 0; i < population; ++i) {
+            // The descriptors are never used for I/O.
+            clients[i] = creg_register(client_registry, (int)i + 3); 
+            snprintf(name, sizeof(name), "player%ld", i); 
+            PLAYER *player = preg_register(player_registry, name); 
+            client_login(clients[i], player); 
+            player_unref(player, "for reference discarded by benchmark"); 
+        }
+
+        double start = now(); 
+        for(int i = 0; i < PAGES; ++i) {
+            snprintf(name, sizeof(name), "player%ld", (long)rand_r(&seed) % population); 
+            discard(creg_find_players(client_registry, name, 0, pagesize)); 
+        }
+        double prefix = (now() - start) / PAGES * 1e6; 
+
+        start = now(); 
+        for(int i = 0; i < PAGES; ++i)
+            discard(creg_find_players(client_registry, "player",
+                (size_t)rand_r(&seed) % population, pagesize)); 
+        double offset = (now() - start) / PAGES * 1e6; 
+
+        start = now(); 
+        for(int i = 0; i < LISTS; ++i)
+            discard(creg_all_players(client_registry)); 
+        double all = (now() - start) / LISTS * 1e6; 
+
+        printf("%-12ld %14.2f %14.2f %14.2f\n", population, prefix, offset, all); 
+        for(long i = 0; i < population; ++i) {
+            client_logout(clients[i]); 
+            creg_unregister(client_registry, clients[i]); 
+        }
+        free(clients); 
+        preg_fini(player_registry); 
+        creg_fini(client_registry); 
+    }
+    return EXIT_SUCCESS; 
+}
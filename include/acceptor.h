@@ -0,0 +1,32 @@
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+/*
+ * Multiple acceptor threads, each with a listening socket of its own.
+ * The sockets are all bound to the same port with SO_REUSEPORT, so the
+ * kernel spreads incoming connections across them (and so across cores)
+ * instead of funnelling them through a single accept queue and thread.
+ * Each acceptor sleeps until its socket is readable and then drains the
+ * accept queue with non-blocking accept4() calls, up to a batch at a
+ * time, before handing the connections over.
+ */
+
+/*
+ * Open the listening sockets and start the acceptor threads.
+ *
+ * @param port  The port on which to listen.
+ * @param nacceptors  The number of acceptors to start.
+ * @param handoff  The function to which each accepted connection is
+ * handed, on the acceptor's thread.  It takes over the descriptor.
+ * @return 0 if all of the acceptors were started, otherwise -1, in which
+ * case any that were started have been stopped.
+ */
+int acc_start(char *port, int nacceptors, void (*handoff)(int fd));
+
+/*
+ * Stop accepting connections.  The listening sockets are shut down and
+ * the acceptor threads exit.
+ */
+void acc_stop(void);
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef CLIENT_EXT_H
+#define CLIENT_EXT_H
+
+#include "client.h"
+
+/*
+ * Packets sent with client_send_packet() are appended to a per-client
+ * output queue.  Normally the queue is written out at once, but while the
+ * calling thread has output corked, packets for every client it sends to
+ * are held back and written out together, with a single system call per
+ * client, when the thread uncorks.  The server corks around the handling
+ * of each request, so that e.g. the RESIGNED and ENDED notifications to
+ * an opponent leave in one segment rather than one per packet.
+ *
+ * Corking nests; output is only written out by the outermost uncork.
+ */
+void client_cork(void);
+
+/*
+ * Undo one call to client_cork(), writing out held back packets if
+ * this was the outermost one.
+ */
+void client_uncork(void);
+
+/*
+ * Attach a client to the I/O context that services its connection.  Once
+ * attached, sending a packet to the client never writes to its socket:
+ * the packet is queued and the wakeup function is called (with the
+ * client's mutex held, and at most once until the next call to
+ * client_flush_output()) to tell the owner that there is output.  The
+ * owner then writes the queue out itself, so a thread notifying an
+ * opponent never blocks on that opponent's socket.
+ *
+ * Passing a NULL wakeup function detaches the client for good: queued
+ * output is dropped and later packets are discarded.  This is done just
+ * before the connection is closed.  A client that was never attached
+ * has its output written out synchronously by the sender.
+ *
+ * @param client  The client to attach.
+ * @param wakeup  The function to call when output is queued, or NULL.
+ * @param arg  The argument to pass to the wakeup function.
+ */
+void client_set_wakeup(CLIENT *client, void (*wakeup)(void *), void *arg);
+
+/*
+ * Write out as much of a client's queued output as its socket will take
+ * without blocking.  This is to be called by the owner of the connection
+ * in response to a wakeup, or when its socket becomes writable.
+ *
+ * @param client  The client whose output is to be written.
+ * @return  1 if output remains queued and the caller should wait for the
+ * socket to become writable, 0 if all output has been written, or -1 if
+ * the connection has failed.
+ */
+int client_flush_output(CLIENT *client);
+
+/*
+ * Send an ACK whose payload is owned by someone else, without copying it
+ * into the client's output queue up front.  The payload is fed into the
+ * queue a chunk at a time (see JEUX_CHUNK_PKT) as the queue drains, so
+ * that however large it is, it takes little memory per client and many
+ * clients can be sent the same buffer.  A part is only fed in once
+ * everything queued before it has been written out, and the part being
+ * written does not count against the client's budget (see below).
+ * Responses sent to the client before the payload has been fed in,
+ * including other streamed ones, wait behind it, so that responses are
+ * never reordered and the stream keeps its pace.
+ *
+ * @param client  The client.
+ * @param data  The payload, which must stay valid until it is released.
+ * @param datalen  The length of the payload.
+ * @param release  Called (with the client's mutex held) once the payload
+ * is no longer needed.  It takes over the caller's reference to the
+ * payload.
+ * @return 0 if the response was queued, -1 if the connection has failed.
+ */
+int client_stream_ack(CLIENT *client, char *data, size_t datalen, void (*release)(char *));
+
+/*
+ * Accept an invitation, as client_accept_invitation() does, but render
+ * the initial game state for the accepting client's ACK into a
+ * caller-provided buffer instead of a malloc'ed string.
+ *
+ * @param client  The CLIENT that is the target of the INVITATION to be
+ * accepted.
+ * @param id  The ID assigned by the target to the INVITATION.
+ * @param buf  A buffer of at least GAME_STATE_BUFSIZE bytes (see
+ * game_ext.h), into which the initial game state is rendered if the
+ * accepting client is the first player to move.
+ * @return the length of the state in buf, or 0 if the accepting client
+ * is not the first player to move, if the INVITATION is successfully
+ * accepted, otherwise -1.
+ */
+int client_accept_invitation_into(CLIENT *client, int id, char *buf);
+
+/*
+ * Switch a client to 32-bit invitation IDs (see JEUX_EXTIDS_PKT), so
+ * that it can have far more than 256 invitations at once.  This is only
+ * possible while the client is not logged in.
+ *
+ * @param client  The client.
+ * @return 0 if the client uses extended IDs, -1 if it is logged in.
+ */
+int client_use_extended_ids(CLIENT *client);
+
+/*
+ * Determine whether a client uses 32-bit invitation IDs.
+ *
+ * @param client  The client.
+ * @return nonzero if it does, otherwise zero.
+ */
+int client_has_extended_ids(CLIENT *client);
+
+/*
+ * Subscribe a logged in client to presence notifications (see
+ * presence.h).  On success, the ACK carrying the baseline list of players
+ * has been sent to the client.
+ *
+ * @param client  The client.
+ * @return 0 if the client was subscribed, -1 if it is not logged in or
+ * is subscribed already.
+ */
+int client_subscribe(CLIENT *client);
+
+/*
+ * Unsubscribe a client from presence notifications.  This is done
+ * automatically when the client logs out.
+ *
+ * @param client  The client.
+ * @return 0 if the client was unsubscribed, -1 if it was not subscribed.
+ */
+int client_unsubscribe(CLIENT *client);
+
+/*
+ * Limits on how far an attached client may fall behind: the number of
+ * bytes and the number of packets waiting in its output queue, counting
+ * responses waiting behind a streamed one but not the part of the stream
+ * being written.  Zero means no limit.  When a packet takes a client over either limit,
+ * queued MOVED notifications that a later one for the same game makes
+ * redundant are dropped.  If the client is still over the limit, it is
+ * evicted: its output is discarded and its connection is shut down, so
+ * that the session ends (and the client is logged out) as if the client
+ * had disconnected.
+ */
+#define CLIENT_OBUF_BUDGET (1 << 20)
+#define CLIENT_OPKT_BUDGET 8192
+
+extern size_t client_obuf_budget;
+extern size_t client_opkt_budget;
+
+/*
+ * Counters describing the output queue of a client.
+ */
+typedef struct client_output_stats {
+    size_t queued_bytes;    // Bytes waiting to be written.
+    size_t queued_packets;  // Packets not yet written in full.
+    size_t peak_bytes;      // Most bytes ever waiting.
+    size_t peak_packets;    // Most packets ever waiting.
+    size_t dropped;         // Notifications dropped as redundant.
+    int evicted;            // Nonzero if the client was evicted.
+} CLIENT_OUTPUT_STATS;
+
+/*
+ * Get a snapshot of the counters for a client's output queue.
+ *
+ * @param client  The client.
+ * @param stats  Caller-supplied storage for the counters.
+ */
+void client_get_output_stats(CLIENT *client, CLIENT_OUTPUT_STATS *stats);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef CLIENT_REGISTRY_EXT_H
+#define CLIENT_REGISTRY_EXT_H
+
+#include <stddef.h>
+
+#include "client_registry.h"
+
+/*
+ * The registry is not limited to MAX_CLIENTS.  Clients are spread over
+ * CREG_SHARDS shards by file descriptor, each shard with a lock of its
+ * own and a table, indexed by descriptor, that grows as needed, so that
+ * registering and unregistering a client takes constant time and clients
+ * on different shards never contend.  Since a client is unregistered
+ * before its descriptor is closed, no two registered clients share a
+ * descriptor.
+ */
+#define CREG_SHARDS 16
+
+/*
+ * The most clients that may be registered at once, or 0 for no limit
+ * (other than the number of descriptors the process may have open).
+ * Registration fails once the limit has been reached.
+ */
+extern size_t creg_client_limit;
+
+/*
+ * Logged in clients are also indexed by username, in a hash table split
+ * into lock stripes, so that creg_lookup() takes constant time and only
+ * locks the stripe the name falls in.  The index is maintained by
+ * client_login() and client_logout(), which bind a client to the name
+ * of its player and unbind it again.
+ */
+
+/*
+ * Bind a username to a client.  This fails if the name is already bound,
+ * which makes binding the test of whether a player is logged in.  The
+ * name is not copied: it must stay valid until it is unbound.
+ *
+ * @param cr  The client registry.
+ * @param user  The username.
+ * @param client  The client logged in under the name.
+ * @return 0 if the name was bound, -1 if it was already bound.
+ */
+int creg_bind_name(CLIENT_REGISTRY *cr, char *user, CLIENT *client);
+
+/*
+ * Unbind a username from a client.  Nothing happens unless the name is
+ * bound to that client.
+ *
+ * @param cr  The client registry.
+ * @param user  The username.
+ * @param client  The client to which the name is bound.
+ */
+void creg_unbind_name(CLIENT_REGISTRY *cr, char *user, CLIENT *client);
+
+/*
+ * The bound names are also kept in a sorted index, a balanced search
+ * tree in which each node knows the size of its subtree, so that a page
+ * of the names with a given prefix can be found without looking at the
+ * others.  The index is behind a reader-writer lock: binding and
+ * unbinding take it exclusively and lookups share it.
+ */
+
+/*
+ * Return a page of the logged in players whose names start with a prefix,
+ * in order of name.  The cost grows with the logarithm of the number of
+ * players logged in and with the size of the page, but not with the
+ * number of players that match.  As with creg_all_players(), the result
+ * is a malloc'ed, NULL-terminated array of PLAYER pointers, each of which
+ * the caller must unref before freeing the array.
+ *
+ * @param cr  The client registry.
+ * @param prefix  The prefix, which may be empty to match every name.
+ * @param offset  The number of matching players to pass over.
+ * @param limit  The most players to return, or 0 for no limit.
+ * @return the players, as a NULL-terminated array of pointers.
+ */
+PLAYER **creg_find_players(CLIENT_REGISTRY *cr, char *prefix, size_t offset, size_t limit);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+/*
+ * Event-driven alternative to running one service thread per connection.
+ * A small, fixed set of loop threads each own an epoll instance.  Accepted
+ * connections are made non-blocking and handed to one of the loops, which
+ * reassembles packets incrementally as data arrives and dispatches each
+ * complete packet through jeux_client_dispatch().  A connection is only
+ * ever read by the loop that owns it, so requests from the same client are
+ * still handled one at a time and in order.  Output for a connection is
+ * likewise only ever written by its loop, without blocking: packets sent
+ * to the client from elsewhere are queued and the loop is woken up to
+ * write them out when the socket has room.
+ */
+
+/*
+ * Start the event loop threads.  This must be called once, before any
+ * connection is handed over with evl_add().
+ *
+ * @param nloops  The number of loop threads to start.  If zero, one loop
+ * per online processor is started.
+ * @return 0 if the loops were started, otherwise -1.
+ */
+int evl_init(int nloops);
+
+/*
+ * Hand a newly accepted connection over to one of the event loops.
+ * A CLIENT is registered for the connection and the loop takes over
+ * responsibility for closing the file descriptor.
+ *
+ * @param fd  The file descriptor of the accepted connection.
+ * @return 0 if the connection was handed over, otherwise -1, in which
+ * case the file descriptor has been closed.
+ */
+int evl_add(int fd);
+
+#endif
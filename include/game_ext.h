@@ -0,0 +1,77 @@
+#ifndef GAME_EXT_H
+#define GAME_EXT_H
+
+#include <stddef.h>
+
+#include "game.h"
+
+/*
+ * Variants of the game functions that work in caller-provided storage,
+ * so that a move can be parsed, applied and rendered without touching
+ * the heap.  GAME_MOVE is defined here so that callers can keep one on
+ * the stack; it is still to be treated as immutable once parsed.
+ */
+
+struct game_move {
+    GAME_ROLE role;
+    int pos;
+};
+
+/*
+ * Size of a buffer that is large enough for any rendered game state,
+ * including the terminating NUL.
+ */
+#define GAME_STATE_BUFSIZE 48
+
+/*
+ * Size of a buffer that is large enough for any rendered move,
+ * including the terminating NUL.
+ */
+#define GAME_MOVE_BUFSIZE 8
+
+/*
+ * Parse a move into caller-provided storage.  This has the same
+ * contract as game_parse_move().
+ *
+ * @param game  The game in which the move is to be made.
+ * @param role  The role of the player making the move.
+ * @param str  The string to be parsed.
+ * @param move  Storage into which to parse the move.
+ * @return 0 if the move was parsed, otherwise -1.
+ */
+int game_parse_move_into(GAME *game, GAME_ROLE role, char *str, GAME_MOVE *move);
+
+/*
+ * Suggest a move for a player, one that does best against best play
+ * from then on: if the player can force a win, the move keeps the win,
+ * and otherwise, if a draw can be forced, it keeps the draw.
+ *
+ * @param game  The game in which the move is to be made.
+ * @param role  The role of the player to make the move.
+ * @param move  Storage into which to put the move.
+ * @return 0 if a move was suggested, or -1 if the game is over or it is
+ * not the player's turn.
+ */
+int game_suggest_move(GAME *game, GAME_ROLE role, GAME_MOVE *move);
+
+/*
+ * Render the state of a game into a caller-provided buffer.  The result
+ * is the same string that game_unparse_state() returns.
+ *
+ * @param game  The game whose state is to be rendered.
+ * @param buf  The buffer, of at least GAME_STATE_BUFSIZE bytes.
+ * @return  The length of the rendered state, not counting the NUL.
+ */
+size_t game_unparse_state_into(GAME *game, char *buf);
+
+/*
+ * Render a move into a caller-provided buffer.  The result is the same
+ * string that game_unparse_move() returns.
+ *
+ * @param move  The move to be rendered.
+ * @param buf  The buffer, of at least GAME_MOVE_BUFSIZE bytes.
+ * @return  The buffer.
+ */
+char *game_unparse_move_into(GAME_MOVE *move, char *buf);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef INVITATION_EXT_H
+#define INVITATION_EXT_H
+
+#include "invitation.h"
+
+/*
+ * An invitation records the ID it has in the list of each of its two
+ * clients, so that either side can find the ID by which the other knows
+ * it (to address a notification) without searching the other's list.
+ * The IDs are maintained by client_add_invitation() and
+ * client_remove_invitation().
+ */
+
+/*
+ * Set the ID of an invitation in a client's list.
+ *
+ * @param inv  The invitation.
+ * @param client  The source or the target of the invitation.
+ * @param id  The ID, or -1 once the invitation is no longer in the list.
+ */
+void inv_set_id(INVITATION *inv, CLIENT *client, int id);
+
+/*
+ * Get the ID of an invitation in a client's list.
+ *
+ * @param inv  The invitation.
+ * @param client  The source or the target of the invitation.
+ * @return  The ID, or -1 if the invitation is not in the client's list
+ * (or the client is neither the source nor the target).
+ */
+int inv_get_id(INVITATION *inv, CLIENT *client);
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef OBJ_POOL_H
+#define OBJ_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Pools of fixed-size objects, for the structures that are created and
+ * freed at a high rate (a game lasts seconds).
+ *
+ * An object freed to its pool keeps whatever its init function set up,
+ * in particular its mutex, so that taking it out again costs neither an
+ * allocation nor a mutex initialization; the owner only resets the other
+ * fields.  Each thread keeps a small cache of free objects per pool, so
+ * that an object freed by the thread that allocated it is normally reused
+ * without taking any lock, and a cache that grows too large hands half of
+ * its objects back to a shared depot.  Objects that find the depot full
+ * are finalized and freed.  The payload pool (payload_pool.h) is built
+ * from one of these pools per size class.
+ */
+
+/*
+ * Pool counters, summed over all threads.
+ */
+typedef struct opool_stats {
+    unsigned long allocs;       // Calls to opool_alloc().
+    unsigned long frees;        // Calls to opool_free().
+    unsigned long cache_hits;   // Allocations served from a thread cache.
+    unsigned long depot_hits;   // Allocations served from the depot.
+    unsigned long mallocs;      // Objects created (and initialized).
+    unsigned long destroys;     // Objects finalized and freed.
+    unsigned long releases;     // Objects given up by thread caches.
+    unsigned long in_use;       // Objects allocated and not yet freed.
+    unsigned long idle;         // Free objects held by caches and the depot.
+} OPOOL_STATS;
+
+typedef struct opool_hdr OPOOL_HDR;
+typedef struct opool_cache OPOOL_CACHE;
+
+/*
+ * A pool.  Pools are defined statically with OPOOL_INITIALIZER; the
+ * fields other than those given to it are private.
+ */
+typedef struct obj_pool {
+    char *name;
+    size_t size;
+    void (*init)(void *obj);
+    void (*fini)(void *obj);
+    int cache_max;
+    int depot_max;
+    int index;
+    pthread_mutex_t mutex;
+    OPOOL_HDR *depot;
+    int ndepot;
+    OPOOL_CACHE *caches;
+    OPOOL_STATS retired;
+} OBJ_POOL;
+
+/*
+ * Initializer for a pool.
+ *
+ * @param name  Name of the pool, for statistics.
+ * @param size  Size of the objects.
+ * @param init  Function called on an object when it is first created, or
+ * NULL.
+ * @param fini  Function called on an object before it is finally freed,
+ * or NULL.
+ */
+#define OPOOL_INITIALIZER(name, size, init, fini) \
+    OPOOL_LIMITED_INITIALIZER(name, size, init, fini, 0, 0)
+
+/*
+ * Initializer for a pool with its own limits on the number of free
+ * objects, for pools of large objects.
+ *
+ * @param cache_max  Most free objects kept by each thread, or 0 for the
+ * default.
+ * @param depot_max  Most free objects kept in the depot, or 0 for the
+ * default.
+ */
+#define OPOOL_LIMITED_INITIALIZER(name, size, init, fini, cache_max, depot_max) \
+    {(name), (size), (init), (fini), (cache_max), (depot_max), -1, PTHREAD_MUTEX_INITIALIZER}
+
+/*
+ * The pools of the server's shared objects.  Their objects are handed
+ * out by client_create(), inv_create() and game_create(), and go back
+ * when the last reference is released.
+ */
+extern OBJ_POOL client_pool;
+extern OBJ_POOL inv_pool;
+extern OBJ_POOL game_pool;
+
+/*
+ * Take an object from a pool.
+ *
+ * @param pool  The pool.
+ * @return  An object, initialized by the pool's init function when it was
+ * created, but otherwise left as it was when it was last freed.
+ */
+void *opool_alloc(OBJ_POOL *pool);
+
+/*
+ * Give an object obtained from opool_alloc() back to its pool.
+ *
+ * @param pool  The pool.
+ * @param obj  The object.
+ */
+void opool_free(OBJ_POOL *pool, void *obj);
+
+/*
+ * Get a snapshot of a pool's counters.  Counters of threads that are
+ * still running may be slightly behind.
+ *
+ * @param pool  The pool.
+ * @param stats  Caller-supplied storage for the counters.
+ */
+void opool_get_stats(OBJ_POOL *pool, OPOOL_STATS *stats);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef PAYLOAD_POOL_H
+#define PAYLOAD_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Pool of buffers for packet payloads.
+ *
+ * Buffers come in a few size classes, large enough for any payload (at most
+ * 65535 bytes) plus a terminating NUL.  Each thread keeps a small cache of
+ * free buffers per class, so that a buffer freed by the thread that
+ * allocated it is normally reused without taking any lock.  A cache that
+ * grows too large hands half of its buffers back to a shared depot, from
+ * which empty caches are refilled before falling back to malloc().
+ *
+ * Payloads are handed to request handlers in a pooled buffer and given
+ * back with ppool_free() by whoever received the packet, once the handler
+ * has returned.
+ */
+
+/*
+ * Get a buffer with room for a payload of the specified size and a
+ * terminating NUL.
+ *
+ * @param size  The size of the payload, at most 65535.
+ * @return  A buffer of at least size+1 bytes.
+ */
+void *ppool_alloc(size_t size);
+
+/*
+ * Give a buffer obtained from ppool_alloc() back to the pool.
+ *
+ * @param buf  The buffer, or NULL.
+ */
+void ppool_free(void *buf);
+
+/*
+ * Allocator counters, summed over all threads.
+ */
+typedef struct ppool_stats {
+    unsigned long allocs;       // Calls to ppool_alloc().
+    unsigned long frees;        // Calls to ppool_free() with a buffer.
+    unsigned long cache_hits;   // Allocations served from a thread cache.
+    unsigned long depot_hits;   // Allocations served from the depot.
+    unsigned long mallocs;      // Allocations that had to call malloc().
+    unsigned long releases;     // Buffers handed back to the depot.
+} PPOOL_STATS;
+
+/*
+ * Get a snapshot of the allocator counters.  Counters of threads that are
+ * still running may be slightly behind.
+ *
+ * @param stats  Caller-supplied storage for the counters.
+ */
+void ppool_get_stats(PPOOL_STATS *stats);
+
+#endif
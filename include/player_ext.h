@@ -0,0 +1,27 @@
+#ifndef PLAYER_EXT_H
+#define PLAYER_EXT_H
+
+#include "player.h"
+
+/*
+ * Mark a player as online (logged in on some client) or offline.  The
+ * flag is changed with a single atomic compare-and-swap, so that of two
+ * clients trying to log in as the same player at once, exactly one
+ * succeeds, without any lock shared between players.
+ *
+ * @param player  The player.
+ * @param online  Nonzero to mark the player online, zero for offline.
+ * @return 0 if the flag was changed, -1 if the player was already in
+ * the requested state.
+ */
+int player_set_online(PLAYER *player, int online);
+
+/*
+ * Test whether a player is online.
+ *
+ * @param player  The player.
+ * @return nonzero if the player is online, otherwise zero.
+ */
+int player_is_online(PLAYER *player);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include "client_registry.h"
+
+/*
+ * Presence notifications: the clients that have sent SUBSCRIBE are told
+ * (with ONLINE, OFFLINE and RATING packets) whenever a player logs in or
+ * out or has a rating change.  Notifications are published by the thread
+ * that makes the change, which queues them for every subscriber, so the
+ * changes to one player reach a subscriber in the order in which they
+ * were made.  Publishing threads share a read lock and run in parallel;
+ * subscribing takes the lock exclusively, so that no notification is
+ * queued between a subscriber's baseline and its being subscribed.
+ *
+ * A change must be made visible (and the USERS list invalidated) before
+ * it is published, and no client mutex may be held while publishing.
+ */
+
+/*
+ * Add a client to the subscribers and send it the ACK carrying the
+ * baseline list of players.
+ *
+ * @param client  The client, which must not already be subscribed.
+ */
+void pres_subscribe(CLIENT *client);
+
+/*
+ * Remove a client from the subscribers.
+ *
+ * @param client  The client, which must be subscribed.
+ */
+void pres_unsubscribe(CLIENT *client);
+
+/*
+ * Tell the subscribers that a player has logged in.
+ */
+void pres_online(PLAYER *player);
+
+/*
+ * Tell the subscribers that a player has logged out.
+ */
+void pres_offline(PLAYER *player);
+
+/*
+ * Tell the subscribers that a player's rating has changed.
+ */
+void pres_rating(PLAYER *player);
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef PROTO_URING_H
+#define PROTO_URING_H
+
+#include <sys/uio.h>
+
+#include "protocol.h"
+
+/*
+ * io_uring backend for sending and receiving packets.
+ *
+ * Receiving uses one ring per connection with a multishot receive into a
+ * ring of provided buffers, so the kernel keeps filling buffers as data
+ * arrives and packets that are already buffered are handed out without any
+ * further system calls.  Sending uses one ring per thread and submits the
+ * header and the payload as a pair of linked sends, completed with a single
+ * io_uring_enter() call.
+ *
+ * The backend is only used if proto_uring_init() has succeeded; otherwise
+ * the blocking proto_send_packet()/proto_recv_packet() path is used.
+ */
+
+/*
+ * Nonzero if the io_uring backend has been selected and is usable.
+ */
+extern int proto_uring_enabled;
+
+/*
+ * Probe the kernel for the io_uring features that the backend relies on
+ * and, if they are present, enable the backend.
+ *
+ * @return 0 if the backend was enabled, otherwise -1.
+ */
+int proto_uring_init(void);
+
+/*
+ * The PROTO_URING type holds the receive state for one connection.
+ */
+typedef struct proto_uring PROTO_URING;
+
+/*
+ * Create the receive state for a connection.
+ *
+ * @param fd  The file descriptor of the connection.
+ * @return  The receive state, or NULL if it could not be created.
+ */
+PROTO_URING *proto_uring_create(int fd);
+
+/*
+ * Free the receive state for a connection.  The file descriptor is
+ * not closed.
+ *
+ * @param pu  The receive state to be freed.
+ */
+void proto_uring_destroy(PROTO_URING *pu);
+
+/*
+ * Receive a packet, blocking until one is available.  This has the same
+ * contract as proto_recv_packet(), except that the payload is a pooled
+ * buffer, followed by a NUL byte, to be given back with ppool_free().
+ *
+ * @param pu  The receive state of the connection.
+ * @param hdr  Pointer to caller-supplied storage for the packet header.
+ * @param payloadp  Pointer to a variable into which to store a pointer
+ * to any payload received, which the caller is responsible for freeing.
+ * It is set even if -1 is returned.
+ * @return  0 in case of successful reception, -1 otherwise.
+ */
+int proto_uring_recv_packet(PROTO_URING *pu, JEUX_PACKET_HEADER *hdr, void **payloadp);
+
+/*
+ * Have a connection's ring also watch a descriptor (an eventfd) that is
+ * used to wake up the thread servicing the connection.  Once this has
+ * become readable, proto_uring_recv_packet() returns -1 with errno set
+ * to EINTR instead of waiting for the next packet.  The caller is
+ * responsible for reading the descriptor to reset it.
+ *
+ * @param pu  The receive state of the connection.
+ * @param fd  The descriptor to watch.
+ */
+void proto_uring_set_wakefd(PROTO_URING *pu, int fd);
+
+/*
+ * Send the contents of a vector of buffers using the calling thread's
+ * ring.  This has the same contract as proto_sendv().
+ *
+ * @param fd  The file descriptor on which the data is to be sent.
+ * @param iov  The buffers to be sent, in order.  The array is modified.
+ * @param iovcnt  The number of buffers.
+ * @return  0 if everything was sent, otherwise -1 with errno set.
+ */
+int proto_uring_sendv(int fd, struct iovec *iov, int iovcnt);
+
+/*
+ * Send a packet using the calling thread's ring.  This has the same
+ * contract as proto_send_packet().
+ *
+ * @param fd  The file descriptor on which the packet is to be sent.
+ * @param hdr  The packet header, with multi-byte fields in network byte order.
+ * @param data  The payload, or NULL, if there is none.
+ * @return  0 in case of successful transmission, -1 otherwise.
+ */
+int proto_uring_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data);
+
+#endif
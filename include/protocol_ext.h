@@ -0,0 +1,195 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+
+/*
+ * USERS with a payload is a query for a page of the logged in players,
+ * those whose names start with a prefix, in order of name.  The payload
+ * is "<prefix>[\t<offset>[\t<limit>]]": the prefix, which may be empty,
+ * optionally followed by the number of matching players to pass over and
+ * then by the most to return (0, the default, for no limit), in decimal.
+ * The ACK carries the page, in the same format as the response to USERS
+ * without a payload.  A malformed query is NACKed.
+ */
+
+/*
+ * Packet types beyond those of the base protocol.
+ *
+ * A logged in client sends SUBSCRIBE to be told of changes in the set of
+ * logged in players, instead of polling with USERS.  The ACK carries the
+ * same list as the response to USERS, as a baseline, and from then on the
+ * client is sent a notification for each change: ONLINE ("<name>\t<rating>")
+ * when a player logs in, OFFLINE ("<name>") when a player logs out, and
+ * RATING ("<name>\t<rating>") when a player's rating changes.  Each of
+ * these states the player's new situation rather than a difference, so a
+ * notification for a change that the baseline already reflects is harmless.
+ * UNSUBSCRIBE (or logging out) stops the notifications.
+ */
+enum {
+    /* Client-to-server */
+    JEUX_SUBSCRIBE_PKT = JEUX_ENDED_PKT + 1,
+    JEUX_UNSUBSCRIBE_PKT,
+    /* Server-to-client notifications (asynchronous) */
+    JEUX_ONLINE_PKT,
+    JEUX_OFFLINE_PKT,
+    JEUX_RATING_PKT,
+    /* Server-to-client responses (synchronous) */
+    JEUX_CHUNK_PKT,
+    /* Client-to-server */
+    JEUX_EXTIDS_PKT
+};
+
+/*
+ * A response whose payload does not fit in one packet (size is only 16
+ * bits) is sent as a series of CHUNK packets, each carrying the next
+ * JEUX_CHUNK_MAX bytes of the payload, followed by the ACK carrying the
+ * rest.  The client reassembles the payload by concatenating the chunks
+ * and the ACK's payload.  Notifications may arrive between the packets of
+ * a response, but the packets of one response are never interleaved with
+ * those of another.  Notifications are never split: one whose payload
+ * would be longer than JEUX_CHUNK_MAX is cut at that size.
+ */
+#define JEUX_CHUNK_MAX 65535
+
+/*
+ * Invitation IDs are normally 8 bits wide, the width of the id field of
+ * the header.  A client that needs more (a bot playing many games at
+ * once) sends EXTIDS before logging in.  If it is ACKed, every invitation
+ * ID to and from that connection is 32 bits wide from then on, with the
+ * upper bits carried in what is padding in the base header: bits 8-15 in
+ * byte 3, and bits 16-31 in bytes 6 and 7, in network byte order.  IDs
+ * given out in this mode are below 2^31.  EXTIDS is NACKed once the
+ * client has logged in.
+ */
+#define JEUX_ID_MID_BYTE 3
+#define JEUX_ID_HIGH_BYTE 6
+
+_Static_assert(offsetof(JEUX_PACKET_HEADER, size) == JEUX_ID_MID_BYTE + 1 &&
+    offsetof(JEUX_PACKET_HEADER, timestamp_sec) == JEUX_ID_HIGH_BYTE + 2,
+    "the upper bits of extended IDs must lie in the header's padding");
+
+/*
+ * Get the invitation ID from a packet header.
+ *
+ * @param hdr  The header.
+ * @param extended  Nonzero if the connection uses 32-bit IDs.
+ * @return  The ID.
+ */
+static inline uint32_t proto_get_id(JEUX_PACKET_HEADER *hdr, int extended) {
+    unsigned char *bytes = (unsigned char *)hdr;
+    if(!extended)
+        return hdr->id;
+    return (uint32_t)bytes[JEUX_ID_HIGH_BYTE] << 24 | (uint32_t)bytes[JEUX_ID_HIGH_BYTE + 1] << 16 |
+        (uint32_t)bytes[JEUX_ID_MID_BYTE] << 8 | hdr->id;
+}
+
+/*
+ * Store an invitation ID in a packet header.
+ *
+ * @param hdr  The header.
+ * @param id  The ID.
+ * @param extended  Nonzero if the connection uses 32-bit IDs, otherwise
+ * only the low 8 bits are stored.
+ */
+static inline void proto_set_id(JEUX_PACKET_HEADER *hdr, uint32_t id, int extended) {
+    unsigned char *bytes = (unsigned char *)hdr;
+    hdr->id = (uint8_t)id;
+    if(extended) {
+        bytes[JEUX_ID_MID_BYTE] = (uint8_t)(id >> 8);
+        bytes[JEUX_ID_HIGH_BYTE] = (uint8_t)(id >> 24);
+        bytes[JEUX_ID_HIGH_BYTE + 1] = (uint8_t)(id >> 16);
+    }
+}
+
+/*
+ * Print a packet trace line to stderr in debug builds.
+ *
+ * @param dir  Direction marker ("=>" for sent, "<=" for received).
+ * @param hdr  The packet header, with multi-byte fields in network byte order.
+ * @param data  The payload, or NULL, if there is none.
+ */
+#ifdef DEBUG
+void proto_debug_packet(char *dir, JEUX_PACKET_HEADER *hdr, void *data);
+#else
+#define proto_debug_packet(dir, hdr, data)
+#endif
+
+/*
+ * Send the contents of a vector of buffers with as few system calls as
+ * the socket allows, retrying after short writes and waiting for the
+ * send buffer to drain if the descriptor is non-blocking.
+ *
+ * @param fd  The file descriptor on which the data is to be sent.
+ * @param iov  The buffers to be sent, in order.  The array is modified.
+ * @param iovcnt  The number of buffers.
+ * @return  0 if everything was sent, otherwise -1 with errno set.
+ */
+int proto_sendv(int fd, struct iovec *iov, int iovcnt);
+
+/*
+ * Send as much of the contents of a vector of buffers as the socket will
+ * take right now, without blocking.
+ *
+ * @param fd  The file descriptor on which the data is to be sent.
+ * @param iov  The buffers to be sent, in order.
+ * @param iovcnt  The number of buffers.
+ * @return  The number of bytes sent, which is zero if the send buffer
+ * is full, or -1 if the connection has failed.
+ */
+ssize_t proto_trysendv(int fd, struct iovec *iov, int iovcnt);
+
+/*
+ * A PROTO_READER buffers the incoming side of a connection.  Each read
+ * from the socket pulls in as much data as will fit in the buffer, and
+ * complete packets are then handed out directly from the buffer, so a
+ * burst of small packets costs a single read() and no allocations.
+ */
+typedef struct proto_reader PROTO_READER;
+
+/*
+ * Create a reader for a connection.
+ *
+ * @param fd  The file descriptor of the connection, which may be
+ * either blocking or non-blocking.
+ * @return  The newly created reader.
+ */
+PROTO_READER *proto_reader_create(int fd);
+
+/*
+ * Free a reader.  The file descriptor is not closed.
+ *
+ * @param rp  The reader to be freed.
+ */
+void proto_reader_destroy(PROTO_READER *rp);
+
+/*
+ * Get the next packet from a reader, reading from the connection only
+ * if no complete packet is buffered.
+ *
+ * @param rp  The reader.
+ * @param hdr  Pointer to caller-supplied storage for the packet header,
+ * with multi-byte fields in network byte order.
+ * @param payloadp  Pointer to a variable into which to store a pointer to
+ * the payload, or NULL if there is none.  The payload is owned by the
+ * reader and remains valid only until the next call on the same reader.
+ * It is followed by a NUL byte, so a payload without embedded NULs can be
+ * used as a string without copying it.
+ * @return  0 if a packet was returned, otherwise -1.  If the descriptor
+ * is non-blocking and no complete packet is available yet, -1 is
+ * returned with errno set to EAGAIN and the partial packet is kept.
+ */
+int proto_reader_next(PROTO_READER *rp, JEUX_PACKET_HEADER *hdr, void **payloadp);
+
+/*
+ * Determine whether a reader holds data that has not been handed out.
+ *
+ * @param rp  The reader to be queried.
+ * @return  1 if there is unread data in the buffer, 0 otherwise.
+ */
+int proto_reader_buffered(PROTO_READER *rp);
+
+#endif
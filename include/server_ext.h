@@ -0,0 +1,43 @@
+#ifndef SERVER_EXT_H
+#define SERVER_EXT_H
+
+#include "protocol.h"
+#include "client_registry.h"
+
+/*
+ * Carry out a single request received from a client.  This is the body
+ * of the service loop run by jeux_client_service(), factored out so that
+ * other I/O front ends (e.g. the event loop) can share it.
+ *
+ * @param client  The CLIENT from which the packet was received.
+ * @param playerp  Pointer to the session's logged in PLAYER, or to NULL
+ * if the session has not logged in yet.  Updated on a successful LOGIN.
+ * @param hdr  The header of the received packet.
+ * @param data  The payload of the received packet, or NULL.  It must be
+ * followed by a NUL byte, so that names and moves can be used in place;
+ * the payload buffers of the packet readers are.  It is not freed by
+ * this function.
+ */
+void jeux_client_dispatch(CLIENT *client, PLAYER **playerp,
+                JEUX_PACKET_HEADER *hdr, void *data);
+
+/*
+ * Run the service loop for a connection on the calling thread, returning
+ * once the session has ended and the connection has been closed.  This
+ * is what jeux_client_service() runs, without the thread management, so
+ * that the loop can also be run by pooled worker threads.
+ *
+ * @param connfd  The file descriptor of the client connection.
+ */
+void jeux_client_serve(int connfd);
+
+/*
+ * End a client session once EOF has been seen on its connection: log the
+ * client out (if it was logged in), unregister it and close its socket.
+ *
+ * @param client  The CLIENT whose session is ending.
+ * @param player  The session's logged in PLAYER, or NULL.
+ */
+void jeux_client_finish(CLIENT *client, PLAYER *player);
+
+#endif
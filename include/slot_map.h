@@ -0,0 +1,98 @@
+#ifndef SLOT_MAP_H
+#define SLOT_MAP_H
+
+#include <stddef.h>
+
+/*
+ * A slot map hands out small integer IDs for items, such as a client's
+ * invitations, and maps them back in constant time.
+ *
+ * IDs are drawn from a fixed space of 2^idbits values, so that they fit
+ * the field that carries them on the wire.  The slots live in a table
+ * whose size is a power of two, no larger than the ID space, and an ID
+ * is held by the slot whose position is the ID modulo the table size.
+ * The remaining (high) bits of the ID are the slot's generation: when an
+ * item is removed, its slot moves on to the next ID with the same
+ * position, so that the old ID no longer maps to anything and is
+ * recognized as stale, for as long as the space allows before the
+ * generations wrap around.  Free slots are reused in the order they were
+ * freed, which puts off reusing an ID for as long as possible.  The
+ * table doubles when no slot is free, until it fills the ID space.
+ *
+ * A slot map does no locking of its own.
+ */
+typedef struct slot_map SLOT_MAP;
+
+/*
+ * Create an empty slot map.
+ *
+ * @param idbits  The width of the IDs, at most 31.
+ * @return  The slot map.
+ */
+SLOT_MAP *smap_create(int idbits);
+
+/*
+ * Free a slot map.  The items are not touched.
+ *
+ * @param map  The slot map.
+ */
+void smap_free(SLOT_MAP *map);
+
+/*
+ * Add an item.
+ *
+ * @param map  The slot map.
+ * @param item  The item, which must not be NULL.
+ * @return  The ID of the item, or -1 if every ID is in use.
+ */
+int smap_insert(SLOT_MAP *map, void *item);
+
+/*
+ * Look up an ID.
+ *
+ * @param map  The slot map.
+ * @param id  The ID.
+ * @return  The item with the ID, or NULL if the ID is not in use, which
+ * includes IDs that have been removed and IDs out of range.
+ */
+void *smap_get(SLOT_MAP *map, int id);
+
+/*
+ * Remove an ID.
+ *
+ * @param map  The slot map.
+ * @param id  The ID.
+ * @return  The item that had the ID, or NULL if the ID was not in use.
+ */
+void *smap_remove(SLOT_MAP *map, int id);
+
+/*
+ * Get the number of items.
+ *
+ * @param map  The slot map.
+ * @return  The number of IDs in use.
+ */
+size_t smap_count(SLOT_MAP *map);
+
+/*
+ * Get the number of slots, which bounds the positions that may be passed
+ * to smap_at().
+ *
+ * @param map  The slot map.
+ * @return  The number of slots.
+ */
+size_t smap_capacity(SLOT_MAP *map);
+
+/*
+ * Get the item in the slot at a position, for going through all of them.
+ * Positions only change when the map grows, that is, when an item is
+ * added.
+ *
+ * @param map  The slot map.
+ * @param pos  The position, less than smap_capacity().
+ * @param idp  If the slot is in use, set to the item's ID.
+ * @return  The item in the slot, or NULL if it is free.
+ */
+void *smap_at(SLOT_MAP *map, size_t pos, int *idp);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef USER_LIST_H
+#define USER_LIST_H
+
+#include <stddef.h>
+
+/*
+ * The payload of the response to USERS, a line "<name>\t<rating>\n" per
+ * logged in player, is kept ready rather than built for each request.
+ * The list has a version, which is bumped whenever a player logs in or
+ * out or has a rating change.  The list is rebuilt (by the first request
+ * that finds it out of date) only when the version has moved on, so as
+ * long as nothing changes, every USERS request is answered from the same
+ * buffer.  A list is immutable once built and is reference counted, so
+ * requesters share it and a rebuild never disturbs one being sent.
+ */
+
+/*
+ * Note that the list of players or a player's rating has changed, so
+ * that the next request rebuilds the list.
+ */
+void ulist_invalidate(void);
+
+/*
+ * Get a reference to the current list, rebuilding it if it is out of
+ * date.
+ *
+ * @param lenp  Set to the length of the list.
+ * @return  The list, which must be given back with ulist_release().  It
+ * is not NUL-terminated.
+ */
+char *ulist_acquire(size_t *lenp);
+
+/*
+ * Give back a reference obtained from ulist_acquire() or ulist_query().
+ *
+ * @param data  The list.
+ */
+void ulist_release(char *data);
+
+/*
+ * Build the part of the list asked for by a USERS query: a page of the
+ * players whose names start with a prefix, in order of name.  This is
+ * answered from the sorted index of the client registry rather than from
+ * the cached list, so its cost depends on the size of the page and not
+ * on the number of players logged in.
+ *
+ * @param prefix  The prefix, or "" for all players.
+ * @param offset  The number of matching players to pass over.
+ * @param limit  The most players to include, or 0 for no limit.
+ * @param lenp  Set to the length of the result.
+ * @return  The result, in the same format as the list, which must be
+ * given back with ulist_release().  As with the list, it is sent by
+ * streaming (see client_stream_ack()), so that however many players match,
+ * it goes out a part at a time.
+ */
+char *ulist_query(char *prefix, size_t offset, size_t limit, size_t *lenp);
+
+/*
+ * Discard the current list.  This is for clean termination.
+ */
+void ulist_fini(void);
+
+#endif
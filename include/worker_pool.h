@@ -0,0 +1,37 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Pool of pre-created service threads.  Instead of starting (and tearing
+ * down) a detached thread per connection, accepted connections are put
+ * on a queue from which idle workers take them, each running
+ * jeux_client_serve() for one connection at a time and then going back
+ * to the queue.  Since a connection occupies its worker for as long as
+ * it lasts, the pool starts another worker whenever a connection is
+ * queued with no idle worker to take it, so the pool size is a floor
+ * rather than a limit on the number of clients.  Workers started beyond
+ * that floor exit again once they have been idle for a while.
+ */
+
+/*
+ * Start the worker threads.  This must be called once, before any
+ * connection is handed over with wpool_submit().
+ *
+ * @param nworkers  The number of workers to start.
+ * @param stacksize  The stack size for worker threads, in bytes, or 0
+ * for the default.
+ * @return 0 if the workers were started, otherwise -1.
+ */
+int wpool_init(int nworkers, size_t stacksize);
+
+/*
+ * Hand a newly accepted connection over to the pool.  The worker that
+ * serves it takes over responsibility for closing the file descriptor.
+ *
+ * @param fd  The file descriptor of the accepted connection.
+ */
+void wpool_submit(int fd);
+
+#endif
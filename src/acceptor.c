@@ -0,0 +1,134 @@
+#define _GNU_SOURCE  // for accept4()
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "acceptor.h"
+#include "debug.h"
+
+#define ACC_BATCH 64
+#define ACC_LISTENQ 1024  // as LISTENQ in csapp.h
+
+typedef struct acceptor {
+    pthread_t tid; 
+    int fd; 
+} ACCEPTOR; 
+
+static ACCEPTOR *acceptors; 
+static int nacceptors; 
+static void (*acc_handoff)(int fd); 
+
+/*
+ * Open a non-blocking listening socket on the port, sharing the port
+ * with the other acceptors.  This follows open_listenfd().
+ */
+static int acc_open(char *port) {
+    struct addrinfo hints, *listp, *p; 
+    int fd = -1, rc, optval = 1; 
+    memset(&hints, 0, sizeof(struct addrinfo)); 
+    hints.ai_socktype = SOCK_STREAM; 
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV; 
+    if((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+        debug("getaddrinfo failed (port %s): %s", port, gai_strerror(rc)); 
+        return -1; 
+    }
+    for(p = listp; p; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol); 
+        if(fd < 0)
+            continue; 
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int)); 
+        if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) == 0 &&
+            bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, ACC_LISTENQ) == 0)
+            break; 
+        close(fd); 
+        fd = -1; 
+    }
+    freeaddrinfo(listp); 
+    return fd; 
+}
+
+static void *acc_run(void *arg) {
+    ACCEPTOR *acc = (ACCEPTOR *)arg; 
+    struct pollfd pfd = {.fd = acc->fd, .events = POLLIN}; 
+    int fds[ACC_BATCH]; 
+    while(1) {
+        if(poll(&pfd, 1, -1) < 0) {
+            if(errno == EINTR)
+                continue; 
+            break; 
+        }
+        if(pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+            break; 
+        // Take everything that is queued (up to a batch) before handing
+        // any of it over, so that a storm of connections costs one wakeup
+        // per batch rather than one per connection.
+        // The handoffs may clobber errno, so keep the error that ended
+        // the batch.
+        int n = 0, err = 0; 
+        while(n < ACC_BATCH) {
+            int fd = accept4(acc->fd, NULL, NULL, SOCK_CLOEXEC); 
+            if(fd >= 0)
+                fds[n++] = fd; 
+            else if(errno != EINTR && errno != ECONNABORTED) {
+                err = errno; 
+                break; 
+            }
+        }
+        for(int i = 0; i < n; ++i)
+            acc_handoff(fds[i]); 
+        if(err && err != EAGAIN && err != EWOULDBLOCK) {
+            debug("accept4: %s", strerror(err)); 
+            if(err == EINVAL || err == EBADF)
+                break; 
+        }
+    }
+    debug("Acceptor on fd %d exiting", acc->fd); 
+    return NULL; 
+}
+
+int acc_start(char *port, int n, void (*handoff)(int fd)) {
+    acceptors = (ACCEPTOR *)calloc(sizeof(ACCEPTOR), n); 
+    acc_handoff = handoff; 
+    for(nacceptors = 0; nacceptors < n; ++nacceptors) {
+        if((acceptors[nacceptors].fd = acc_open(port)) < 0) {
+            debug("Failed to open listening socket %d on port %s", nacceptors, port); 
+            while(nacceptors--)
+                close(acceptors[nacceptors].fd); 
+            nacceptors = 0; 
+            return -1; 
+        }
+    }
+
+    // Acceptor threads must not take SIGHUP, since the handler waits for
+    // all clients to go away.
+    sigset_t mask, omask; 
+    sigfillset(&mask); 
+    pthread_sigmask(SIG_BLOCK, &mask, &omask); 
+    for(int i = 0; i < nacceptors; ++i) {
+        int status = pthread_create(&acceptors[i].tid, NULL, acc_run, &acceptors[i]); 
+        if(status != 0) {
+            debug("pthread_create: %s", strerror(status)); 
+            pthread_sigmask(SIG_SETMASK, &omask, NULL); 
+            acc_stop(); 
+            return -1; 
+        }
+        pthread_detach(acceptors[i].tid); 
+    }
+    pthread_sigmask(SIG_SETMASK, &omask, NULL); 
+    debug("Started %d acceptors on port %s", nacceptors, port); 
+    return 0; 
+}
+
+void acc_stop(void) {
+    // Shutting the sockets down wakes the acceptors up; they are left
+    // open, so that an acceptor never polls a descriptor that has been
+    // reused.
+    for(int i = 0; i < nacceptors; ++i)
+        shutdown(acceptors[i].fd, SHUT_RDWR); 
+}
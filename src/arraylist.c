@@ -28,7 +28,7 @@ extern void arraylist_push(ARRAYLIST *list, void *item) {
 
 extern void *arraylist_pop(ARRAYLIST *list) {
     if(list->size)
-        return list->data[list->size--]; 
+        return list->data[--list->size]; 
     return NULL; 
 }
 
@@ -1,10 +1,24 @@
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <time.h>
+#include <sys/socket.h>
 
 #include "client_registry.h"
+#include "client_registry_ext.h"
+#include "player_ext.h"
+#include "user_list.h"
+#include "presence.h"
+#include "client_ext.h"
+#include "game_ext.h"
+#include "protocol_ext.h"
 #include "jeux_globals_ext.h"
-#include "arraylist.h"
+#include "proto_uring.h"
+#include "invitation_ext.h"
+#include "slot_map.h"
+#include "obj_pool.h"
 #include "debug.h"
 
 typedef struct client {
@@ -13,97 +27,231 @@ typedef struct client {
     CLIENT_REGISTRY *creg; 
     int fd; 
     PLAYER *player; 
-    ARRAYLIST *invitations; 
+    int leaving; 
+    int subscribed; 
+    int extids; 
+    SLOT_MAP *invitations; 
+    char *obuf; 
+    size_t ooff, olen, ocap; 
+    size_t opkt_off, opkts; 
+    CLIENT_OUTPUT_STATS ostats; 
+    int oerr; 
+    void (*wakeup)(void *); 
+    void *wakeup_arg; 
+    int wakeup_pending; 
+    struct client_stream *shead, *stail; 
+    size_t send; 
+    size_t sbytes, spkts; 
 } CLIENT; 
 
-CLIENT *client_create(CLIENT_REGISTRY *creg, int fd) {
-    CLIENT *client = (CLIENT *)calloc(sizeof(CLIENT), 1); 
+/*
+ * A response waiting to be fed into a client's output queue.  A streamed
+ * response (see client_stream_ack()) is fed in a part at a time, and
+ * only once the queue has drained, so that there is about one part in
+ * flight per client.  A response sent while one is being streamed waits
+ * here behind it, copied, and is fed in as soon as the stream is over.
+ * While the part of a stream last fed in is being written, the client's
+ * send is the offset in the output buffer at which that part ends; the
+ * part does not count against the client's budget, but the responses
+ * waiting behind it (sbytes and spkts) do.
+ */
+typedef struct client_stream {
+    struct client_stream *next; 
+    JEUX_PACKET_HEADER header;  // the whole header, for a copied response
+    char *data; 
+    size_t off, len; 
+    void (*release)(char *);    // NULL for a copied response
+} CLIENT_STREAM; 
+
+#define CLIENT_MAX_CORKED 8
+#define CLIENT_OBUF_MIN 512
+#define CLIENT_OBUF_KEEP 4096
+#define CLIENT_INV_ID_BITS 8  // the width of the id field of a packet header
+#define CLIENT_EXT_ID_BITS 31  // extended IDs, kept within an int
+
+size_t client_obuf_budget = CLIENT_OBUF_BUDGET; 
+size_t client_opkt_budget = CLIENT_OPKT_BUDGET; 
+
+static void client_stream_end(CLIENT *client); 
+static void client_stream_feed(CLIENT *client); 
+
+static __thread int cork_depth; 
+static __thread int ncorked; 
+static __thread CLIENT *corked[CLIENT_MAX_CORKED]; 
+
+static void client_init(void *obj) {
     pthread_mutexattr_t attr; 
     pthread_mutexattr_init(&attr); 
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE); 
-    pthread_mutex_init(&client->mutex, &attr); 
+    pthread_mutex_init(&((CLIENT *)obj)->mutex, &attr); 
     pthread_mutexattr_destroy(&attr); 
+}
+
+static void client_fini(void *obj) {
+    pthread_mutex_destroy(&((CLIENT *)obj)->mutex); 
+}
+
+OBJ_POOL client_pool = OPOOL_INITIALIZER("CLIENT", sizeof(CLIENT), client_init, client_fini); 
+
+CLIENT *client_create(CLIENT_REGISTRY *creg, int fd) {
+    CLIENT *client = (CLIENT *)opool_alloc(&client_pool); 
+    memset(&client->refs, 0, sizeof(CLIENT) - offsetof(CLIENT, refs)); 
     client->creg = creg; 
     client->fd = fd; 
-    client->invitations = arraylist_create();  
+    client->invitations = smap_create(CLIENT_INV_ID_BITS); 
     return client_ref(client, "for newly created client"); 
 }
 
 CLIENT *client_ref(CLIENT *client, char *why) {
-    pthread_mutex_lock(&client->mutex); 
+    size_t refs __attribute__((unused)) = __atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED); 
     debug("Increase reference count on client %p (%lu -> %lu) %s",
-        client, client->refs, client->refs+1, why); 
-    client->refs++; 
-    pthread_mutex_unlock(&client->mutex); 
+        client, refs-1, refs, why); 
     return client; 
 }
 
 void client_unref(CLIENT *client, char *why) {
-    size_t refs; 
-    pthread_mutex_lock(&client->mutex); 
+    // The decrement releases, so that whatever a thread did with the
+    // client happens before its reference is seen to be gone, and the
+    // thread that drops the last reference acquires before freeing it,
+    // so that it sees all of that.
+    size_t refs = __atomic_sub_fetch(&client->refs, 1, __ATOMIC_RELEASE); 
     debug("Decrease reference count on client %p (%lu -> %lu) %s",
-        client, client->refs, client->refs-1, why); 
-    refs = --client->refs; 
-    pthread_mutex_unlock(&client->mutex); 
+        client, refs+1, refs, why); 
     if(!refs) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); 
         debug("Free client %p", client); 
         client_logout(client);  
-        arraylist_free(client->invitations); 
-        pthread_mutex_destroy(&client->mutex); 
-        free(client); 
+        smap_free(client->invitations); 
+        client_stream_end(client); 
+        free(client->obuf); 
+        opool_free(&client_pool, client); 
     }
 }
 
-static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER; 
-
 int client_login(CLIENT *client, PLAYER *player) {
     int res = -1; 
-    pthread_mutex_lock(&log_mutex); 
-    PLAYER **plist = creg_all_players(client->creg); 
-    int logged = 0; 
-    PLAYER **pp = plist; 
-    while(*pp) {
-        logged = logged || *pp == player; 
-        player_unref(*pp, "for player removed from players list");      
-        pp++; 
-    }
-    free(plist); 
-    pthread_mutex_lock(&client->mutex); 
-    if(!client->player && !logged) {
-        client->player = player_ref(player, "for reference being retained by client"); 
-        res = 0; 
+    // Only one client at a time can take a player online, so this is the
+    // whole test of whether the player is logged in already.
+    if(player_set_online(player, 1))
+        return -1; 
+    if(!creg_bind_name(client->creg, player_get_name(player), client)) {
+        pthread_mutex_lock(&client->mutex); 
+        if(!client->player) {
+            client->player = player_ref(player, "for reference being retained by client"); 
+            res = 0; 
+        }
+        pthread_mutex_unlock(&client->mutex); 
+        if(res)
+            creg_unbind_name(client->creg, player_get_name(player), client); 
     }
-    pthread_mutex_unlock(&client->mutex); 
-    pthread_mutex_unlock(&log_mutex); 
+    if(res) {
+        player_set_online(player, 0); 
+        return res; 
+    }
+    ulist_invalidate(); 
+    pres_online(player); 
     return res; 
 }
 
 int client_logout(CLIENT *client) {
+    PLAYER *player = NULL; 
+    pthread_mutex_lock(&client->mutex); 
+    if(!client->player || client->leaving) {
+        pthread_mutex_unlock(&client->mutex); 
+        return -1; 
+    }
+    debug("Log out client %p", client); 
+    // Once the client is leaving it is given no new invitations, so the
+    // ones it has can be disposed of without holding its mutex, which
+    // would otherwise be held while locking the other participants.
+    client->leaving = 1; 
+    pthread_mutex_unlock(&client->mutex); 
+    for(size_t i = 0; ; ++i) {
+        int id; 
+        pthread_mutex_lock(&client->mutex); 
+        if(i >= smap_capacity(client->invitations)) {
+            pthread_mutex_unlock(&client->mutex); 
+            break; 
+        }
+        INVITATION *inv = smap_at(client->invitations, i, &id); 
+        if(inv)
+            inv_ref(inv, "for pointer to invitation copied from client's list"); 
+        pthread_mutex_unlock(&client->mutex); 
+        if(inv) {
+            if(inv_get_game(inv))
+                client_resign_game(client, id); 
+            else if(inv_get_source(inv) == client)
+                client_revoke_invitation(client, id); 
+            else
+                client_decline_invitation(client, id); 
+            inv_unref(inv, "because pointer to invitation is now being discarded"); 
+        }
+    }
+    pthread_mutex_lock(&client->mutex); 
+    player = client->player; 
+    client->player = NULL; 
+    client->leaving = 0; 
+    int subscribed = client->subscribed; 
+    client->subscribed = 0; 
+    pthread_mutex_unlock(&client->mutex); 
+    if(subscribed)
+        pres_unsubscribe(client); 
+    // The name is unbound without holding the client's mutex, since
+    // creg_lookup() takes a reference to the client with the index locked.
+    // The player is only taken offline once the logout has been published,
+    // so that it cannot be overtaken by the notice of a new login.
+    creg_unbind_name(client->creg, player_get_name(player), client); 
+    ulist_invalidate(); 
+    pres_offline(player); 
+    player_set_online(player, 0); 
+    player_unref(player, "because client is being logged out"); 
+    return 0; 
+}
+
+int client_use_extended_ids(CLIENT *client) {
     int res = -1; 
-    pthread_mutex_lock(&log_mutex); 
     pthread_mutex_lock(&client->mutex); 
-    if(client->player) {
-        debug("Log out client %p", client); 
-        for(int i = 0; i < client->invitations->size; ++i) {
-            INVITATION *inv = arraylist_get(client->invitations, i); 
-            if(inv) {
-                if(inv_get_game(inv))
-                    client_resign_game(client, i); 
-                else if(inv_get_source(inv) == client)
-                    client_revoke_invitation(client, i); 
-                else
-                    client_decline_invitation(client, i); 
-            } 
+    if(!client->player && !smap_count(client->invitations)) {
+        if(!client->extids) {
+            smap_free(client->invitations); 
+            client->invitations = smap_create(CLIENT_EXT_ID_BITS); 
+            __atomic_store_n(&client->extids, 1, __ATOMIC_RELAXED); 
         }
-        player_unref(client->player, "because client is being logged out"); 
-        client->player = NULL; 
         res = 0; 
     }
     pthread_mutex_unlock(&client->mutex); 
-    pthread_mutex_unlock(&log_mutex); 
     return res; 
 }
 
+int client_has_extended_ids(CLIENT *client) {
+    // The mode only changes while the client is not logged in, when no
+    // other client has anything to send it.
+    return __atomic_load_n(&client->extids, __ATOMIC_RELAXED); 
+}
+
+int client_subscribe(CLIENT *client) {
+    pthread_mutex_lock(&client->mutex); 
+    if(!client->player || client->leaving || client->subscribed) {
+        pthread_mutex_unlock(&client->mutex); 
+        return -1; 
+    }
+    client->subscribed = 1; 
+    pthread_mutex_unlock(&client->mutex); 
+    pres_subscribe(client); 
+    return 0; 
+}
+
+int client_unsubscribe(CLIENT *client) {
+    pthread_mutex_lock(&client->mutex); 
+    int subscribed = client->subscribed; 
+    client->subscribed = 0; 
+    pthread_mutex_unlock(&client->mutex); 
+    if(!subscribed)
+        return -1; 
+    pres_unsubscribe(client); 
+    return 0; 
+}
+
 PLAYER *client_get_player(CLIENT *client) {
     PLAYER *player; 
     pthread_mutex_lock(&client->mutex); 
@@ -112,6 +260,27 @@ PLAYER *client_get_player(CLIENT *client) {
     return player; 
 }
 
+/*
+ * Get a reference to the player logged in on a client, or NULL if there
+ * is none.
+ */
+static PLAYER *client_ref_player(CLIENT *client) {
+    PLAYER *player; 
+    pthread_mutex_lock(&client->mutex); 
+    player = client->player; 
+    if(player)
+        player_ref(player, "for reference to player copied from client"); 
+    pthread_mutex_unlock(&client->mutex); 
+    return player; 
+}
+
+static void client_unref_players(PLAYER *player, PLAYER *opp_player) {
+    if(player)
+        player_unref(player, "because reference to player copied from client is being discarded"); 
+    if(opp_player)
+        player_unref(opp_player, "because reference to player copied from client is being discarded"); 
+}
+
 int client_get_fd(CLIENT *client) {
     int fd; 
     pthread_mutex_lock(&client->mutex);  
@@ -120,25 +289,493 @@ int client_get_fd(CLIENT *client) {
     return fd; 
 }
 
+/*
+ * Forget output that has been written out, releasing the buffer if it was
+ * grown for an unusually large packet.
+ */
+static void client_reset_output(CLIENT *client) {
+    client->ooff = client->olen = 0; 
+    client->opkt_off = client->opkts = 0; 
+    client->send = 0; 
+    if(client->ocap > CLIENT_OBUF_KEEP) {
+        free(client->obuf); 
+        client->obuf = NULL; 
+        client->ocap = 0; 
+    }
+}
+
+/*
+ * Write out everything queued for a client, blocking if need be.  The
+ * caller must hold the client's mutex.  Once a write has failed, the
+ * connection is considered broken and anything queued afterwards is
+ * discarded.
+ */
+static int client_flush(CLIENT *client) {
+    int res = client->oerr ? -1 : 0; 
+    do {
+        client_stream_feed(client); 
+        if(client->olen > client->ooff && !res) {
+            struct iovec iov = {.iov_base = client->obuf + client->ooff, 
+                .iov_len = client->olen - client->ooff}; 
+            if(proto_uring_enabled)
+                res = proto_uring_sendv(client->fd, &iov, 1); 
+            else
+                res = proto_sendv(client->fd, &iov, 1); 
+            client->oerr = res != 0; 
+        }
+        client_reset_output(client); 
+    } while(client->shead && !res); 
+    if(res)
+        client_stream_end(client); 
+    return res; 
+}
+
+/*
+ * Let whoever owns a client's connection know that there is output to be
+ * written.  The caller must hold the client's mutex.  A client that has
+ * not been attached to an I/O context has its output written out here.
+ */
+static int client_wake(CLIENT *client) {
+    if(!client->wakeup)
+        return client_flush(client); 
+    if(!client->wakeup_pending && client->olen > client->ooff) {
+        client->wakeup_pending = 1; 
+        client->wakeup(client->wakeup_arg); 
+    }
+    return client->oerr ? -1 : 0; 
+}
+
+static size_t client_packet_len(CLIENT *client, size_t off) {
+    JEUX_PACKET_HEADER *hdr = (JEUX_PACKET_HEADER *)(client->obuf + off); 
+    return sizeof(JEUX_PACKET_HEADER) + ntohs(hdr->size); 
+}
+
+/*
+ * Account for output that has been written out, advancing over the
+ * packets that have been sent in full.
+ */
+static void client_written(CLIENT *client) {
+    while(client->opkts) {
+        size_t len = client_packet_len(client, client->opkt_off); 
+        if(client->opkt_off + len > client->ooff)
+            break; 
+        client->opkt_off += len; 
+        client->opkts--; 
+    }
+}
+
+static void client_queue(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data) {
+    size_t size = data ? ntohs(pkt->size) : 0; 
+    size_t len = client->olen + sizeof(JEUX_PACKET_HEADER) + size; 
+    // The buffer is compacted from the start of the first packet that
+    // has not been sent in full, so that it always starts with a header.
+    if(len > client->ocap && client->opkt_off) {
+        size_t shift = client->opkt_off; 
+        memmove(client->obuf, client->obuf + shift, client->olen - shift); 
+        client->olen -= shift; 
+        client->ooff -= shift; 
+        client->opkt_off = 0; 
+        client->send = client->send > shift ? client->send - shift : 0; 
+        len -= shift; 
+    }
+    if(len > client->ocap) {
+        client->ocap = client->ocap ? client->ocap : CLIENT_OBUF_MIN; 
+        while(client->ocap < len)
+            client->ocap <<= 1; 
+        client->obuf = realloc(client->obuf, client->ocap); 
+    }
+    JEUX_PACKET_HEADER *hdr = (JEUX_PACKET_HEADER *)(client->obuf + client->olen); 
+    memcpy(hdr, pkt, sizeof(JEUX_PACKET_HEADER)); 
+    hdr->size = htons((uint16_t)size); 
+    if(size)
+        memcpy(hdr + 1, data, size); 
+    client->olen = len; 
+    client->opkts++; 
+    if(client->olen - client->ooff > client->ostats.peak_bytes)
+        client->ostats.peak_bytes = client->olen - client->ooff; 
+    if(client->opkts > client->ostats.peak_packets)
+        client->ostats.peak_packets = client->opkts; 
+}
+
+/*
+ * Give up the streamed response being sent to a client, and the
+ * responses waiting behind it.
+ */
+static void client_stream_end(CLIENT *client) {
+    while(client->shead) {
+        CLIENT_STREAM *stream = client->shead; 
+        client->shead = stream->next; 
+        if(stream->release)
+            stream->release(stream->data); 
+        else
+            free(stream->data); 
+        free(stream); 
+    }
+    client->stail = NULL; 
+    client->sbytes = client->spkts = 0; 
+}
+
+static void client_stream_push(CLIENT *client, CLIENT_STREAM *stream) {
+    if(client->stail)
+        client->stail->next = stream; 
+    else
+        client->shead = stream; 
+    client->stail = stream; 
+}
+
+static void client_stream_pop(CLIENT *client) {
+    CLIENT_STREAM *stream = client->shead; 
+    if(!(client->shead = stream->next))
+        client->stail = NULL; 
+    if(stream->release) {
+        stream->release(stream->data); 
+    }
+    else {
+        client->sbytes -= sizeof(JEUX_PACKET_HEADER) + stream->len; 
+        client->spkts--; 
+        free(stream->data); 
+    }
+    free(stream); 
+}
+
+/*
+ * Feed whatever is waiting into a client's output queue: the next part of
+ * a streamed response, if the queue has drained, and the responses that
+ * were waiting for the stream to finish.  The caller must hold the
+ * client's mutex.
+ */
+static void client_stream_feed(CLIENT *client) {
+    while(client->shead) {
+        CLIENT_STREAM *stream = client->shead; 
+        if(!stream->release) {
+            client_queue(client, &stream->header, stream->data); 
+            client_stream_pop(client); 
+            continue; 
+        }
+        if(client->olen > client->ooff)
+            return; 
+        JEUX_PACKET_HEADER header = {0}; 
+        struct timespec time; 
+        size_t len = stream->len - stream->off; 
+        header.type = JEUX_ACK_PKT; 
+        if(len > JEUX_CHUNK_MAX) {
+            header.type = JEUX_CHUNK_PKT; 
+            len = JEUX_CHUNK_MAX; 
+        }
+        header.size = htons((uint16_t)len); 
+        clock_gettime(CLOCK_MONOTONIC, &time); 
+        header.timestamp_sec = htonl((uint32_t)time.tv_sec); 
+        header.timestamp_nsec = htonl((uint32_t)time.tv_nsec); 
+        proto_debug_packet("=>", &header, NULL); 
+        client_queue(client, &header, stream->data + stream->off); 
+        client->send = client->olen; 
+        stream->off += len; 
+        if(stream->off < stream->len)
+            return; 
+        client_stream_pop(client); 
+    }
+}
+
+static int client_over_budget(CLIENT *client) {
+    size_t bytes = client->olen - client->ooff + client->sbytes; 
+    size_t pkts = client->opkts + client->spkts; 
+    if(client->send > client->ooff) {
+        bytes -= client->send - client->ooff; 
+        pkts--; 
+    }
+    return (client_obuf_budget && bytes > client_obuf_budget) ||
+        (client_opkt_budget && pkts > client_opkt_budget); 
+}
+
+/*
+ * Drop queued MOVED notifications that are superseded by a later one for
+ * the same game, since each carries the full state of the board.  IDs
+ * are reused once a game is over, so a MOVED is only superseded by the
+ * next one with the same ID if nothing else with that ID (such as ENDED,
+ * or ACCEPTED for a new game) comes in between.  A packet that has been
+ * partly written out is left alone.
+ */
+typedef struct client_moved {
+    int used; 
+    uint32_t id; 
+    size_t off;  // the latest MOVED for the ID, or SIZE_MAX if there is none
+} CLIENT_MOVED; 
+
+static void client_coalesce(CLIENT *client) {
+    size_t start = client->opkt_off, off, out, len; 
+    int extended = client->extids; 
+    if(client->ooff > start)
+        start += client_packet_len(client, start); 
+    size_t mask = 1; 
+    while(mask < 2 * client->opkts)
+        mask <<= 1; 
+    CLIENT_MOVED *moved = (CLIENT_MOVED *)calloc(mask, sizeof(CLIENT_MOVED)); 
+    mask--; 
+    // Superseded packets are marked by changing their type, and then
+    // squeezed out.
+    for(off = start; off < client->olen; off += len) {
+        JEUX_PACKET_HEADER *hdr = (JEUX_PACKET_HEADER *)(client->obuf + off); 
+        uint32_t id = proto_get_id(hdr, extended); 
+        size_t i = (id * 2654435761U) & mask; 
+        len = client_packet_len(client, off); 
+        while(moved[i].used && moved[i].id != id)
+            i = (i + 1) & mask; 
+        if(hdr->type == JEUX_MOVED_PKT) {
+            if(moved[i].used && moved[i].off != SIZE_MAX)
+                ((JEUX_PACKET_HEADER *)(client->obuf + moved[i].off))->type = JEUX_NO_PKT; 
+            moved[i].used = 1; 
+            moved[i].id = id; 
+            moved[i].off = off; 
+        }
+        else if(moved[i].used) {
+            moved[i].off = SIZE_MAX; 
+        }
+    }
+    free(moved); 
+    for(off = out = start; off < client->olen; off += len) {
+        JEUX_PACKET_HEADER *hdr = (JEUX_PACKET_HEADER *)(client->obuf + off); 
+        len = client_packet_len(client, off); 
+        if(hdr->type == JEUX_NO_PKT) {
+            client->opkts--; 
+            client->ostats.dropped++; 
+            continue; 
+        }
+        if(out != off)
+            memmove(client->obuf + out, hdr, len); 
+        out += len; 
+    }
+    client->olen = out; 
+}
+
+/*
+ * Give up on a client that has fallen too far behind.  Its output is
+ * discarded and the connection is shut down, so that whoever services it
+ * sees EOF and ends the session the usual way, logging the client out.
+ */
+static void client_evict(CLIENT *client) {
+    debug("Evict client %p (clientfd=%d): %lu bytes / %lu packets queued", 
+        client, client->fd, client->olen - client->ooff, client->opkts); 
+    client->ostats.evicted = 1; 
+    client->oerr = 1; 
+    client_reset_output(client); 
+    client_stream_end(client); 
+    shutdown(client->fd, SHUT_RDWR); 
+}
+
+/*
+ * Determine whether output to a client can be held back until the calling
+ * thread uncorks, recording the client if this is the first packet for it.
+ */
+static int client_hold(CLIENT *client) {
+    if(!cork_depth)
+        return 0; 
+    for(int i = 0; i < ncorked; ++i) {
+        if(corked[i] == client)
+            return 1; 
+    }
+    if(ncorked == CLIENT_MAX_CORKED)
+        return 0; 
+    corked[ncorked++] = client_ref(client, "for client corked by this thread"); 
+    return 1; 
+}
+
 int client_send_packet(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data) {
-    int res;  
+    int res = 0;  
     pthread_mutex_lock(&client->mutex); 
     debug("Send packet (clientfd=%d, type=%s) for client %p",
         client->fd, JEUX_PACKET_TYPE_NAME[pkt->type], client); 
-    res = proto_send_packet(client->fd, pkt, data); 
+    proto_debug_packet("=>", pkt, data); 
+    if(client->oerr) {
+        pthread_mutex_unlock(&client->mutex); 
+        return -1; 
+    }
+    // A response must not overtake the rest of a streamed one, so it waits
+    // behind the stream.
+    if(client->shead && 
+        (pkt->type == JEUX_ACK_PKT || pkt->type == JEUX_NACK_PKT || pkt->type == JEUX_CHUNK_PKT)) {
+        CLIENT_STREAM *stream = (CLIENT_STREAM *)calloc(sizeof(CLIENT_STREAM), 1); 
+        stream->header = *pkt; 
+        stream->len = data ? ntohs(pkt->size) : 0; 
+        if(stream->len) {
+            stream->data = malloc(stream->len); 
+            memcpy(stream->data, data, stream->len); 
+        }
+        client_stream_push(client, stream); 
+        client->sbytes += sizeof(JEUX_PACKET_HEADER) + stream->len; 
+        client->spkts++; 
+    }
+    else {
+        client_queue(client, pkt, data); 
+    }
+    // Output only piles up for a client whose I/O context is not keeping
+    // up with it.
+    if(client->wakeup && client_over_budget(client)) {
+        client_coalesce(client); 
+        if(client_over_budget(client)) {
+            client_evict(client); 
+            pthread_mutex_unlock(&client->mutex); 
+            return -1; 
+        }
+    }
+    if(!client_hold(client))
+        res = client_wake(client); 
+    else if(client->oerr)
+        res = -1; 
+    pthread_mutex_unlock(&client->mutex); 
+    return res; 
+}
+
+void client_cork(void) {
+    cork_depth++; 
+}
+
+void client_uncork(void) {
+    if(--cork_depth)
+        return; 
+    for(int i = 0; i < ncorked; ++i) {
+        CLIENT *client = corked[i]; 
+        pthread_mutex_lock(&client->mutex); 
+        client_wake(client); 
+        pthread_mutex_unlock(&client->mutex); 
+        client_unref(client, "because client is no longer corked by this thread"); 
+    }
+    ncorked = 0; 
+}
+
+void client_set_wakeup(CLIENT *client, void (*wakeup)(void *), void *arg) {
+    pthread_mutex_lock(&client->mutex); 
+    client->wakeup = wakeup; 
+    client->wakeup_arg = arg; 
+    client->wakeup_pending = 0; 
+    if(!wakeup) {
+        client->oerr = 1; 
+        client_reset_output(client); 
+        client_stream_end(client); 
+    }
+    pthread_mutex_unlock(&client->mutex); 
+}
+
+/*
+ * Write out a client's queued output with blocking io_uring sends.  The
+ * queue is taken over before writing, so that the client's mutex is not
+ * held while blocked and other threads can keep queueing (and evict the
+ * client, which makes the send fail, if it falls too far behind).
+ */
+static int client_flush_uring(CLIENT *client) {
+    char *buf = client->obuf; 
+    size_t cap = client->ocap; 
+    struct iovec iov = {.iov_base = client->obuf + client->ooff, 
+        .iov_len = client->olen - client->ooff}; 
+    int res = 0; 
+    client->obuf = NULL; 
+    client->ocap = 0; 
+    client->ooff = client->olen = 0; 
+    client->opkt_off = client->opkts = 0; 
+    client->send = 0; 
+    pthread_mutex_unlock(&client->mutex); 
+    if(iov.iov_len)
+        res = proto_uring_sendv(client->fd, &iov, 1); 
+    pthread_mutex_lock(&client->mutex); 
+    if(res)
+        client->oerr = 1; 
+    if(!client->obuf && cap <= CLIENT_OBUF_KEEP) {
+        client->obuf = buf; 
+        client->ocap = cap; 
+    }
+    else {
+        free(buf); 
+    }
+    return client->oerr ? -1 : 0; 
+}
+
+int client_flush_output(CLIENT *client) {
+    int res; 
+    pthread_mutex_lock(&client->mutex); 
+    client->wakeup_pending = 0; 
+    if(client->oerr) {
+        res = client_flush(client); 
+    }
+    else if(proto_uring_enabled) {
+        do {
+            client_stream_feed(client); 
+            res = client_flush_uring(client); 
+        } while(client->shead && !res); 
+    }
+    else {
+        // A streamed response is fed in for as long as the socket keeps
+        // taking everything that is queued.
+        ssize_t wbytes = 0; 
+        do {
+            client_stream_feed(client); 
+            if(client->olen > client->ooff) {
+                struct iovec iov = {.iov_base = client->obuf + client->ooff, 
+                    .iov_len = client->olen - client->ooff}; 
+                wbytes = proto_trysendv(client->fd, &iov, 1); 
+                if(wbytes < 0) {
+                    client->oerr = 1; 
+                }
+                else {
+                    client->ooff += wbytes; 
+                    client_written(client); 
+                }
+            }
+            if(client->olen == client->ooff)
+                client_reset_output(client); 
+        } while(client->shead && !client->oerr && client->olen == client->ooff); 
+        res = client->oerr ? -1 : client->olen > client->ooff; 
+    }
     pthread_mutex_unlock(&client->mutex); 
     return res; 
 }
 
+void client_get_output_stats(CLIENT *client, CLIENT_OUTPUT_STATS *stats) {
+    pthread_mutex_lock(&client->mutex); 
+    *stats = client->ostats; 
+    stats->queued_bytes = client->olen - client->ooff; 
+    stats->queued_packets = client->opkts; 
+    pthread_mutex_unlock(&client->mutex); 
+}
+
 int client_send_ack(CLIENT *client, void *data, size_t datalen) {
     JEUX_PACKET_HEADER header = {0}; 
     struct timespec time; 
     header.type = JEUX_ACK_PKT;
-    header.size = htons((uint16_t)datalen); 
     clock_gettime(CLOCK_MONOTONIC, &time); 
     header.timestamp_sec = htonl((uint32_t)time.tv_sec); 
     header.timestamp_nsec = htonl((uint32_t)time.tv_nsec); 
-    return client_send_packet(client, &header, data); 
+    // A payload too large for one packet goes out in chunks.
+    char *cp = data; 
+    while(datalen > JEUX_CHUNK_MAX) {
+        header.type = JEUX_CHUNK_PKT; 
+        header.size = htons((uint16_t)JEUX_CHUNK_MAX); 
+        if(client_send_packet(client, &header, cp) < 0)
+            return -1; 
+        cp += JEUX_CHUNK_MAX; 
+        datalen -= JEUX_CHUNK_MAX; 
+    }
+    header.type = JEUX_ACK_PKT;
+    header.size = htons((uint16_t)datalen); 
+    return client_send_packet(client, &header, cp); 
+}
+
+int client_stream_ack(CLIENT *client, char *data, size_t datalen, void (*release)(char *)) {
+    int res; 
+    pthread_mutex_lock(&client->mutex); 
+    if(client->oerr) {
+        release(data); 
+        res = -1; 
+    }
+    else {
+        CLIENT_STREAM *stream = (CLIENT_STREAM *)calloc(sizeof(CLIENT_STREAM), 1); 
+        stream->data = data; 
+        stream->len = datalen; 
+        stream->release = release; 
+        client_stream_push(client, stream); 
+        client_stream_feed(client); 
+        res = client_hold(client) ? 0 : client_wake(client); 
+    }
+    pthread_mutex_unlock(&client->mutex); 
+    return res; 
 }
 
 int client_send_nack(CLIENT *client) {
@@ -159,11 +796,16 @@ int client_add_invitation(CLIENT *client, INVITATION *inv) {
     else if(client == inv_get_target(inv))
         role = 2; 
     pthread_mutex_lock(&client->mutex); 
-    if(client->player && role) {
+    if(client->player && !client->leaving && role) {
         debug("[%d] Add invitation as %s", client->fd, role == 1 ? "source" : "target"); 
-        id = arraylist_find(client->invitations, NULL);
-        arraylist_set(client->invitations, id, (void *)inv_ref(inv, 
-            "for invitation being added to client's list")); 
+        id = smap_insert(client->invitations, inv); 
+        if(id >= 0) {
+            inv_ref(inv, "for invitation being added to client's list"); 
+            inv_set_id(inv, client, id); 
+        }
+        else {
+            debug("[%d] No invitation ID is free", client->fd); 
+        }
     }    
     else {
         debug("[%d] Failed to add invitation", client->fd); 
@@ -175,14 +817,15 @@ int client_add_invitation(CLIENT *client, INVITATION *inv) {
 int client_remove_invitation(CLIENT *client, INVITATION *inv) {
     int id; 
     pthread_mutex_lock(&client->mutex); 
-    id = arraylist_find(client->invitations, inv); 
-    if(id < client->invitations->size) {
+    id = inv_get_id(inv, client); 
+    if(id >= 0 && smap_get(client->invitations, id) == inv) {
         debug("[%d] Remove invitation %p", client->fd, inv);
-        inv_unref(arraylist_get(client->invitations, id),
-            "for invitation being removed from client's list"); 
-        arraylist_set(client->invitations, id, NULL);  
+        smap_remove(client->invitations, id); 
+        inv_set_id(inv, client, -1); 
+        inv_unref(inv, "for invitation being removed from client's list"); 
     }
     else {
+        id = -1; 
         debug("[%d] Failed to remove invitation %p", client->fd, inv); 
     }
     pthread_mutex_unlock(&client->mutex); 
@@ -199,15 +842,22 @@ int client_make_invitation(CLIENT *source, CLIENT *target,
     }
     int source_id = client_add_invitation(source, inv); 
     int target_id = client_add_invitation(target, inv); 
-    inv_unref(inv, "becuase pointer to invitation is being discarded"); 
-    if(source_id == -1 || target_id == -1)
+    if(source_id == -1 || target_id == -1) {
+        // Either side may have run out of IDs, so the other is undone.
+        if(source_id != -1)
+            client_remove_invitation(source, inv); 
+        if(target_id != -1)
+            client_remove_invitation(target, inv); 
+        inv_unref(inv, "becuase pointer to invitation is being discarded"); 
         return -1; 
+    }
+    inv_unref(inv, "becuase pointer to invitation is being discarded"); 
 
     JEUX_PACKET_HEADER header = {0}; 
     char *data; 
     struct timespec time; 
     header.type = JEUX_INVITED_PKT; 
-    header.id = (uint8_t)target_id; 
+    proto_set_id(&header, target_id, client_has_extended_ids(target)); 
     header.role = (uint8_t)target_role;
     data = player_get_name(client_get_player(source)); 
     header.size = htons((uint16_t)strlen(data)); 
@@ -221,7 +871,7 @@ int client_make_invitation(CLIENT *source, CLIENT *target,
 int client_revoke_invitation(CLIENT *client, int id) {
     debug("[%d] Revoke invitation %d", client_get_fd(client), id); 
     pthread_mutex_lock(&client->mutex); 
-    INVITATION *inv = arraylist_get(client->invitations, id); 
+    INVITATION *inv = smap_get(client->invitations, id); 
     if(inv) {
         inv_ref(inv, "for pointer to invitation copied from source client's list"); 
     }
@@ -252,7 +902,7 @@ int client_revoke_invitation(CLIENT *client, int id) {
     JEUX_PACKET_HEADER header = {0}; 
     struct timespec time; 
     header.type = JEUX_REVOKED_PKT; 
-    header.id = (uint8_t)target_id; 
+    proto_set_id(&header, target_id, client_has_extended_ids(target)); 
     clock_gettime(CLOCK_MONOTONIC, &time); 
     header.timestamp_sec = htonl((uint32_t)time.tv_sec); 
     header.timestamp_nsec = htonl((uint32_t)time.tv_nsec); 
@@ -263,7 +913,7 @@ int client_revoke_invitation(CLIENT *client, int id) {
 int client_decline_invitation(CLIENT *client, int id) {
     debug("[%d] Decline invitation %d", client_get_fd(client), id); 
     pthread_mutex_lock(&client->mutex); 
-    INVITATION *inv = arraylist_get(client->invitations, id); 
+    INVITATION *inv = smap_get(client->invitations, id); 
     if(inv) {
         inv_ref(inv, "for pointer to invitation copied from target client's list"); 
     }
@@ -294,7 +944,7 @@ int client_decline_invitation(CLIENT *client, int id) {
     JEUX_PACKET_HEADER header = {0}; 
     struct timespec time; 
     header.type = JEUX_DECLINED_PKT; 
-    header.id = (uint8_t)source_id; 
+    proto_set_id(&header, source_id, client_has_extended_ids(source)); 
     clock_gettime(CLOCK_MONOTONIC, &time); 
     header.timestamp_sec = htonl((uint32_t)time.tv_sec); 
     header.timestamp_nsec = htonl((uint32_t)time.tv_nsec); 
@@ -303,9 +953,18 @@ int client_decline_invitation(CLIENT *client, int id) {
 }
 
 int client_accept_invitation(CLIENT *client, int id, char **strp) {
+    char buf[GAME_STATE_BUFSIZE]; 
+    int len = client_accept_invitation_into(client, id, buf); 
+    if(len == -1)
+        return -1; 
+    *strp = len ? strdup(buf) : NULL; 
+    return 0; 
+}
+
+int client_accept_invitation_into(CLIENT *client, int id, char *buf) {
     debug("[%d] Accept invitation %d", client_get_fd(client), id); 
     pthread_mutex_lock(&client->mutex); 
-    INVITATION *inv = arraylist_get(client->invitations, id);
+    INVITATION *inv = smap_get(client->invitations, id); 
     if(inv) {
         inv_ref(inv, "for pointer to invitation copied from target client's list"); 
     }
@@ -329,35 +988,31 @@ int client_accept_invitation(CLIENT *client, int id, char **strp) {
     
     CLIENT *source = inv_get_source(inv); 
     JEUX_PACKET_HEADER header = {0}; 
-    char *data = NULL; 
+    char data[GAME_STATE_BUFSIZE]; 
     struct timespec time; 
+    int len = 0; 
     header.type = JEUX_ACCEPTED_PKT; 
-    pthread_mutex_lock(&source->mutex); 
-    header.id = (uint8_t)arraylist_find(source->invitations, inv); 
-    pthread_mutex_unlock(&source->mutex); 
+    proto_set_id(&header, inv_get_id(inv, source), client_has_extended_ids(source)); 
     if(inv_get_target_role(inv) == FIRST_PLAYER_ROLE) {
-        *strp = game_unparse_state(inv_get_game(inv));  
+        len = (int)game_unparse_state_into(inv_get_game(inv), buf); 
         header.size = 0; 
     }
     else {
-        data = game_unparse_state(inv_get_game(inv)); 
-        header.size = htons((uint16_t)strlen(data)); 
+        header.size = htons((uint16_t)game_unparse_state_into(inv_get_game(inv), data)); 
     }
     clock_gettime(CLOCK_MONOTONIC, &time); 
     header.timestamp_sec = htonl((uint32_t)time.tv_sec); 
     header.timestamp_nsec = htonl((uint32_t)time.tv_nsec); 
-    client_send_packet(source, &header, data); 
-    if(data)
-        free(data);  
+    client_send_packet(source, &header, header.size ? data : NULL); 
     inv_unref(inv, "because pointer to invitation is now being discarded"); 
-    return 0; 
+    return len; 
 }
 
 static int client_send_end(CLIENT *client, int id, GAME_ROLE winner) {
     JEUX_PACKET_HEADER header = {0}; 
     struct timespec time; 
     header.type = JEUX_ENDED_PKT; 
-    header.id = (uint8_t)id; 
+    proto_set_id(&header, id, client_has_extended_ids(client)); 
     header.role = winner; 
     clock_gettime(CLOCK_MONOTONIC, &time); 
     header.timestamp_sec = htonl((uint32_t)time.tv_sec); 
@@ -368,7 +1023,7 @@ static int client_send_end(CLIENT *client, int id, GAME_ROLE winner) {
 int client_resign_game(CLIENT *client, int id) {
     debug("[%d] Resign game %d", client_get_fd(client), id); 
     pthread_mutex_lock(&client->mutex); 
-    INVITATION *inv = arraylist_get(client->invitations, id);
+    INVITATION *inv = smap_get(client->invitations, id); 
     if(inv) {
         inv_ref(inv, "for pointer to invitation copied from client's list"); 
     }
@@ -393,12 +1048,17 @@ int client_resign_game(CLIENT *client, int id) {
         inv_unref(inv, "because pointer to invitation is now being discarded"); 
         return -1; 
     } 
+    // The players are taken before the game is closed, since once it is
+    // closed, nothing stops the opponent from logging out.
     int opp_id; 
-    if (!inv_get_game(inv) || inv_close(inv, role) ||
+    PLAYER *player = client_ref_player(client); 
+    PLAYER *opp_player = client_ref_player(opp); 
+    if (!player || !opp_player || !inv_get_game(inv) || inv_close(inv, role) ||
         client_remove_invitation(client, inv) == -1 ||
         (opp_id = client_remove_invitation(opp, inv)) == -1) 
     { 
         debug("[%d] Invitation %d cannot be resigned", client_get_fd(client), id); 
+        client_unref_players(player, opp_player); 
         inv_unref(inv, "because pointer to invitation is now being discarded"); 
         return -1; 
     }    
@@ -406,14 +1066,15 @@ int client_resign_game(CLIENT *client, int id) {
     JEUX_PACKET_HEADER header = {0}; 
     struct timespec time;     
     header.type = JEUX_RESIGNED_PKT;  
-    header.id = (uint8_t)opp_id; 
+    proto_set_id(&header, opp_id, client_has_extended_ids(opp)); 
     clock_gettime(CLOCK_MONOTONIC, &time); 
     header.timestamp_sec = htonl((uint32_t)time.tv_sec); 
     header.timestamp_nsec = htonl((uint32_t)time.tv_nsec); 
     client_send_packet(opp, &header, NULL); 
     client_send_end(client, id, role%2+1); 
     client_send_end(opp, opp_id, role%2+1); 
-    player_post_result(client_get_player(client), client_get_player(opp), 2); 
+    player_post_result(player, opp_player, 2); 
+    client_unref_players(player, opp_player); 
     inv_unref(inv, "because pointer to invitation is now being discarded"); 
     return 0; 
 }
@@ -421,7 +1082,7 @@ int client_resign_game(CLIENT *client, int id) {
 int client_make_move(CLIENT *client, int id, char *move) {
     debug("[%d] Make move '%s' in game %d", client_get_fd(client), move, id); 
     pthread_mutex_lock(&client->mutex); 
-    INVITATION *inv = arraylist_get(client->invitations, id);
+    INVITATION *inv = smap_get(client->invitations, id); 
     if(inv) {
         inv_ref(inv, "for pointer to invitation copied from client's list"); 
     }
@@ -452,41 +1113,41 @@ int client_make_move(CLIENT *client, int id, char *move) {
         inv_unref(inv, "because pointer to invitation is now being discarded"); 
         return -1; 
     }
-    GAME_MOVE *gmove = game_parse_move(game, role, move); 
-    if(!gmove) {
+    // The move and the new state are kept on the stack, so that a move
+    // that does not end the game makes no heap allocations.
+    GAME_MOVE gmove; 
+    if(game_parse_move_into(game, role, move, &gmove)) {
         debug("[%d] Cannot parse move", client_get_fd(client)); 
         inv_unref(inv, "because pointer to invitation is now being discarded"); 
         return -1; 
     }
-    if(game_apply_move(game, gmove)) {
+    if(game_apply_move(game, &gmove)) {
         debug("[%d] Illegal move", client_get_fd(client)); 
         inv_unref(inv, "because pointer to invitation is now being discarded"); 
         return -1; 
     }
-    free(gmove); 
 
     JEUX_PACKET_HEADER header = {0}; 
-    char *data;
+    char data[GAME_STATE_BUFSIZE];
     struct timespec time;  
     header.type = JEUX_MOVED_PKT; 
-    pthread_mutex_lock(&opp->mutex); 
-    header.id = (uint8_t)arraylist_find(opp->invitations, inv);  
-    pthread_mutex_unlock(&opp->mutex); 
-    data = game_unparse_state(game); 
-    header.size = htons((uint16_t)strlen(data)); 
+    proto_set_id(&header, inv_get_id(inv, opp), client_has_extended_ids(opp)); 
+    header.size = htons((uint16_t)game_unparse_state_into(game, data)); 
     clock_gettime(CLOCK_MONOTONIC, &time); 
     header.timestamp_sec = htonl((uint32_t)time.tv_sec); 
     header.timestamp_nsec = htonl((uint32_t)time.tv_nsec); 
     client_send_packet(opp, &header, data); 
-    free(data); 
 
     if(game_is_over(game)) {
         GAME_ROLE winner = game_get_winner(game); 
         int opp_id; 
-        if (inv_close(inv, winner%2+1) || 
+        PLAYER *player = client_ref_player(client); 
+        PLAYER *opp_player = client_ref_player(opp); 
+        if (!player || !opp_player || inv_close(inv, winner%2+1) || 
             client_remove_invitation(client, inv) == -1 || 
             (opp_id = client_remove_invitation(opp, inv)) == -1) 
         {
+            client_unref_players(player, opp_player); 
             inv_unref(inv, "because pointer to invitation is now being discarded"); 
             return -1; 
         }
@@ -497,7 +1158,8 @@ int client_make_move(CLIENT *client, int id, char *move) {
             result = 2; 
         client_send_end(client, id, winner); 
         client_send_end(opp, opp_id, winner); 
-        player_post_result(client_get_player(client), client_get_player(opp), result); 
+        player_post_result(player, opp_player, result); 
+        client_unref_players(player, opp_player); 
     }
     inv_unref(inv, "because pointer to invitation is now being discarded"); 
     return 0; 
@@ -1,23 +1,88 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
 
 #include "client_registry.h"
+#include "client_registry_ext.h"
 #include "arraylist.h"
 #include "debug.h"
 
-typedef struct client_registry {
+#define CREG_SHARD_MIN 16
+#define CREG_NAME_BUCKETS_MIN 16
+
+size_t creg_client_limit = 0; 
+
+/*
+ * A shard holds the clients whose file descriptors are congruent to its
+ * index modulo CREG_SHARDS, the one with descriptor fd in slot
+ * fd / CREG_SHARDS.  Shards are kept on cache lines of their own, so
+ * that threads working on different shards do not contend.
+ */
+typedef struct creg_shard {
     pthread_mutex_t mutex; 
+    CLIENT **clients; 
+    size_t cap; 
+} __attribute__((aligned(64))) CREG_SHARD; 
+
+/*
+ * An entry in the username index, chained from its hash bucket.  The
+ * same entry is a node of the sorted index, a treap ordered by name and
+ * heap-ordered by a random priority, in which each node counts the nodes
+ * below it.  The priority is not derived from the name, which clients
+ * choose, so that no choice of names can make the treap degenerate.
+ */
+typedef struct creg_name {
+    struct creg_name *next; 
+    size_t hash; 
+    char *user; 
+    CLIENT *client; 
+    struct creg_name *left, *right; 
+    uint64_t priority; 
     size_t size; 
-    CLIENT *clients[MAX_CLIENTS]; 
+} CREG_NAME; 
+
+/*
+ * A lock stripe of the username index: a chained hash table of its own,
+ * which doubles in size once it holds as many names as it has buckets.
+ */
+typedef struct creg_stripe {
+    pthread_mutex_t mutex; 
+    CREG_NAME **buckets; 
+    size_t nbuckets, count; 
+} __attribute__((aligned(64))) CREG_STRIPE; 
+
+typedef struct client_registry {
+    CREG_SHARD shards[CREG_SHARDS]; 
+    CREG_STRIPE stripes[CREG_SHARDS]; 
+    pthread_rwlock_t index_lock; 
+    CREG_NAME *index; 
+    uint64_t index_rand;    // Priority generator state, under index_lock
+    size_t size; 
+    pthread_mutex_t mutex; 
     sem_t sem; 
     size_t waiting; 
 } CLIENT_REGISTRY; 
 
 CLIENT_REGISTRY *creg_init() {
     debug("Initialize client registry"); 
-    CLIENT_REGISTRY *cr = (CLIENT_REGISTRY *)calloc(sizeof(CLIENT_REGISTRY), 1);
+    CLIENT_REGISTRY *cr = (CLIENT_REGISTRY *)aligned_alloc(64, sizeof(CLIENT_REGISTRY)); 
+    memset(cr, 0, sizeof(CLIENT_REGISTRY)); 
+    for(int i = 0; i < CREG_SHARDS; ++i) {
+        pthread_mutex_init(&cr->shards[i].mutex, NULL); 
+        pthread_mutex_init(&cr->stripes[i].mutex, NULL); 
+    }
+    pthread_rwlock_init(&cr->index_lock, NULL); 
+    if(getrandom(&cr->index_rand, sizeof(cr->index_rand), GRND_NONBLOCK) != sizeof(cr->index_rand)) {
+        struct timespec now; 
+        clock_gettime(CLOCK_REALTIME, &now); 
+        cr->index_rand = (uint64_t)now.tv_nsec << 32 ^ (uint64_t)now.tv_sec ^ (uint64_t)getpid() << 16; 
+    }
+    cr->index_rand |= 1; 
     pthread_mutex_init(&cr->mutex, NULL); 
     sem_init(&cr->sem, 0, 0); 
     return cr; 
@@ -25,95 +90,392 @@ CLIENT_REGISTRY *creg_init() {
 
 void creg_fini(CLIENT_REGISTRY *cr) {
     debug("Finalize client registry"); 
+    // A thread that let the waiters go may still be unlocking the mutex.
+    pthread_mutex_lock(&cr->mutex); 
+    pthread_mutex_unlock(&cr->mutex); 
+    for(int i = 0; i < CREG_SHARDS; ++i) {
+        free(cr->shards[i].clients); 
+        pthread_mutex_destroy(&cr->shards[i].mutex); 
+        CREG_STRIPE *stripe = &cr->stripes[i]; 
+        for(size_t j = 0; j < stripe->nbuckets; ++j) {
+            while(stripe->buckets[j]) {
+                CREG_NAME *entry = stripe->buckets[j]; 
+                stripe->buckets[j] = entry->next; 
+                free(entry); 
+            }
+        }
+        free(stripe->buckets); 
+        pthread_mutex_destroy(&stripe->mutex); 
+    }
     sem_destroy(&cr->sem); 
+    pthread_rwlock_destroy(&cr->index_lock); 
     pthread_mutex_destroy(&cr->mutex); 
     free(cr); 
 }
 
-CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd) {
-    CLIENT *res = NULL; 
+/*
+ * Let threads in creg_wait_for_empty() go, if the registry is empty.
+ * The count is checked again under the mutex, in case a client was
+ * registered since it dropped to zero.
+ */
+static void creg_release_waiters(CLIENT_REGISTRY *cr) {
     pthread_mutex_lock(&cr->mutex); 
-    if(cr->size < MAX_CLIENTS) {
-        res = client_create(cr, fd);  
-        if(res) {
-            for(int i = 0; i < MAX_CLIENTS; ++i) {
-                if(cr->clients[i] == NULL) {
-                    cr->clients[i] = res; 
-                    cr->size++; 
-                    debug("Register client fd %d (total connected: %lu)", fd, cr->size);
-                    break; 
-                }
-            }
+    if(!__atomic_load_n(&cr->size, __ATOMIC_ACQUIRE)) {
+        while(cr->waiting) {
+            sem_post(&cr->sem); 
+            cr->waiting--; 
         }
     }
     pthread_mutex_unlock(&cr->mutex); 
+}
+
+CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd) {
+    if(fd < 0)
+        return NULL; 
+    // Claim a place first, so that the limit holds without a global lock.
+    size_t size = __atomic_add_fetch(&cr->size, 1, __ATOMIC_ACQ_REL); 
+    if(creg_client_limit && size > creg_client_limit) {
+        debug("Client limit (%lu) reached, refusing fd %d", creg_client_limit, fd); 
+        if(!__atomic_sub_fetch(&cr->size, 1, __ATOMIC_ACQ_REL))
+            creg_release_waiters(cr); 
+        return NULL; 
+    }
+    CREG_SHARD *shard = &cr->shards[fd % CREG_SHARDS]; 
+    size_t slot = fd / CREG_SHARDS; 
+    CLIENT *res = client_create(cr, fd); 
+    pthread_mutex_lock(&shard->mutex); 
+    if(res && slot >= shard->cap) {
+        size_t cap = shard->cap ? shard->cap : CREG_SHARD_MIN; 
+        while(cap <= slot)
+            cap *= 2; 
+        CLIENT **clients = (CLIENT **)realloc(shard->clients, cap * sizeof(CLIENT *)); 
+        if(clients) {
+            memset(clients + shard->cap, 0, (cap - shard->cap) * sizeof(CLIENT *)); 
+            shard->clients = clients; 
+            shard->cap = cap; 
+        }
+    }
+    if(res && slot < shard->cap && !shard->clients[slot]) {
+        shard->clients[slot] = res; 
+        debug("Register client fd %d (total connected: %lu)", fd, size); 
+    }
+    else if(res) {
+        debug("Failed to register client fd %d", fd); 
+        client_unref(res, "because client could not be registered"); 
+        res = NULL; 
+    }
+    pthread_mutex_unlock(&shard->mutex); 
+    if(!res && !__atomic_sub_fetch(&cr->size, 1, __ATOMIC_ACQ_REL))
+        creg_release_waiters(cr); 
     return res; 
 }
 
 int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client) {
     int res = -1; 
-    pthread_mutex_lock(&cr->mutex); 
-    for(int i = 0; i < MAX_CLIENTS; ++i) {
-        if(cr->clients[i] == client) {
-            cr->clients[i] = NULL; 
-            cr->size--; 
-            res = 0; 
-            debug("Unregister client fd %d (total connected: %lu)", client_get_fd(client), cr->size); 
-            client_unref(client, "because client is being unregistered");
-            break; 
-        }
+    int fd = client_get_fd(client); 
+    CREG_SHARD *shard = &cr->shards[fd % CREG_SHARDS]; 
+    size_t slot = fd / CREG_SHARDS; 
+    pthread_mutex_lock(&shard->mutex); 
+    if(slot < shard->cap && shard->clients[slot] == client) {
+        shard->clients[slot] = NULL; 
+        res = 0; 
     }
-    if(!cr->size) {
-        while(cr->waiting) {
-            sem_post(&cr->sem); 
-            cr->waiting--; 
-        }
+    pthread_mutex_unlock(&shard->mutex); 
+    if(res) {
+        debug("Client fd %d is not registered", fd); 
+        return res; 
     }
-    pthread_mutex_unlock(&cr->mutex); 
+    // The client is let go before it stops being counted, since once the
+    // count drops to zero, the registry and everything else may be
+    // finalized.
+    client_unref(client, "because client is being unregistered"); 
+    size_t size = __atomic_sub_fetch(&cr->size, 1, __ATOMIC_ACQ_REL); 
+    debug("Unregister client fd %d (total connected: %lu)", fd, size); 
+    if(!size)
+        creg_release_waiters(cr); 
     return res; 
 }
 
-CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user) {
-    CLIENT *res = NULL; 
-    pthread_mutex_lock(&cr->mutex); 
-    for(int i = 0; i < MAX_CLIENTS; ++i) {
-        if(cr->clients[i]) {
-            PLAYER *player = client_get_player(cr->clients[i]); 
-            if(player) {
-                char *name = player_get_name(player); 
-                if(!strcmp(user, name)) {
-                    client_ref(cr->clients[i], "for reference being returned by creg_lookup()"); 
-                    res = cr->clients[i]; 
-                    break; 
-                }
-            }
+/*
+ * FNV-1a hash of a username.  The low bits select the stripe and the
+ * remaining ones the bucket within it.
+ */
+static size_t creg_hash(char *user) {
+    size_t hash = 14695981039346656037UL; 
+    for(unsigned char *cp = (unsigned char *)user; *cp; ++cp)
+        hash = (hash ^ *cp) * 1099511628211UL; 
+    return hash; 
+}
+
+static CREG_STRIPE *creg_stripe(CLIENT_REGISTRY *cr, size_t hash) {
+    return &cr->stripes[hash % CREG_SHARDS]; 
+}
+
+static CREG_NAME **creg_find(CREG_STRIPE *stripe, size_t hash, char *user) {
+    if(!stripe->nbuckets)
+        return NULL; 
+    CREG_NAME **entryp = &stripe->buckets[hash / CREG_SHARDS % stripe->nbuckets]; 
+    while(*entryp && ((*entryp)->hash != hash || strcmp((*entryp)->user, user)))
+        entryp = &(*entryp)->next; 
+    return entryp; 
+}
+
+static void creg_grow(CREG_STRIPE *stripe) {
+    size_t nbuckets = stripe->nbuckets ? 2 * stripe->nbuckets : CREG_NAME_BUCKETS_MIN; 
+    CREG_NAME **buckets = (CREG_NAME **)calloc(sizeof(CREG_NAME *), nbuckets); 
+    if(!buckets)
+        return; 
+    for(size_t i = 0; i < stripe->nbuckets; ++i) {
+        while(stripe->buckets[i]) {
+            CREG_NAME *entry = stripe->buckets[i]; 
+            stripe->buckets[i] = entry->next; 
+            size_t j = entry->hash / CREG_SHARDS % nbuckets; 
+            entry->next = buckets[j]; 
+            buckets[j] = entry; 
         }
     }
-    pthread_mutex_unlock(&cr->mutex);  
+    free(stripe->buckets); 
+    stripe->buckets = buckets; 
+    stripe->nbuckets = nbuckets; 
+}
+
+/*
+ * Draw the priority of a new index node (xorshift64*).  The index must
+ * be write-locked.
+ */
+static uint64_t creg_index_priority(CLIENT_REGISTRY *cr) {
+    uint64_t x = cr->index_rand; 
+    x ^= x >> 12; 
+    x ^= x << 25; 
+    x ^= x >> 27; 
+    cr->index_rand = x; 
+    return x * 2685821657736338717ULL; 
+}
+
+static size_t creg_index_size(CREG_NAME *node) {
+    return node ? node->size : 0; 
+}
+
+static void creg_index_update(CREG_NAME *node) {
+    node->size = 1 + creg_index_size(node->left) + creg_index_size(node->right); 
+}
+
+/*
+ * Split a subtree into the names that sort before a name and the rest.
+ */
+static void creg_index_split(CREG_NAME *node, char *user, CREG_NAME **leftp, CREG_NAME **rightp) {
+    if(!node) {
+        *leftp = *rightp = NULL; 
+        return; 
+    }
+    if(strcmp(node->user, user) < 0) {
+        creg_index_split(node->right, user, &node->right, rightp); 
+        *leftp = node; 
+    }
+    else {
+        creg_index_split(node->left, user, leftp, &node->left); 
+        *rightp = node; 
+    }
+    creg_index_update(node); 
+}
+
+/*
+ * Join two subtrees, all of whose names in the first sort before those
+ * in the second.
+ */
+static CREG_NAME *creg_index_merge(CREG_NAME *left, CREG_NAME *right) {
+    if(!left || !right)
+        return left ? left : right; 
+    if(left->priority > right->priority) {
+        left->right = creg_index_merge(left->right, right); 
+        creg_index_update(left); 
+        return left; 
+    }
+    right->left = creg_index_merge(left, right->left); 
+    creg_index_update(right); 
+    return right; 
+}
+
+static CREG_NAME *creg_index_insert(CREG_NAME *node, CREG_NAME *entry) {
+    if(!node || entry->priority > node->priority) {
+        creg_index_split(node, entry->user, &entry->left, &entry->right); 
+        creg_index_update(entry); 
+        return entry; 
+    }
+    if(strcmp(entry->user, node->user) < 0)
+        node->left = creg_index_insert(node->left, entry); 
+    else
+        node->right = creg_index_insert(node->right, entry); 
+    creg_index_update(node); 
+    return node; 
+}
+
+static CREG_NAME *creg_index_remove(CREG_NAME *node, CREG_NAME *entry) {
+    if(!node)
+        return NULL; 
+    if(node == entry)
+        return creg_index_merge(node->left, node->right); 
+    if(strcmp(entry->user, node->user) < 0)
+        node->left = creg_index_remove(node->left, entry); 
+    else
+        node->right = creg_index_remove(node->right, entry); 
+    creg_index_update(node); 
+    return node; 
+}
+
+int creg_bind_name(CLIENT_REGISTRY *cr, char *user, CLIENT *client) {
+    size_t hash = creg_hash(user); 
+    CREG_STRIPE *stripe = creg_stripe(cr, hash); 
+    CREG_NAME *entry = (CREG_NAME *)malloc(sizeof(CREG_NAME)); 
+    entry->hash = hash; 
+    entry->user = user; 
+    entry->client = client; 
+    pthread_mutex_lock(&stripe->mutex); 
+    if(stripe->count >= stripe->nbuckets)
+        creg_grow(stripe); 
+    CREG_NAME **entryp = creg_find(stripe, hash, user); 
+    if(!entryp || *entryp) {
+        pthread_mutex_unlock(&stripe->mutex); 
+        free(entry); 
+        return -1; 
+    }
+    entry->next = NULL; 
+    *entryp = entry; 
+    stripe->count++; 
+    // The sorted index is updated with the stripe still locked, so that
+    // it never holds two entries for a name that is unbound and rebound.
+    pthread_rwlock_wrlock(&cr->index_lock); 
+    entry->priority = creg_index_priority(cr); 
+    cr->index = creg_index_insert(cr->index, entry); 
+    pthread_rwlock_unlock(&cr->index_lock); 
+    pthread_mutex_unlock(&stripe->mutex); 
+    debug("Bind '%s' to client %p", user, client); 
+    return 0; 
+}
+
+void creg_unbind_name(CLIENT_REGISTRY *cr, char *user, CLIENT *client) {
+    size_t hash = creg_hash(user); 
+    CREG_STRIPE *stripe = creg_stripe(cr, hash); 
+    CREG_NAME *entry = NULL; 
+    pthread_mutex_lock(&stripe->mutex); 
+    CREG_NAME **entryp = creg_find(stripe, hash, user); 
+    if(entryp && *entryp && (*entryp)->client == client) {
+        entry = *entryp; 
+        *entryp = entry->next; 
+        stripe->count--; 
+        pthread_rwlock_wrlock(&cr->index_lock); 
+        cr->index = creg_index_remove(cr->index, entry); 
+        pthread_rwlock_unlock(&cr->index_lock); 
+    }
+    pthread_mutex_unlock(&stripe->mutex); 
+    if(entry)
+        debug("Unbind '%s' from client %p", user, client); 
+    free(entry); 
+}
+
+CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user) {
+    CLIENT *res = NULL; 
+    size_t hash = creg_hash(user); 
+    CREG_STRIPE *stripe = creg_stripe(cr, hash); 
+    pthread_mutex_lock(&stripe->mutex); 
+    CREG_NAME **entryp = creg_find(stripe, hash, user); 
+    if(entryp && *entryp)
+        res = client_ref((*entryp)->client, "for reference being returned by creg_lookup()"); 
+    pthread_mutex_unlock(&stripe->mutex); 
     return res; 
 }
 
 PLAYER **creg_all_players(CLIENT_REGISTRY *cr) {
     ARRAYLIST *plist = arraylist_create(); 
-    pthread_mutex_lock(&cr->mutex);    
-    for(int i = 0; i < MAX_CLIENTS; ++i) {
-        if(cr->clients[i]) {
-            PLAYER *pp = client_get_player(cr->clients[i]);
-            if(pp) {
-                arraylist_push(plist, player_ref(pp, "for reference being added to players list"));
+    for(int i = 0; i < CREG_SHARDS; ++i) {
+        CREG_SHARD *shard = &cr->shards[i]; 
+        pthread_mutex_lock(&shard->mutex); 
+        for(size_t j = 0; j < shard->cap; ++j) {
+            if(shard->clients[j]) {
+                PLAYER *pp = client_get_player(shard->clients[j]); 
+                if(pp) {
+                    arraylist_push(plist, player_ref(pp, "for reference being added to players list")); 
+                }
             }
         }
+        pthread_mutex_unlock(&shard->mutex); 
     }
-    pthread_mutex_unlock(&cr->mutex); 
     PLAYER **players = (PLAYER **)arraylist_to_array(plist); 
     arraylist_free(plist); 
     return players; 
 }
 
+/*
+ * State of a walk over the sorted index for creg_find_players().
+ */
+typedef struct creg_query {
+    char *prefix; 
+    size_t prefixlen; 
+    size_t remaining; 
+    ARRAYLIST *players; 
+} CREG_QUERY; 
+
+/*
+ * Visit the nodes of a subtree in order, starting with the one at the
+ * given position within it, until a name without the prefix has been
+ * reached or the limit has been met.  Subtrees that lie wholly before the
+ * starting position are skipped by their sizes, so the cost is that of
+ * one descent plus the number of nodes visited.
+ *
+ * @return 1 if the walk is to go on, 0 if it has finished.
+ */
+static int creg_index_visit(CREG_NAME *node, size_t skip, CREG_QUERY *query) {
+    if(!node)
+        return 1; 
+    size_t nleft = creg_index_size(node->left); 
+    if(skip < nleft && !creg_index_visit(node->left, skip, query))
+        return 0; 
+    if(skip <= nleft) {
+        if(!query->remaining || strncmp(node->user, query->prefix, query->prefixlen))
+            return 0; 
+        // A client that has bound its name but not yet taken its player,
+        // or the other way about, is left out.
+        PLAYER *pp = client_get_player(node->client); 
+        if(pp) {
+            arraylist_push(query->players, player_ref(pp, "for reference being added to players list")); 
+            query->remaining--; 
+        }
+        skip = 0; 
+    }
+    else {
+        skip -= nleft + 1; 
+    }
+    return creg_index_visit(node->right, skip, query); 
+}
+
+PLAYER **creg_find_players(CLIENT_REGISTRY *cr, char *prefix, size_t offset, size_t limit) {
+    CREG_QUERY query = {prefix, strlen(prefix), limit ? limit : (size_t)-1, arraylist_create()}; 
+    pthread_rwlock_rdlock(&cr->index_lock); 
+    // The names with the prefix are those from the first name that does
+    // not sort before the prefix, up to the first one without it.
+    size_t start = 0; 
+    CREG_NAME *node = cr->index; 
+    while(node) {
+        if(strcmp(node->user, prefix) < 0) {
+            start += creg_index_size(node->left) + 1; 
+            node = node->right; 
+        }
+        else {
+            node = node->left; 
+        }
+    }
+    if(offset < creg_index_size(cr->index) - start)
+        creg_index_visit(cr->index, start + offset, &query); 
+    pthread_rwlock_unlock(&cr->index_lock); 
+    PLAYER **players = (PLAYER **)arraylist_to_array(query.players); 
+    arraylist_free(query.players); 
+    return players; 
+}
+
 void creg_wait_for_empty(CLIENT_REGISTRY *cr) {
     int done = 1; 
     pthread_mutex_lock(&cr->mutex); 
-    if(cr->size) {
+    if(__atomic_load_n(&cr->size, __ATOMIC_ACQUIRE)) {
         cr->waiting++; 
         done = 0; 
     }
@@ -123,13 +485,16 @@ void creg_wait_for_empty(CLIENT_REGISTRY *cr) {
 }
 
 void creg_shutdown_all(CLIENT_REGISTRY *cr) {
-    pthread_mutex_lock(&cr->mutex); 
-    for(int i = 0; i < MAX_CLIENTS; ++i) {
-        if(cr->clients[i]) {
-            int fd = client_get_fd(cr->clients[i]); 
-            debug("EOF on fd: %d", fd); 
-            shutdown(fd, SHUT_RD);     
+    for(int i = 0; i < CREG_SHARDS; ++i) {
+        CREG_SHARD *shard = &cr->shards[i]; 
+        pthread_mutex_lock(&shard->mutex); 
+        for(size_t j = 0; j < shard->cap; ++j) {
+            if(shard->clients[j]) {
+                int fd = client_get_fd(shard->clients[j]); 
+                debug("EOF on fd: %d", fd); 
+                shutdown(fd, SHUT_RD); 
+            }
         }
+        pthread_mutex_unlock(&shard->mutex); 
     }
-    pthread_mutex_unlock(&cr->mutex); 
-}
\ No newline at end of file
+}
@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "event_loop.h"
+#include "server.h"
+#include "server_ext.h"
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "client_ext.h"
+#include "debug.h"
+
+#define EVL_MAX_EVENTS 64
+#define EVL_MAX_BATCH 32
+
+typedef struct evl_conn {
+    int fd; 
+    CLIENT *client; 
+    PLAYER *player; 
+    PROTO_READER *reader; 
+    struct evl_loop *loop; 
+    struct evl_conn *next_ready; 
+    struct evl_conn *next_flush; 
+    int ready; 
+    int flushing; 
+    int closed; 
+} EVL_CONN; 
+
+typedef struct evl_loop {
+    pthread_t tid; 
+    int epfd; 
+    EVL_CONN *ready; 
+    EVL_CONN *flush; 
+} EVL_LOOP; 
+
+static EVL_LOOP *loops; 
+static int nloops; 
+static unsigned int next_loop; 
+static __thread EVL_LOOP *this_loop; 
+
+/*
+ * Wakeup hook for a connection's CLIENT.  Output queued while the owning
+ * loop is handling a request is written out once the loop is done with
+ * the events at hand.  Output queued by any other thread arms EPOLLOUT,
+ * so that the owning loop writes it out as soon as the socket has room.
+ */
+static void evl_wakeup(void *arg) {
+    EVL_CONN *conn = (EVL_CONN *)arg; 
+    if(this_loop == conn->loop) {
+        if(!conn->flushing) {
+            conn->flushing = 1; 
+            conn->next_flush = this_loop->flush; 
+            this_loop->flush = conn; 
+        }
+        return; 
+    }
+    struct epoll_event ev = {0}; 
+    ev.events = EPOLLIN | EPOLLOUT; 
+    ev.data.ptr = conn; 
+    epoll_ctl(conn->loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev); 
+}
+
+/*
+ * Tear down a connection.  A connection that is still on one of the
+ * loop's lists is only freed once it has been taken off.
+ */
+static void evl_close(EVL_LOOP *loop, EVL_CONN *conn) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL); 
+    proto_reader_destroy(conn->reader); 
+    jeux_client_finish(conn->client, conn->player); 
+    conn->closed = 1; 
+    if(!conn->ready && !conn->flushing)
+        free(conn); 
+}
+
+/*
+ * Write out as much of a connection's output as the socket will take,
+ * watching for EPOLLOUT only while some of it remains.  Returns -1 if the
+ * write failed and the connection was closed, in which case it may have
+ * been freed, otherwise 0.
+ */
+static int evl_flush(EVL_LOOP *loop, EVL_CONN *conn, int armed) {
+    struct epoll_event ev = {0}; 
+    ev.data.ptr = conn; 
+    // EPOLLOUT is disarmed before writing rather than after, so that a
+    // wakeup from another thread in between cannot be lost.
+    if(armed) {
+        ev.events = EPOLLIN; 
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev); 
+    }
+    int status = client_flush_output(conn->client); 
+    if(status < 0) {
+        debug("[%d] Write failed in event loop", conn->fd); 
+        evl_close(loop, conn); 
+        return -1; 
+    }
+    if(status > 0) {
+        ev.events = EPOLLIN | EPOLLOUT; 
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev); 
+    }
+    return 0; 
+}
+
+/*
+ * Handle readiness on a connection.  At most EVL_MAX_BATCH packets are
+ * dispatched before returning to epoll_wait(), so that one busy client
+ * cannot starve the others sharing the loop.  Packets that the reader
+ * has already buffered are invisible to epoll, so a connection cut off
+ * with data still buffered is put on the loop's ready list to be
+ * serviced again without waiting for the socket.
+ */
+static void evl_service(EVL_LOOP *loop, EVL_CONN *conn) {
+    JEUX_PACKET_HEADER hdr; 
+    void *data; 
+    int i, status = 0; 
+    for(i = 0; i < EVL_MAX_BATCH; ++i) {
+        if((status = proto_reader_next(conn->reader, &hdr, &data)))
+            break; 
+        jeux_client_dispatch(conn->client, &conn->player, &hdr, data); 
+    }
+    if(status == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        debug("[%d] EOF in event loop", conn->fd); 
+        evl_close(loop, conn); 
+    }
+    else if(i == EVL_MAX_BATCH && proto_reader_buffered(conn->reader)) {
+        conn->ready = 1; 
+        conn->next_ready = loop->ready; 
+        loop->ready = conn; 
+    }
+}
+
+static void *evl_run(void *arg) {
+    EVL_LOOP *loop = (EVL_LOOP *)arg; 
+    struct epoll_event events[EVL_MAX_EVENTS]; 
+    this_loop = loop; 
+    while(1) {
+        int n = epoll_wait(loop->epfd, events, EVL_MAX_EVENTS, loop->ready || loop->flush ? 0 : -1); 
+        if(n < 0) {
+            if(errno == EINTR)
+                continue; 
+            debug("epoll_wait: %s", strerror(errno)); 
+            break; 
+        }
+        // Connections on the ready list that also came back from
+        // epoll_wait() are serviced only once.  EPOLLOUT stays armed for
+        // those until they are flushed on a later pass.
+        for(int i = 0; i < n; ++i) {
+            EVL_CONN *conn = (EVL_CONN *)events[i].data.ptr; 
+            if(conn->ready)
+                continue; 
+            if(events[i].events & EPOLLOUT && evl_flush(loop, conn, 1))
+                continue; 
+            if(events[i].events & ~EPOLLOUT)
+                evl_service(loop, conn); 
+        }
+        EVL_CONN *ready = loop->ready; 
+        loop->ready = NULL; 
+        while(ready) {
+            EVL_CONN *conn = ready; 
+            ready = conn->next_ready; 
+            conn->ready = 0; 
+            if(!conn->closed)
+                evl_service(loop, conn); 
+            else if(!conn->flushing)
+                free(conn); 
+        }
+        // Responses to everything handled above go out with one write
+        // per connection.
+        EVL_CONN *flush = loop->flush; 
+        loop->flush = NULL; 
+        while(flush) {
+            EVL_CONN *conn = flush; 
+            flush = conn->next_flush; 
+            conn->flushing = 0; 
+            if(!conn->closed)
+                evl_flush(loop, conn, 0); 
+            else if(!conn->ready)
+                free(conn); 
+        }
+    }
+    return NULL; 
+}
+
+int evl_init(int n) {
+    if(n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN); 
+    if(n <= 0)
+        n = 1; 
+    loops = (EVL_LOOP *)calloc(sizeof(EVL_LOOP), n); 
+
+    // Loop threads must not take SIGHUP, since the handler waits for
+    // all clients (including the ones those threads serve) to go away.
+    sigset_t mask, omask; 
+    sigfillset(&mask); 
+    pthread_sigmask(SIG_BLOCK, &mask, &omask); 
+    for(nloops = 0; nloops < n; ++nloops) {
+        EVL_LOOP *loop = &loops[nloops]; 
+        if((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            debug("epoll_create1: %s", strerror(errno)); 
+            break; 
+        }
+        int status = pthread_create(&loop->tid, NULL, evl_run, loop); 
+        if(status != 0) {
+            debug("pthread_create: %s", strerror(status)); 
+            close(loop->epfd); 
+            break; 
+        }
+        pthread_detach(loop->tid); 
+    }
+    pthread_sigmask(SIG_SETMASK, &omask, NULL); 
+    debug("Started %d of %d event loops", nloops, n); 
+    return nloops ? 0 : -1; 
+}
+
+int evl_add(int fd) {
+    EVL_LOOP *loop = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % nloops]; 
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); 
+    CLIENT *client = creg_register(client_registry, fd); 
+    if(!client) {
+        debug("[%d] Failed to register client", fd); 
+        close(fd); 
+        return -1; 
+    }
+    EVL_CONN *conn = (EVL_CONN *)calloc(sizeof(EVL_CONN), 1); 
+    conn->fd = fd; 
+    conn->client = client; 
+    conn->loop = loop; 
+    conn->reader = proto_reader_create(fd); 
+    client_set_wakeup(client, evl_wakeup, conn); 
+    // EPOLLOUT starts out armed, in case output gets queued by another
+    // thread before the connection has been added.
+    struct epoll_event ev = {0}; 
+    ev.events = EPOLLIN | EPOLLOUT; 
+    ev.data.ptr = conn; 
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        debug("[%d] epoll_ctl: %s", fd, strerror(errno)); 
+        proto_reader_destroy(conn->reader); 
+        jeux_client_finish(client, NULL); 
+        free(conn); 
+        return -1; 
+    }
+    debug("[%d] Starting client service in event loop %ld", fd, loop - loops); 
+    return 0; 
+}
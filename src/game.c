@@ -1,99 +1,193 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include "game.h"
+#include "game_ext.h"
+#include "obj_pool.h"
 #include "debug.h"
 
+/*
+ * Every reachable position is worked out once, the first time a game is
+ * created, and kept in a table: from the empty board, each position leads
+ * to the ones reached by a move on each empty square, until one player has
+ * a line or the board is full.  Positions reached by different orders of
+ * moves are found by a base-3 key (square n contributes 3^(n-1) times 1
+ * for X or 2 for O) and share an entry, which leaves 5478 of them.  For
+ * each, the table knows whose turn it is, the legal moves and where they
+ * lead, and the winner, so that a game is just a pointer into the table.
+ *
+ * The board is kept as two 9-bit masks, one per player, of the squares
+ * the player has taken; square n (1 to 9, reading across the rows) is
+ * bit n-1.  The value of a position is the outcome with best play on
+ * both sides: 1 if X wins, -1 if O wins and 0 for a draw.
+ */
+typedef struct game_state {
+    uint16_t marks[2]; 
+    uint16_t moves;      // squares on which a move may be made
+    uint16_t best;       // those of the moves that keep the value
+    uint16_t next[9];    // index of the position after a move on each square
+    uint8_t turn, winner; 
+    int8_t value; 
+} GAME_STATE; 
+
+#define GAME_STATES 5478
+#define GAME_FULL 0x1ff
+
+static GAME_STATE game_states[GAME_STATES]; 
+static pthread_once_t game_states_once = PTHREAD_ONCE_INIT; 
+
+/*
+ * A game also keeps the rendering of its state, which is only ever
+ * changed in place: a move fills in one square and the player to move.
+ */
 typedef struct game {
     pthread_mutex_t mutex; 
     size_t refs; 
-    GAME_ROLE board[9]; 
-    GAME_ROLE turn, winner; 
+    const GAME_STATE *state; 
+    GAME_ROLE resigned; 
+    char text[GAME_STATE_BUFSIZE]; 
 } GAME; 
 
-typedef struct game_move {
-    GAME_ROLE role; 
-    int pos; 
-} GAME_MOVE; 
-
-const int game_wins[][3] = {
-    // horizontal
-    {0, 1, 2},
-    {3, 4, 5},
-    {6, 7, 8},
-    // vertical
-    {0, 3, 6},
-    {1, 4, 7},
-    {2, 5, 8},
-    // diagonal
-    {0, 4, 8},
-    {2, 4, 6},
+static const char game_empty_text[] = " | | \n-----\n | | \n-----\n | | \nX to move"; 
+
+#define GAME_TEXT_LEN (sizeof(game_empty_text) - 1)
+#define GAME_TEXT_SQUARE(pos) (((pos)-1) / 3 * 12 + ((pos)-1) % 3 * 2)
+#define GAME_TEXT_TURN 30
+
+_Static_assert(sizeof(game_empty_text) <= GAME_STATE_BUFSIZE, "GAME_STATE_BUFSIZE is too small"); 
+
+/*
+ * Bit m of this table is set if the squares in mask m include a whole
+ * row, column or diagonal, that is, one of
+ *   horizontal  0x007 0x038 0x1c0
+ *   vertical    0x049 0x092 0x124
+ *   diagonal    0x111 0x054
+ */
+static const uint64_t game_won[8] = {
+    0xff80808080808080UL, 0xfff0aa80faf0aa80UL, 0xffcc8080cccc8080UL, 0xfffcaa80fefcaa80UL,
+    0xfffaf0f0aaaa8080UL, 0xfffafaf0fafaaa80UL, 0xfffef0f0eeee8080UL, 0xffffffffffffffffUL
 }; 
 
+static int game_is_won(uint16_t mask) {
+    return game_won[mask >> 6] >> (mask & 63) & 1; 
+}
+
+/*
+ * Add the position with the given marks and key to the table, along with
+ * every position that can follow it, unless it is there already.
+ * Returns its index.
+ */
+static int game_states_add(int16_t *index, int *count, uint16_t x, uint16_t o, int key, GAME_ROLE turn) {
+    static const int pow3[9] = {1, 3, 9, 27, 81, 243, 729, 2187, 6561}; 
+    if(index[key] >= 0)
+        return index[key]; 
+    int i = index[key] = (*count)++; 
+    GAME_STATE *state = &game_states[i]; 
+    state->marks[0] = x; 
+    state->marks[1] = o; 
+    if(game_is_won(x) || game_is_won(o)) {
+        state->winner = game_is_won(x) ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE; 
+        state->value = game_is_won(x) ? 1 : -1; 
+        return i; 
+    }
+    if((x | o) == GAME_FULL)
+        return i; 
+    state->turn = turn; 
+    state->moves = ~(x | o) & GAME_FULL; 
+    int sign = turn == FIRST_PLAYER_ROLE ? 1 : -1; 
+    int value = -2; 
+    for(int pos = 0; pos < 9; ++pos) {
+        uint16_t square = 1 << pos; 
+        if(!(state->moves & square))
+            continue; 
+        int next = turn == FIRST_PLAYER_ROLE
+            ? game_states_add(index, count, x | square, o, key + pow3[pos], SECOND_PLAYER_ROLE)
+            : game_states_add(index, count, x, o | square, key + 2 * pow3[pos], FIRST_PLAYER_ROLE); 
+        state->next[pos] = next; 
+        int v = sign * game_states[next].value; 
+        if(v > value) {
+            value = v; 
+            state->best = 0; 
+        }
+        if(v == value)
+            state->best |= square; 
+    }
+    state->value = sign * value; 
+    return i; 
+}
+
+static void game_states_init(void) {
+    int16_t *index = malloc(19683 * sizeof(int16_t)); 
+    memset(index, -1, 19683 * sizeof(int16_t)); 
+    int count = 0; 
+    game_states_add(index, &count, 0, 0, 0, FIRST_PLAYER_ROLE); 
+    free(index); 
+    debug("Built table of %d game positions", count); 
+}
+
+static void game_init(void *obj) {
+    pthread_mutex_init(&((GAME *)obj)->mutex, NULL); 
+}
+
+static void game_fini(void *obj) {
+    pthread_mutex_destroy(&((GAME *)obj)->mutex); 
+}
+
+OBJ_POOL game_pool = OPOOL_INITIALIZER("GAME", sizeof(GAME), game_init, game_fini); 
+
 GAME *game_create() {
-    GAME *game = (GAME *)calloc(sizeof(GAME), 1); 
-    pthread_mutex_init(&game->mutex, NULL); 
-    game->turn = FIRST_PLAYER_ROLE; 
+    GAME *game = (GAME *)opool_alloc(&game_pool); 
+    pthread_once(&game_states_once, game_states_init); 
+    memset(&game->refs, 0, sizeof(GAME) - offsetof(GAME, refs)); 
+    game->state = &game_states[0]; 
+    memcpy(game->text, game_empty_text, sizeof(game_empty_text)); 
     return game_ref(game, "for newly created game"); 
 }
 
 GAME *game_ref(GAME *game, char *why) {
-    pthread_mutex_lock(&game->mutex); 
+    size_t refs __attribute__((unused)) = __atomic_add_fetch(&game->refs, 1, __ATOMIC_RELAXED); 
     debug("Increase reference count on game %p (%lu -> %lu) %s",
-        game, game->refs, game->refs+1, why); 
-    game->refs++; 
-    pthread_mutex_unlock(&game->mutex); 
+        game, refs-1, refs, why); 
     return game; 
 }
 
 void game_unref(GAME *game, char *why) {
-    size_t refs; 
-    pthread_mutex_lock(&game->mutex); 
+    size_t refs = __atomic_sub_fetch(&game->refs, 1, __ATOMIC_RELEASE); 
     debug("Decrease reference count on game %p (%lu -> %lu) %s",
-        game, game->refs, game->refs-1, why); 
-    refs = --game->refs; 
-    pthread_mutex_unlock(&game->mutex); 
+        game, refs+1, refs, why); 
     if(!refs) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); 
         debug("Free game %p", game); 
-        pthread_mutex_destroy(&game->mutex); 
-        free(game); 
+        opool_free(&game_pool, game); 
     }
 }
 
 int game_apply_move(GAME *game, GAME_MOVE *move) {
+#ifdef DEBUG
+    char str[GAME_MOVE_BUFSIZE]; 
+    game_unparse_move_into(move, str); 
+#endif
     pthread_mutex_lock(&game->mutex); 
-    if(move->role != game->turn) {
-        debug("Specified role (%d) does not match the role (%d) who is to move", move->role, game->turn); 
+    const GAME_STATE *state = game->state; 
+    if(game->resigned || move->role != state->turn) {
+        debug("Specified role (%d) does not match the role (%d) who is to move", move->role,
+            game->resigned ? NULL_ROLE : state->turn); 
         pthread_mutex_unlock(&game->mutex); 
         return -1; 
     }
-    if(game->board[move->pos-1]) {
-        debug("Cannot apply move %s: position is already taken", game_unparse_move(move)); 
+    if(!(state->moves & 1 << (move->pos-1))) {
+        debug("Cannot apply move %s: position is already taken", str); 
         pthread_mutex_unlock(&game->mutex); 
         return -1; 
     }
-    debug("Apply move %s on game %p", game_unparse_move(move), game); 
-    game->board[move->pos-1] = move->role; 
-    game->turn = game->turn%2+1; 
-    for(int i = 0; i < sizeof(game_wins)/sizeof(game_wins[0]); ++i) {
-        if (game->board[game_wins[i][0]] == move->role && 
-            game->board[game_wins[i][0]] == game->board[game_wins[i][1]] &&
-            game->board[game_wins[i][1]] == game->board[game_wins[i][2]])
-        {
-            game->winner = move->role; 
-            game->turn = NULL_ROLE;         
-            break; 
-        }
-    }      
-    int tie = game->turn; 
-    for(int i = 0; i < sizeof(game->board)/sizeof(game->board[0]) && tie; ++i) {
-        tie = tie && game->board[i]; 
-    }
-    if(tie) {
-        game->winner = NULL_ROLE; 
-        game->turn = NULL_ROLE; 
-    }
+    debug("Apply move %s on game %p", str, game); 
+    game->state = &game_states[state->next[move->pos-1]]; 
+    game->text[GAME_TEXT_SQUARE(move->pos)] = move->role == FIRST_PLAYER_ROLE ? 'X' : 'O'; 
+    game->text[GAME_TEXT_TURN] = game->state->turn == FIRST_PLAYER_ROLE ? 'X' : 'O'; 
     pthread_mutex_unlock(&game->mutex); 
     return 0; 
 }
@@ -101,41 +195,32 @@ int game_apply_move(GAME *game, GAME_MOVE *move) {
 int game_resign(GAME *game, GAME_ROLE role) {
     int res = -1; 
     pthread_mutex_lock(&game->mutex); 
-    if(game->turn && role) {
-        game->winner = role%2+1; 
-        game->turn = NULL_ROLE; 
+    if(game->state->turn && !game->resigned && role) {
+        game->resigned = role; 
+        game->text[GAME_TEXT_TURN] = 'O'; 
         res = 0;         
     }
     pthread_mutex_unlock(&game->mutex); 
     return res; 
 }
 
-char *game_unparse_state(GAME *game) {
-    char *state; 
-    size_t len; 
-    FILE *stream = open_memstream(&state, &len); 
+size_t game_unparse_state_into(GAME *game, char *buf) {
     pthread_mutex_lock(&game->mutex);  
-    for(int i = 0; i < 3; ++i) {
-        for(int j = 0; j < 3; ++j) {
-            int pos = 3*i+j; 
-            char ch = ' '; 
-            if(game->board[pos])
-                ch = game->board[pos] == FIRST_PLAYER_ROLE ? 'X' : 'O'; 
-            fprintf(stream, "%c%c", ch, j < 2 ? '|' : '\n'); 
-        }
-        if(i < 2)
-            fprintf(stream, "-----\n"); 
-    }
-    fprintf(stream, "%c to move", game->turn == FIRST_PLAYER_ROLE ? 'X' : 'O'); 
+    memcpy(buf, game->text, GAME_TEXT_LEN + 1); 
     pthread_mutex_unlock(&game->mutex); 
-    fclose(stream); 
-    return state; 
+    return GAME_TEXT_LEN; 
+}
+
+char *game_unparse_state(GAME *game) {
+    char buf[GAME_STATE_BUFSIZE]; 
+    game_unparse_state_into(game, buf); 
+    return strdup(buf); 
 }
 
 int game_is_over(GAME *game) {
     int is_over; 
     pthread_mutex_lock(&game->mutex); 
-    is_over = !game->turn; 
+    is_over = game->resigned || !game->state->turn; 
     pthread_mutex_unlock(&game->mutex);  
     return is_over; 
 }
@@ -143,27 +228,48 @@ int game_is_over(GAME *game) {
 GAME_ROLE game_get_winner(GAME *game) {
     GAME_ROLE winner; 
     pthread_mutex_lock(&game->mutex);  
-    winner = game->winner; 
+    winner = game->resigned ? game->resigned%2+1 : game->state->winner; 
     pthread_mutex_unlock(&game->mutex);
     return winner; 
 }
 
-GAME_MOVE *game_parse_move(GAME *game, GAME_ROLE role, char *str) {
+int game_suggest_move(GAME *game, GAME_ROLE role, GAME_MOVE *move) {
+    pthread_mutex_lock(&game->mutex); 
+    const GAME_STATE *state = game->state; 
+    int ok = !game->resigned && role && role == state->turn; 
+    pthread_mutex_unlock(&game->mutex); 
+    if(!ok)
+        return -1; 
+    move->role = role; 
+    move->pos = __builtin_ctz(state->best) + 1; 
+    return 0; 
+}
+
+int game_parse_move_into(GAME *game, GAME_ROLE role, char *str, GAME_MOVE *move) {
     char *end; 
     int pos = strtol(str, &end, 10); 
     if(!role || *end || !(1 <= pos && pos <= 9))
-        return NULL; 
-    GAME_MOVE *move = malloc(sizeof(GAME_MOVE)); 
+        return -1; 
     move->role = role; 
     move->pos = pos;
+    return 0; 
+}
+
+GAME_MOVE *game_parse_move(GAME *game, GAME_ROLE role, char *str) {
+    GAME_MOVE *move = malloc(sizeof(GAME_MOVE)); 
+    if(game_parse_move_into(game, role, str, move)) {
+        free(move); 
+        return NULL; 
+    }
     return move; 
 }
 
+char *game_unparse_move_into(GAME_MOVE *move, char *buf) {
+    snprintf(buf, GAME_MOVE_BUFSIZE, "%d<-%c", move->pos, move->role == FIRST_PLAYER_ROLE ? 'X' : 'O'); 
+    return buf; 
+}
+
 char *game_unparse_move(GAME_MOVE *move) {
-    char *str; 
-    size_t len; 
-    FILE *stream = open_memstream(&str, &len); 
-    fprintf(stream, "%d<-%c", move->pos, move->role == FIRST_PLAYER_ROLE ? 'X' : 'O'); 
-    fclose(stream); 
-    return str; 
-}
\ No newline at end of file
+    char buf[GAME_MOVE_BUFSIZE]; 
+    return strdup(game_unparse_move_into(move, buf)); 
+}
@@ -1,7 +1,11 @@
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 #include <pthread.h>
 
 #include "client_registry.h"
+#include "invitation_ext.h"
+#include "obj_pool.h"
 #include "debug.h"
 
 typedef struct invitation {
@@ -9,50 +13,57 @@ typedef struct invitation {
     size_t refs; 
     CLIENT *source, *target; 
     GAME_ROLE source_role, target_role; 
+    int source_id, target_id; 
     GAME *game; 
     INVITATION_STATE state; 
 } INVITATION; 
 
+static void inv_init(void *obj) {
+    pthread_mutex_init(&((INVITATION *)obj)->mutex, NULL); 
+}
+
+static void inv_fini(void *obj) {
+    pthread_mutex_destroy(&((INVITATION *)obj)->mutex); 
+}
+
+OBJ_POOL inv_pool = OPOOL_INITIALIZER("INVITATION", sizeof(INVITATION), inv_init, inv_fini); 
+
 INVITATION *inv_create(CLIENT *source, CLIENT *target, 
                 GAME_ROLE source_role, GAME_ROLE target_role) {
     if(source == target) {
         debug("Source and target cannot be same client"); 
         return NULL; 
     }
-    INVITATION *inv = (INVITATION *)calloc(sizeof(INVITATION), 1); 
-    pthread_mutex_init(&inv->mutex, NULL); 
+    INVITATION *inv = (INVITATION *)opool_alloc(&inv_pool); 
+    memset(&inv->refs, 0, sizeof(INVITATION) - offsetof(INVITATION, refs)); 
     inv->source = client_ref(source, "as source of new invitation"); 
     inv->target = client_ref(target, "as target of new invitation"); 
     inv->source_role = source_role; 
     inv->target_role = target_role; 
+    inv->source_id = inv->target_id = -1; 
     inv->state = INV_OPEN_STATE; 
     return inv_ref(inv, "for newly created invitation"); 
 }
 
 INVITATION *inv_ref(INVITATION *inv, char *why) {
-    pthread_mutex_lock(&inv->mutex); 
+    size_t refs __attribute__((unused)) = __atomic_add_fetch(&inv->refs, 1, __ATOMIC_RELAXED); 
     debug("Increase reference count on invitation %p (%lu -> %lu) %s",
-        inv, inv->refs, inv->refs+1, why); 
-    inv->refs++; 
-    pthread_mutex_unlock(&inv->mutex); 
+        inv, refs-1, refs, why); 
     return inv; 
 }
 
 void inv_unref(INVITATION *inv, char *why) {
-    int refs; 
-    pthread_mutex_lock(&inv->mutex); 
+    size_t refs = __atomic_sub_fetch(&inv->refs, 1, __ATOMIC_RELEASE); 
     debug("Decrease reference count on invitation %p (%lu -> %lu) %s",
-        inv, inv->refs, inv->refs-1, why); 
-    refs = --inv->refs; 
-    pthread_mutex_unlock(&inv->mutex); 
+        inv, refs+1, refs, why); 
     if(!refs) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); 
         debug("Free invitation %p", inv); 
         client_unref(inv->source, "because invitation is being freed"); 
         client_unref(inv->target, "becuase invitation is being freed"); 
         if(inv->game)
             game_unref(inv->game, "because invitation is being freed"); 
-        pthread_mutex_destroy(&inv->mutex); 
-        free(inv); 
+        opool_free(&inv_pool, inv); 
     }
 }
 
@@ -96,6 +107,26 @@ GAME *inv_get_game(INVITATION *inv) {
     return game; 
 }
 
+void inv_set_id(INVITATION *inv, CLIENT *client, int id) {
+    pthread_mutex_lock(&inv->mutex); 
+    if(client == inv->source)
+        inv->source_id = id; 
+    else if(client == inv->target)
+        inv->target_id = id; 
+    pthread_mutex_unlock(&inv->mutex); 
+}
+
+int inv_get_id(INVITATION *inv, CLIENT *client) {
+    int id = -1; 
+    pthread_mutex_lock(&inv->mutex); 
+    if(client == inv->source)
+        id = inv->source_id; 
+    else if(client == inv->target)
+        id = inv->target_id; 
+    pthread_mutex_unlock(&inv->mutex); 
+    return id; 
+}
+
 int inv_accept(INVITATION *inv) {
     int res = -1; 
     pthread_mutex_lock(&inv->mutex); 
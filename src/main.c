@@ -13,8 +13,17 @@
 #include "debug.h"
 #include "protocol.h"
 #include "server.h"
+#include "event_loop.h"
+#include "worker_pool.h"
+#include "acceptor.h"
+#include "proto_uring.h"
+#include "payload_pool.h"
+#include "obj_pool.h"
 #include "client_registry.h"
+#include "client_registry_ext.h"
+#include "client_ext.h"
 #include "player_registry.h"
+#include "user_list.h"
 #include "jeux_globals.h"
 
 #ifdef DEBUG
@@ -22,26 +31,117 @@ int _debug_packets_ = 1;
 #endif
 
 static int listenfd = -1; 
+static int nacceptors = 0; 
+static int event_mode = 0; 
+static int nworkers = 0; 
+static pthread_attr_t attr; 
 
 static void terminate(int status);
 static void sighup_handler(int signum); 
+static void serve_connection(int connfd); 
 
 /*
  * "Jeux" game server.
  *
- * Usage: jeux <port>
+ * Usage: jeux -p <port> [-e] [-n <loops>] [-u] [-b <bytes>] [-q <packets>]
+ *             [-w <workers>] [-s <KiB>] [-a <acceptors>] [-c <clients>]
  */
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
-    // on which the server should listen.
-    if(argc != 3 || strcmp(argv[1], "-p")) {
-        fprintf(stderr, "Usage: %s -p <port>\n", argv[0]); 
-        return EXIT_FAILURE; 
-    }
+    // on which the server should listen.  Option '-e' serves connections
+    // from a fixed set of event loops (as many as given by '-n <loops>',
+    // by default one per processor) instead of a thread per connection.
+    // Option '-u' selects the io_uring I/O backend, if the kernel has it;
+    // it is only used with a thread per connection, since the event loops
+    // never block on a socket.  Options '-b <bytes>' and '-q <packets>'
+    // limit how much output may be waiting for a client before it is
+    // treated as a slow consumer (0 for no limit).  Option '-w <workers>'
+    // serves connections from a pool of pre-started threads instead of
+    // starting one per connection, and '-s <KiB>' sets the stack size of
+    // service threads.  Option '-a <acceptors>' accepts connections on
+    // that many threads, each with its own listening socket on the port.
+    // Option '-c <clients>' limits the number of clients connected at once
+    // (by default there is no limit).
+    char *port = NULL; 
+    int nloops = 0; 
+    int use_uring = 0; 
+    size_t stacksize = 0; 
+    long limit; 
+    int opt; 
     char *end; 
-    if(strtol(argv[2], &end, 10) < 0 || *end) {
-        fprintf(stderr, "Invalid port number %s\n", argv[2]);         
+    while((opt = getopt(argc, argv, "p:en:ub:q:w:s:a:c:")) != -1) {
+        switch(opt) {
+            case 'p': 
+                port = optarg; 
+                if(strtol(port, &end, 10) < 0 || *end) {
+                    fprintf(stderr, "Invalid port number %s\n", port);         
+                    return EXIT_FAILURE; 
+                }
+                break; 
+            case 'e': 
+                event_mode = 1; 
+                break; 
+            case 'n': 
+                nloops = strtol(optarg, &end, 10); 
+                if(nloops <= 0 || *end) {
+                    fprintf(stderr, "Invalid number of event loops %s\n", optarg); 
+                    return EXIT_FAILURE; 
+                }
+                break; 
+            case 'u': 
+                use_uring = 1; 
+                break; 
+            case 'b': 
+            case 'q': 
+                limit = strtol(optarg, &end, 10); 
+                if(limit < 0 || *end) {
+                    fprintf(stderr, "Invalid output limit %s\n", optarg); 
+                    return EXIT_FAILURE; 
+                }
+                if(opt == 'b')
+                    client_obuf_budget = limit; 
+                else
+                    client_opkt_budget = limit; 
+                break; 
+            case 'w': 
+                nworkers = strtol(optarg, &end, 10); 
+                if(nworkers <= 0 || *end) {
+                    fprintf(stderr, "Invalid number of workers %s\n", optarg); 
+                    return EXIT_FAILURE; 
+                }
+                break; 
+            case 's': 
+                limit = strtol(optarg, &end, 10); 
+                if(limit <= 0 || *end) {
+                    fprintf(stderr, "Invalid stack size %s\n", optarg); 
+                    return EXIT_FAILURE; 
+                }
+                stacksize = limit * 1024; 
+                break; 
+            case 'a': 
+                nacceptors = strtol(optarg, &end, 10); 
+                if(nacceptors <= 0 || *end) {
+                    fprintf(stderr, "Invalid number of acceptors %s\n", optarg); 
+                    return EXIT_FAILURE; 
+                }
+                break; 
+            case 'c': 
+                limit = strtol(optarg, &end, 10); 
+                if(limit < 0 || *end) {
+                    fprintf(stderr, "Invalid client limit %s\n", optarg); 
+                    return EXIT_FAILURE; 
+                }
+                creg_client_limit = limit; 
+                break; 
+            default: 
+                port = NULL; 
+                optind = argc; 
+                break; 
+        }
+    }
+    if(!port || optind != argc) {
+        fprintf(stderr, "Usage: %s -p <port> [-e] [-n <loops>] [-u] [-b <bytes>] [-q <packets>] [-w <workers>] [-s <KiB>] [-a <acceptors>] [-c <clients>]\n", argv[0]); 
         return EXIT_FAILURE; 
     }
     
@@ -69,32 +169,69 @@ int main(int argc, char* argv[]){
         terminate(EXIT_FAILURE); 
     }
 
-    int *connfdp; 
     socklen_t clientlen; 
     struct sockaddr_storage clientaddr;
-    pthread_t tid; 
-    listenfd = open_listenfd(argv[2]); 
-    if(listenfd < 0) {
+    if(!nacceptors && (listenfd = open_listenfd(port)) < 0) {
         debug("open_listenfd: %s", strerror(errno)); 
         terminate(EXIT_FAILURE); 
     }
-    debug("Jeux server listening on port %d", atoi(argv[2])); 
+    if(use_uring && event_mode)
+        debug("io_uring is not used by the event loops, using non-blocking I/O"); 
+    else if(use_uring && proto_uring_init() < 0)
+        debug("io_uring is not available, using blocking I/O"); 
+    if(event_mode && evl_init(nloops) < 0) {
+        debug("Failed to start event loops"); 
+        terminate(EXIT_FAILURE); 
+    }
+    if(!event_mode && nworkers && wpool_init(nworkers, stacksize) < 0) {
+        debug("Failed to start workers"); 
+        terminate(EXIT_FAILURE); 
+    }
+    pthread_attr_init(&attr); 
+    if(stacksize && (errno = pthread_attr_setstacksize(&attr, stacksize))) {
+        debug("pthread_attr_setstacksize: %s", strerror(errno)); 
+        terminate(EXIT_FAILURE); 
+    }
+    if(nacceptors && acc_start(port, nacceptors, serve_connection) < 0) {
+        debug("Failed to start acceptors"); 
+        terminate(EXIT_FAILURE); 
+    }
+    debug("Jeux server listening on port %d", atoi(port)); 
 
+    // With acceptor threads, the main thread only waits for SIGHUP.
+    while(nacceptors)
+        pause(); 
     while(1) {
         clientlen = sizeof(clientaddr); 
-        connfdp = malloc(sizeof(int)); 
-        *connfdp = accept(listenfd, (SA *)&clientaddr, &clientlen); 
-        if(*connfdp >= 0) {
-            int status = pthread_create(&tid, NULL, jeux_client_service, connfdp); 
-            if(status != 0) {
-                free(connfdp); 
-                debug("pthread_create: %s\n", strerror(status)); 
-            }
-        }
-        else {
-            free(connfdp); 
+        int connfd = accept(listenfd, (SA *)&clientaddr, &clientlen); 
+        if(connfd >= 0)
+            serve_connection(connfd); 
+        else
             debug("accept: %s\n", strerror(errno)); 
-        }
+    }
+}
+
+/*
+ * Hand an accepted connection over to whatever serves connections:
+ * an event loop, the worker pool, or a new thread of its own.
+ */
+static void serve_connection(int connfd) {
+    if(event_mode) {
+        evl_add(connfd); 
+        return; 
+    }
+    if(nworkers) {
+        wpool_submit(connfd); 
+        return; 
+    }
+    pthread_t tid; 
+    int *connfdp = malloc(sizeof(int)); 
+    *connfdp = connfd; 
+    int status = pthread_create(&tid, &attr, jeux_client_service, connfdp); 
+    if(status != 0) {
+        free(connfdp); 
+        close(connfd); 
+        debug("pthread_create: %s\n", strerror(status)); 
     }
 }
 
@@ -105,6 +242,8 @@ void terminate(int status) {
     // Close listening socket if open
     if(listenfd >= 0 && fcntl(listenfd, F_GETFD) != -1)
         close(listenfd); 
+    // Stop the acceptors, if there are any instead
+    acc_stop(); 
 
     // Shutdown all client connections.
     // This will trigger the eventual termination of service threads.
@@ -117,7 +256,22 @@ void terminate(int status) {
     // Finalize modules.
     creg_fini(client_registry);
     preg_fini(player_registry);
+    ulist_fini(); 
 
+#ifdef DEBUG
+    PPOOL_STATS stats; 
+    ppool_get_stats(&stats); 
+    debug("%ld: Payload pool: %lu allocs (%lu from thread caches, %lu from depot, %lu malloc'd), %lu frees", 
+        pthread_self(), stats.allocs, stats.cache_hits, stats.depot_hits, stats.mallocs, stats.frees); 
+    OBJ_POOL *pools[] = {&client_pool, &inv_pool, &game_pool}; 
+    for(int i = 0; i < 3; ++i) {
+        OPOOL_STATS ostats; 
+        opool_get_stats(pools[i], &ostats); 
+        debug("%ld: %s pool: %lu allocs (%lu from thread caches, %lu from depot, %lu created), %lu in use, %lu idle", 
+            pthread_self(), pools[i]->name, ostats.allocs, ostats.cache_hits, ostats.depot_hits, ostats.mallocs, 
+            ostats.in_use, ostats.idle); 
+    }
+#endif
     debug("%ld: Jeux server terminating", pthread_self());
     exit(status);
 }
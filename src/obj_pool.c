@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "obj_pool.h"
+
+#define OPOOL_MAX 16
+#define OPOOL_CACHE_MAX 64
+#define OPOOL_DEPOT_MAX 4096
+
+/*
+ * Every object is preceded by a header, which links it into a free list
+ * while it is not in use, and is aligned so that the object is suitably
+ * aligned for anything.
+ */
+struct opool_hdr {
+    _Alignas(max_align_t) OPOOL_HDR *next; 
+}; 
+
+struct opool_cache {
+    OBJ_POOL *pool; 
+    OPOOL_HDR *free; 
+    int nfree; 
+    OPOOL_STATS stats; 
+    OPOOL_CACHE *next; 
+}; 
+
+static pthread_mutex_t opool_mutex = PTHREAD_MUTEX_INITIALIZER; 
+static int npools; 
+
+static pthread_key_t cache_key; 
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT; 
+static __thread OPOOL_CACHE *caches[OPOOL_MAX]; 
+
+// Counters are only written by the thread owning the cache, but may be
+// read by any thread.
+#define OPOOL_COUNT(c, field) \
+    __atomic_store_n(&(c)->stats.field, (c)->stats.field + 1, __ATOMIC_RELAXED)
+
+static int opool_cache_max(OBJ_POOL *pool) {
+    return pool->cache_max ? pool->cache_max : OPOOL_CACHE_MAX; 
+}
+
+static int opool_depot_max(OBJ_POOL *pool) {
+    return pool->depot_max ? pool->depot_max : OPOOL_DEPOT_MAX; 
+}
+
+/*
+ * Move up to n objects from a thread cache to the depot, finalizing and
+ * freeing those for which the depot has no room.  The caller must hold
+ * the pool's mutex.
+ */
+static void opool_release(OPOOL_CACHE *c, int n) {
+    OBJ_POOL *pool = c->pool; 
+    while(n-- && c->free) {
+        OPOOL_HDR *hdr = c->free; 
+        c->free = hdr->next; 
+        c->nfree--; 
+        if(pool->ndepot < opool_depot_max(pool)) {
+            hdr->next = pool->depot; 
+            pool->depot = hdr; 
+            pool->ndepot++; 
+        }
+        else {
+            if(pool->fini)
+                pool->fini(hdr + 1); 
+            free(hdr); 
+            OPOOL_COUNT(c, destroys); 
+        }
+        OPOOL_COUNT(c, releases); 
+    }
+}
+
+/*
+ * Hand the caches of an exiting thread back to their pools.
+ */
+static void opool_caches_free(void *arg) {
+    OPOOL_CACHE **cp = (OPOOL_CACHE **)arg; 
+    for(int i = 0; i < OPOOL_MAX; ++i) {
+        OPOOL_CACHE *c = cp[i]; 
+        if(!c)
+            continue; 
+        OBJ_POOL *pool = c->pool; 
+        pthread_mutex_lock(&pool->mutex); 
+        opool_release(c, c->nfree); 
+        pool->retired.allocs += c->stats.allocs; 
+        pool->retired.frees += c->stats.frees; 
+        pool->retired.cache_hits += c->stats.cache_hits; 
+        pool->retired.depot_hits += c->stats.depot_hits; 
+        pool->retired.mallocs += c->stats.mallocs; 
+        pool->retired.destroys += c->stats.destroys; 
+        pool->retired.releases += c->stats.releases; 
+        for(OPOOL_CACHE **pp = &pool->caches; *pp; pp = &(*pp)->next) {
+            if(*pp == c) {
+                *pp = c->next; 
+                break; 
+            }
+        }
+        pthread_mutex_unlock(&pool->mutex); 
+        free(c); 
+        cp[i] = NULL; 
+    }
+}
+
+static void opool_key_init(void) {
+    pthread_key_create(&cache_key, opool_caches_free); 
+}
+
+/*
+ * Get the calling thread's cache for a pool, giving the pool an index
+ * the first time it is used.
+ */
+static OPOOL_CACHE *opool_cache(OBJ_POOL *pool) {
+    int index = __atomic_load_n(&pool->index, __ATOMIC_ACQUIRE); 
+    if(index < 0) {
+        pthread_mutex_lock(&opool_mutex); 
+        if(pool->index < 0) {
+            if(npools == OPOOL_MAX)
+                abort(); 
+            __atomic_store_n(&pool->index, npools++, __ATOMIC_RELEASE); 
+        }
+        index = pool->index; 
+        pthread_mutex_unlock(&opool_mutex); 
+    }
+    OPOOL_CACHE *c = caches[index]; 
+    if(!c) {
+        pthread_once(&cache_once, opool_key_init); 
+        c = caches[index] = (OPOOL_CACHE *)calloc(sizeof(OPOOL_CACHE), 1); 
+        c->pool = pool; 
+        pthread_setspecific(cache_key, caches); 
+        pthread_mutex_lock(&pool->mutex); 
+        c->next = pool->caches; 
+        pool->caches = c; 
+        pthread_mutex_unlock(&pool->mutex); 
+    }
+    return c; 
+}
+
+void *opool_alloc(OBJ_POOL *pool) {
+    OPOOL_CACHE *c = opool_cache(pool); 
+    OPOOL_HDR *hdr; 
+    OPOOL_COUNT(c, allocs); 
+
+    // Refill an empty cache with up to half a cache's worth from the depot.
+    if(!c->free && __atomic_load_n(&pool->depot, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&pool->mutex); 
+        for(int n = opool_cache_max(pool) / 2; n > 0 && pool->depot; --n) {
+            hdr = pool->depot; 
+            pool->depot = hdr->next; 
+            pool->ndepot--; 
+            hdr->next = c->free; 
+            c->free = hdr; 
+            c->nfree++; 
+        }
+        pthread_mutex_unlock(&pool->mutex); 
+        if(c->free)
+            OPOOL_COUNT(c, depot_hits); 
+    }
+    else if(c->free) {
+        OPOOL_COUNT(c, cache_hits); 
+    }
+
+    if((hdr = c->free)) {
+        c->free = hdr->next; 
+        c->nfree--; 
+    }
+    else {
+        OPOOL_COUNT(c, mallocs); 
+        hdr = (OPOOL_HDR *)malloc(sizeof(OPOOL_HDR) + pool->size); 
+        if(pool->init)
+            pool->init(hdr + 1); 
+    }
+    return hdr + 1; 
+}
+
+void opool_free(OBJ_POOL *pool, void *obj) {
+    OPOOL_CACHE *c = opool_cache(pool); 
+    OPOOL_HDR *hdr = (OPOOL_HDR *)obj - 1; 
+    OPOOL_COUNT(c, frees); 
+    if(c->nfree == opool_cache_max(pool)) {
+        pthread_mutex_lock(&pool->mutex); 
+        opool_release(c, c->nfree / 2); 
+        pthread_mutex_unlock(&pool->mutex); 
+    }
+    hdr->next = c->free; 
+    c->free = hdr; 
+    c->nfree++; 
+}
+
+void opool_get_stats(OBJ_POOL *pool, OPOOL_STATS *stats) {
+    pthread_mutex_lock(&pool->mutex); 
+    *stats = pool->retired; 
+    for(OPOOL_CACHE *c = pool->caches; c; c = c->next) {
+        stats->allocs += __atomic_load_n(&c->stats.allocs, __ATOMIC_RELAXED); 
+        stats->frees += __atomic_load_n(&c->stats.frees, __ATOMIC_RELAXED); 
+        stats->cache_hits += __atomic_load_n(&c->stats.cache_hits, __ATOMIC_RELAXED); 
+        stats->depot_hits += __atomic_load_n(&c->stats.depot_hits, __ATOMIC_RELAXED); 
+        stats->mallocs += __atomic_load_n(&c->stats.mallocs, __ATOMIC_RELAXED); 
+        stats->destroys += __atomic_load_n(&c->stats.destroys, __ATOMIC_RELAXED); 
+        stats->releases += __atomic_load_n(&c->stats.releases, __ATOMIC_RELAXED); 
+    }
+    pthread_mutex_unlock(&pool->mutex); 
+    // The counters of different threads are not read at the same instant,
+    // so the derived figures are clamped rather than allowed to wrap.
+    size_t live = stats->mallocs > stats->destroys ? stats->mallocs - stats->destroys : 0; 
+    stats->in_use = stats->allocs > stats->frees ? stats->allocs - stats->frees : 0; 
+    stats->idle = live > stats->in_use ? live - stats->in_use : 0; 
+}
@@ -0,0 +1,63 @@
+#include <stdlib.h>
+#include <stddef.h>
+
+#include "payload_pool.h"
+#include "obj_pool.h"
+
+#define PPOOL_NCLASSES 5
+#define PPOOL_CACHE_BYTES (256 * 1024)
+#define PPOOL_CACHE_MAX 32
+#define PPOOL_DEPOT_BYTES (1024 * 1024)
+
+/*
+ * Every buffer is preceded by a header recording its size class, so that
+ * ppool_free() can tell which pool it goes back to.
+ */
+typedef struct ppool_hdr {
+    _Alignas(max_align_t) size_t cls; 
+} PPOOL_HDR; 
+
+/*
+ * Each size class is an object pool of its own, whose caches and depot
+ * are limited by bytes rather than by count, so that a few large buffers
+ * are not kept around as readily as many small ones.
+ */
+#define PPOOL_CLASS(size) \
+    OPOOL_LIMITED_INITIALIZER("PAYLOAD" #size, sizeof(PPOOL_HDR) + (size), NULL, NULL, \
+        PPOOL_CACHE_BYTES / (size) > PPOOL_CACHE_MAX ? PPOOL_CACHE_MAX : PPOOL_CACHE_BYTES / (size), \
+        PPOOL_DEPOT_BYTES / (size))
+
+static const size_t ppool_class_size[PPOOL_NCLASSES] = {64, 512, 4096, 16384, 65536}; 
+static OBJ_POOL ppool_class[PPOOL_NCLASSES] = {
+    PPOOL_CLASS(64), PPOOL_CLASS(512), PPOOL_CLASS(4096), PPOOL_CLASS(16384), PPOOL_CLASS(65536)
+}; 
+
+void *ppool_alloc(size_t size) {
+    size_t cls = 0; 
+    while(size >= ppool_class_size[cls] && cls < PPOOL_NCLASSES-1)
+        cls++; 
+    PPOOL_HDR *hdr = (PPOOL_HDR *)opool_alloc(&ppool_class[cls]); 
+    hdr->cls = cls; 
+    return hdr + 1; 
+}
+
+void ppool_free(void *buf) {
+    if(!buf)
+        return; 
+    PPOOL_HDR *hdr = (PPOOL_HDR *)buf - 1; 
+    opool_free(&ppool_class[hdr->cls], hdr); 
+}
+
+void ppool_get_stats(PPOOL_STATS *stats) {
+    *stats = (PPOOL_STATS){0}; 
+    for(size_t cls = 0; cls < PPOOL_NCLASSES; ++cls) {
+        OPOOL_STATS ostats; 
+        opool_get_stats(&ppool_class[cls], &ostats); 
+        stats->allocs += ostats.allocs; 
+        stats->frees += ostats.frees; 
+        stats->cache_hits += ostats.cache_hits; 
+        stats->depot_hits += ostats.depot_hits; 
+        stats->mallocs += ostats.mallocs; 
+        stats->releases += ostats.releases; 
+    }
+}
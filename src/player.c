@@ -4,6 +4,9 @@
 #include <pthread.h>
 
 #include "player.h"
+#include "player_ext.h"
+#include "user_list.h"
+#include "presence.h"
 #include "debug.h"
 
 typedef struct player {
@@ -11,6 +14,7 @@ typedef struct player {
     size_t refs; 
     char *name; 
     int rating; 
+    int online; 
 } PLAYER; 
 
 PLAYER *player_create(char *name) {
@@ -22,22 +26,18 @@ PLAYER *player_create(char *name) {
 }
 
 PLAYER *player_ref(PLAYER *player, char *why) {
-    pthread_mutex_lock(&player->mutex); 
+    size_t refs __attribute__((unused)) = __atomic_add_fetch(&player->refs, 1, __ATOMIC_RELAXED); 
     debug("Increase reference count on player %p (%lu -> %lu) %s",
-        player, player->refs, player->refs+1, why); 
-    player->refs++; 
-    pthread_mutex_unlock(&player->mutex); 
+        player, refs-1, refs, why); 
     return player; 
 }
 
 void player_unref(PLAYER *player, char *why) {
-    size_t refs; 
-    pthread_mutex_lock(&player->mutex); 
+    size_t refs = __atomic_sub_fetch(&player->refs, 1, __ATOMIC_RELEASE); 
     debug("Decrease reference count on player %p (%lu -> %lu) %s",
-        player, player->refs, player->refs-1, why); 
-    refs = --player->refs; 
-    pthread_mutex_unlock(&player->mutex); 
+        player, refs+1, refs, why); 
     if(!refs) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); 
         debug("Free player %p", player); 
         free(player->name); 
         pthread_mutex_destroy(&player->mutex); 
@@ -53,6 +53,19 @@ char *player_get_name(PLAYER *player) {
     return name; 
 }
 
+int player_set_online(PLAYER *player, int online) {
+    int expected = !online; 
+    online = !!online; 
+    if(!__atomic_compare_exchange_n(&player->online, &expected, online, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return -1; 
+    debug("Player %s is now %s", player->name, online ? "online" : "offline"); 
+    return 0; 
+}
+
+int player_is_online(PLAYER *player) {
+    return __atomic_load_n(&player->online, __ATOMIC_ACQUIRE); 
+}
+
 int player_get_rating(PLAYER *player) {
     int rating; 
     pthread_mutex_lock(&player->mutex); 
@@ -85,4 +98,7 @@ void player_post_result(PLAYER *player1, PLAYER *player2, int result) {
     player2->rating += 32*(s2-e2); 
     pthread_mutex_unlock(&player2->mutex); 
     pthread_mutex_unlock(&player1->mutex); 
+    ulist_invalidate(); 
+    pres_rating(player1); 
+    pres_rating(player2); 
 }
\ No newline at end of file
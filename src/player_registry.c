@@ -1,56 +1,167 @@
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 
 #include "player_registry.h"
-#include "arraylist.h"
 #include "debug.h"
 
-typedef struct player_registry {
+#define PREG_STRIPES 16
+#define PREG_TABLE_MIN 64
+
+/*
+ * Players are kept in a hash table split into lock stripes, each an open
+ * addressing table of its own.  Since players are never removed, a slot
+ * that has been filled stays filled: lookups can probe without taking
+ * any lock, and only fall back to locking the stripe (and inserting) if
+ * the name is not found.  A slot is published by storing its player
+ * last, so a reader that sees the player also sees the hash and name.
+ */
+typedef struct preg_slot {
+    size_t hash; 
+    char *name; 
+    PLAYER *player; 
+} PREG_SLOT; 
+
+/*
+ * When a stripe grows, its old table may still be in use by readers, so
+ * it is not freed but retired, chained from the new one, until the
+ * registry is finalized.  The retired tables take at most as much space
+ * as the current one.
+ */
+typedef struct preg_table {
+    struct preg_table *retired; 
+    size_t mask; 
+    PREG_SLOT slots[]; 
+} PREG_TABLE; 
+
+typedef struct preg_stripe {
     pthread_mutex_t mutex; 
-    ARRAYLIST *players; 
+    PREG_TABLE *table; 
+    size_t count; 
+} __attribute__((aligned(64))) PREG_STRIPE; 
+
+typedef struct player_registry {
+    PREG_STRIPE stripes[PREG_STRIPES]; 
 } PLAYER_REGISTRY; 
 
+static PREG_TABLE *preg_table_create(size_t size) {
+    PREG_TABLE *table = (PREG_TABLE *)calloc(sizeof(PREG_TABLE) + size * sizeof(PREG_SLOT), 1); 
+    table->mask = size - 1; 
+    return table; 
+}
+
 PLAYER_REGISTRY *preg_init() {
-    debug("Initialize player registry");
-    PLAYER_REGISTRY *preg = (PLAYER_REGISTRY *)calloc(sizeof(PLAYER_REGISTRY), 1); 
-    pthread_mutex_init(&preg->mutex, NULL); 
-    preg->players = arraylist_create(); 
+    debug("Initialize player registry"); 
+    PLAYER_REGISTRY *preg = (PLAYER_REGISTRY *)aligned_alloc(64, sizeof(PLAYER_REGISTRY)); 
+    memset(preg, 0, sizeof(PLAYER_REGISTRY)); 
+    for(int i = 0; i < PREG_STRIPES; ++i) {
+        pthread_mutex_init(&preg->stripes[i].mutex, NULL); 
+        preg->stripes[i].table = preg_table_create(PREG_TABLE_MIN); 
+    }
     return preg; 
 }
 
 void preg_fini(PLAYER_REGISTRY *preg) {
     debug("Finalize player registry"); 
-    for(int i = 0; i < preg->players->size; ++i) {
-        PLAYER *player = (PLAYER *)arraylist_get(preg->players, i); 
-        if(player)
-            player_unref(player, "because player registry is being finalized"); 
+    for(int i = 0; i < PREG_STRIPES; ++i) {
+        PREG_TABLE *table = preg->stripes[i].table; 
+        for(size_t j = 0; j <= table->mask; ++j) {
+            if(table->slots[j].player)
+                player_unref(table->slots[j].player, "because player registry is being finalized"); 
+        }
+        while(table) {
+            PREG_TABLE *retired = table->retired; 
+            free(table); 
+            table = retired; 
+        }
+        pthread_mutex_destroy(&preg->stripes[i].mutex); 
     }
-    arraylist_free(preg->players); 
-    pthread_mutex_destroy(&preg->mutex); 
     free(preg); 
 }
 
+/*
+ * FNV-1a hash of a player name.  The low bits select the stripe and the
+ * remaining ones the slot within it.
+ */
+static size_t preg_hash(char *name) {
+    size_t hash = 14695981039346656037UL; 
+    for(unsigned char *cp = (unsigned char *)name; *cp; ++cp)
+        hash = (hash ^ *cp) * 1099511628211UL; 
+    return hash; 
+}
+
+/*
+ * Probe a table for a name.  Returns the slot holding the name, or else
+ * the empty slot at which the probe ended, and sets *playerp to the
+ * player found in it, or NULL.  Without the stripe locked, an empty slot
+ * may be filled by another name at any moment, so it is only this value,
+ * and never the slot's contents, that tells whether the name was found.
+ */
+static PREG_SLOT *preg_probe(PREG_TABLE *table, size_t hash, char *name, PLAYER **playerp) {
+    size_t i = hash / PREG_STRIPES; 
+    while(1) {
+        PREG_SLOT *slot = &table->slots[i & table->mask]; 
+        PLAYER *player = __atomic_load_n(&slot->player, __ATOMIC_ACQUIRE); 
+        if(!player || (slot->hash == hash && !strcmp(slot->name, name))) {
+            *playerp = player; 
+            return slot; 
+        }
+        i++; 
+    }
+}
+
+/*
+ * Double the size of a stripe's table, which must be locked.
+ */
+static void preg_grow(PREG_STRIPE *stripe) {
+    PREG_TABLE *old = stripe->table; 
+    PREG_TABLE *table = preg_table_create(2 * (old->mask + 1)); 
+    for(size_t i = 0; i <= old->mask; ++i) {
+        PREG_SLOT *from = &old->slots[i]; 
+        if(from->player) {
+            PLAYER *player; 
+            PREG_SLOT *to = preg_probe(table, from->hash, from->name, &player); 
+            *to = *from; 
+        }
+    }
+    table->retired = old; 
+    __atomic_store_n(&stripe->table, table, __ATOMIC_RELEASE); 
+}
+
 PLAYER *preg_register(PLAYER_REGISTRY *preg, char *name) {
     debug("Register player %s", name); 
-    PLAYER *player = NULL; 
-    pthread_mutex_lock(&preg->mutex); 
-    for(int i = 0; i < preg->players->size; ++i) {
-        PLAYER *candp = (PLAYER *)arraylist_get(preg->players, i); ;
-        if(!strcmp(name, player_get_name(candp))) {
-            player = candp; 
-            break; 
-        }
+    size_t hash = preg_hash(name); 
+    PREG_STRIPE *stripe = &preg->stripes[hash % PREG_STRIPES]; 
+    PREG_TABLE *table = __atomic_load_n(&stripe->table, __ATOMIC_ACQUIRE); 
+    PLAYER *player; 
+    PREG_SLOT *slot = preg_probe(table, hash, name, &player); 
+    if(player) {
+        debug("Player exists with that name"); 
+        return player_ref(player, "for new reference to existing player"); 
     }
-    if(!player) {
-        debug("Player with that name does not yet exist"); 
-        player = player_create(name); 
-        arraylist_set(preg->players, arraylist_find(preg->players, NULL),
-            player_ref(player, "for reference being retained by player registry")); 
+
+    // Not found without locking: the player may have been added since,
+    // or the stripe may have grown, so look again with the stripe locked.
+    pthread_mutex_lock(&stripe->mutex); 
+    slot = preg_probe(stripe->table, hash, name, &player); 
+    if(player) {
+        debug("Player exists with that name"); 
+        player = player_ref(player, "for new reference to existing player"); 
     }
     else {
-        debug("Player exists with that name"); 
-        player_ref(player, "for new reference to existing player"); 
+        debug("Player with that name does not yet exist"); 
+        player = player_create(name); 
+        if(2 * (stripe->count + 1) > stripe->table->mask + 1) {
+            PLAYER *none; 
+            preg_grow(stripe); 
+            slot = preg_probe(stripe->table, hash, name, &none); 
+        }
+        slot->hash = hash; 
+        slot->name = player_get_name(player); 
+        __atomic_store_n(&slot->player, player_ref(player, "for reference being retained by player registry"),
+            __ATOMIC_RELEASE); 
+        stripe->count++; 
     }
-    pthread_mutex_unlock(&preg->mutex); 
+    pthread_mutex_unlock(&stripe->mutex); 
     return player; 
-}
\ No newline at end of file
+}
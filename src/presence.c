@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "presence.h"
+#include "protocol_ext.h"
+#include "client_ext.h"
+#include "user_list.h"
+#include "arraylist.h"
+#include "payload_pool.h"
+#include "debug.h"
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER; 
+static ARRAYLIST *subscribers; 
+// Read without the lock, so that publishing costs nothing while there
+// are no subscribers.
+static size_t nsubscribers; 
+
+void pres_subscribe(CLIENT *client) {
+    size_t len; 
+    pthread_rwlock_wrlock(&lock); 
+    if(!subscribers)
+        subscribers = arraylist_create(); 
+    arraylist_push(subscribers, client_ref(client, "for reference being retained by presence subscribers")); 
+    size_t n = subscribers->size; 
+    __atomic_store_n(&nsubscribers, n, __ATOMIC_RELEASE); 
+    char *users = ulist_acquire(&len); 
+    client_stream_ack(client, users, len, ulist_release); 
+    pthread_rwlock_unlock(&lock); 
+    debug("[%d] Subscribed to presence (%lu subscribers)", client_get_fd(client), n); 
+}
+
+void pres_unsubscribe(CLIENT *client) {
+    CLIENT *found = NULL; 
+    pthread_rwlock_wrlock(&lock); 
+    int i = subscribers ? arraylist_find(subscribers, client) : 0; 
+    if(subscribers && i < subscribers->size) {
+        found = arraylist_get(subscribers, i); 
+        CLIENT *last = arraylist_pop(subscribers); 
+        if(last != client)
+            arraylist_set(subscribers, i, last); 
+        __atomic_store_n(&nsubscribers, subscribers->size, __ATOMIC_RELEASE); 
+    }
+    pthread_rwlock_unlock(&lock); 
+    if(found) {
+        debug("[%d] Unsubscribed from presence", client_get_fd(client)); 
+        client_unref(found, "because client is no longer a presence subscriber"); 
+    }
+}
+
+static void pres_publish(JEUX_PACKET_TYPE type, char *data, size_t size) {
+    JEUX_PACKET_HEADER header = {0}; 
+    struct timespec time; 
+    header.type = type; 
+    header.size = htons((uint16_t)size); 
+    clock_gettime(CLOCK_MONOTONIC, &time); 
+    header.timestamp_sec = htonl((uint32_t)time.tv_sec); 
+    header.timestamp_nsec = htonl((uint32_t)time.tv_nsec); 
+    pthread_rwlock_rdlock(&lock); 
+    for(size_t i = 0; i < subscribers->size; ++i)
+        client_send_packet(arraylist_get(subscribers, i), &header, data); 
+    pthread_rwlock_unlock(&lock); 
+}
+
+/*
+ * Publish "name<TAB>rating".  The payload is sized from the name, which
+ * may be as long as a LOGIN payload; a name too close to that limit to
+ * leave room for the rating is cut at JEUX_CHUNK_MAX (see protocol_ext.h).
+ */
+static void pres_publish_rating(JEUX_PACKET_TYPE type, PLAYER *player) {
+    if(!__atomic_load_n(&nsubscribers, __ATOMIC_ACQUIRE))
+        return; 
+    char *name = player_get_name(player); 
+    size_t size = strlen(name) + 12;  // TAB, sign and ten digits
+    if(size > JEUX_CHUNK_MAX)
+        size = JEUX_CHUNK_MAX; 
+    char *data = ppool_alloc(size); 
+    int n = snprintf(data, size + 1, "%s\t%d", name, player_get_rating(player)); 
+    pres_publish(type, data, (size_t)n < size ? (size_t)n : size); 
+    ppool_free(data); 
+}
+
+void pres_online(PLAYER *player) {
+    pres_publish_rating(JEUX_ONLINE_PKT, player); 
+}
+
+void pres_offline(PLAYER *player) {
+    if(!__atomic_load_n(&nsubscribers, __ATOMIC_ACQUIRE))
+        return; 
+    char *name = player_get_name(player); 
+    pres_publish(JEUX_OFFLINE_PKT, name, strlen(name)); 
+}
+
+void pres_rating(PLAYER *player) {
+    pres_publish_rating(JEUX_RATING_PKT, player); 
+}
@@ -0,0 +1,503 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "proto_uring.h"
+#include "protocol_ext.h"
+#include "payload_pool.h"
+#include "debug.h"
+
+#define URING_ENTRIES 8
+#define URING_NBUFS 8
+#define URING_BUFSIZE 4096
+#define URING_BGID 0
+#define URING_RECV_TAG 0
+#define URING_WAKE_TAG 1
+
+typedef struct uring {
+    int fd; 
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array; 
+    unsigned sqe_tail; 
+    struct io_uring_sqe *sqes; 
+    unsigned *cq_head, *cq_tail, *cq_mask; 
+    struct io_uring_cqe *cqes; 
+    void *sq_ptr, *cq_ptr; 
+    size_t sq_size, cq_size, sqes_size; 
+} URING; 
+
+typedef struct proto_uring {
+    URING ring; 
+    int fd; 
+    struct io_uring_buf_ring *br; 
+    size_t br_size; 
+    char *bufs; 
+    unsigned short br_tail; 
+    int armed; 
+    int wakefd; 
+    int wake_armed; 
+    int woken; 
+    int eof; 
+    char *chunk; 
+    size_t chunk_len; 
+    int chunk_bid; 
+} PROTO_URING; 
+
+int proto_uring_enabled; 
+
+static pthread_key_t send_ring_key; 
+static pthread_once_t send_ring_once = PTHREAD_ONCE_INIT; 
+
+static int uring_setup(URING *r, unsigned entries) {
+    struct io_uring_params p; 
+    memset(r, 0, sizeof(URING)); 
+    memset(&p, 0, sizeof(p)); 
+    r->fd = syscall(__NR_io_uring_setup, entries, &p); 
+    if(r->fd < 0)
+        return -1; 
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned); 
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe); 
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe); 
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(r->cq_size > r->sq_size)
+            r->sq_size = r->cq_size; 
+        r->cq_size = r->sq_size; 
+    }
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING); 
+    if(r->sq_ptr == MAP_FAILED)
+        goto fail_sq; 
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ptr = r->sq_ptr; 
+    else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING); 
+        if(r->cq_ptr == MAP_FAILED)
+            goto fail_cq; 
+    }
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES); 
+    if(r->sqes == MAP_FAILED)
+        goto fail_sqes; 
+    r->sq_head = r->sq_ptr + p.sq_off.head; 
+    r->sq_tail = r->sq_ptr + p.sq_off.tail; 
+    r->sq_mask = r->sq_ptr + p.sq_off.ring_mask; 
+    r->sq_array = r->sq_ptr + p.sq_off.array; 
+    r->sqe_tail = *r->sq_tail; 
+    r->cq_head = r->cq_ptr + p.cq_off.head; 
+    r->cq_tail = r->cq_ptr + p.cq_off.tail; 
+    r->cq_mask = r->cq_ptr + p.cq_off.ring_mask; 
+    r->cqes = r->cq_ptr + p.cq_off.cqes; 
+    return 0; 
+
+fail_sqes:
+    if(r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_size); 
+fail_cq:
+    munmap(r->sq_ptr, r->sq_size); 
+fail_sq:
+    close(r->fd); 
+    return -1; 
+}
+
+static void uring_teardown(URING *r) {
+    munmap(r->sqes, r->sqes_size); 
+    if(r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_size); 
+    munmap(r->sq_ptr, r->sq_size); 
+    close(r->fd); 
+}
+
+/*
+ * Get a zeroed submission queue entry.  It is not visible to the
+ * kernel until the next call to uring_enter().
+ */
+static struct io_uring_sqe *uring_get_sqe(URING *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE); 
+    if(r->sqe_tail - head > *r->sq_mask)
+        return NULL; 
+    unsigned idx = r->sqe_tail++ & *r->sq_mask; 
+    struct io_uring_sqe *sqe = &r->sqes[idx]; 
+    memset(sqe, 0, sizeof(struct io_uring_sqe)); 
+    r->sq_array[idx] = idx; 
+    return sqe; 
+}
+
+/*
+ * Submit any pending entries and wait until at least min_complete
+ * completions are available.
+ */
+static int uring_enter(URING *r, unsigned min_complete) {
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE); 
+    while(1) {
+        unsigned submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE); 
+        if(syscall(__NR_io_uring_enter, r->fd, submit, min_complete,
+                min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0) >= 0)
+            return 0; 
+        if(errno != EINTR)
+            return -1; 
+    }
+}
+
+static struct io_uring_cqe *uring_peek_cqe(URING *r) {
+    unsigned head = *r->cq_head; 
+    if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL; 
+    return &r->cqes[head & *r->cq_mask]; 
+}
+
+static struct io_uring_cqe *uring_wait_cqe(URING *r) {
+    struct io_uring_cqe *cqe; 
+    while(!(cqe = uring_peek_cqe(r))) {
+        if(uring_enter(r, 1))
+            return NULL; 
+    }
+    return cqe; 
+}
+
+static void uring_cqe_seen(URING *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE); 
+}
+
+/*
+ * Hand a receive buffer back to the kernel.
+ */
+static void uring_recycle(PROTO_URING *pu, int bid) {
+    struct io_uring_buf *buf = &pu->br->bufs[pu->br_tail & (URING_NBUFS-1)]; 
+    buf->addr = (unsigned long)(pu->bufs + bid * URING_BUFSIZE); 
+    buf->len = URING_BUFSIZE; 
+    buf->bid = bid; 
+    pu->br_tail++; 
+    __atomic_store_n(&pu->br->tail, pu->br_tail, __ATOMIC_RELEASE); 
+}
+
+static int uring_arm_recv(PROTO_URING *pu) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&pu->ring); 
+    if(!sqe)
+        return -1; 
+    sqe->opcode = IORING_OP_RECV; 
+    sqe->fd = pu->fd; 
+    sqe->ioprio = IORING_RECV_MULTISHOT; 
+    sqe->flags = IOSQE_BUFFER_SELECT; 
+    sqe->buf_group = URING_BGID; 
+    sqe->user_data = URING_RECV_TAG; 
+    pu->armed = 1; 
+    return 0; 
+}
+
+static int uring_arm_wake(PROTO_URING *pu) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&pu->ring); 
+    if(!sqe)
+        return -1; 
+    sqe->opcode = IORING_OP_POLL_ADD; 
+    sqe->fd = pu->wakefd; 
+    sqe->poll32_events = POLLIN; 
+    sqe->len = IORING_POLL_ADD_MULTI; 
+    sqe->user_data = URING_WAKE_TAG; 
+    pu->wake_armed = 1; 
+    return 0; 
+}
+
+/*
+ * Make the next received buffer current, recycling the previous one.
+ * The multishot receive (and the poll on the wakeup descriptor, if any)
+ * is re-armed whenever the kernel reports that it has stopped (e.g.
+ * because it ran out of buffers).  If interruptible is set, a wakeup
+ * makes this return -1 with errno set to EINTR; otherwise it is noted
+ * for the next packet boundary.
+ */
+static int uring_next_chunk(PROTO_URING *pu, int interruptible) {
+    if(pu->chunk_bid >= 0) {
+        uring_recycle(pu, pu->chunk_bid); 
+        pu->chunk_bid = -1; 
+    }
+    while(!pu->eof) {
+        if(interruptible && pu->woken) {
+            pu->woken = 0; 
+            errno = EINTR; 
+            return -1; 
+        }
+        if(!pu->armed && uring_arm_recv(pu))
+            return -1; 
+        if(pu->wakefd >= 0 && !pu->wake_armed && uring_arm_wake(pu))
+            return -1; 
+        struct io_uring_cqe *cqe = uring_wait_cqe(&pu->ring); 
+        if(!cqe)
+            return -1; 
+        int res = cqe->res; 
+        unsigned flags = cqe->flags; 
+        int tag = cqe->user_data; 
+        uring_cqe_seen(&pu->ring); 
+        if(tag == URING_WAKE_TAG) {
+            if(!(flags & IORING_CQE_F_MORE))
+                pu->wake_armed = 0; 
+            pu->woken = 1; 
+            continue; 
+        }
+        if(!(flags & IORING_CQE_F_MORE))
+            pu->armed = 0; 
+        if(res == -ENOBUFS)
+            continue; 
+        if(res <= 0) {
+            debug("[%d] Multishot receive ended (%d)", pu->fd, res); 
+            errno = -res; 
+            pu->eof = 1; 
+            break; 
+        }
+        pu->chunk_bid = flags >> IORING_CQE_BUFFER_SHIFT; 
+        pu->chunk = pu->bufs + pu->chunk_bid * URING_BUFSIZE; 
+        pu->chunk_len = res; 
+        return 0; 
+    }
+    return -1; 
+}
+
+static int uring_read(PROTO_URING *pu, void *ptr, size_t size) {
+    while(size) {
+        if(!pu->chunk_len && uring_next_chunk(pu, 0))
+            return -1; 
+        size_t n = size < pu->chunk_len ? size : pu->chunk_len; 
+        memcpy(ptr, pu->chunk, n); 
+        pu->chunk += n; 
+        pu->chunk_len -= n; 
+        ptr += n; 
+        size -= n; 
+    }
+    return 0; 
+}
+
+static int uring_register_bufs(PROTO_URING *pu) {
+    pu->br_size = URING_NBUFS * sizeof(struct io_uring_buf); 
+    pu->br = mmap(NULL, pu->br_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); 
+    if(pu->br == MAP_FAILED)
+        return -1; 
+    struct io_uring_buf_reg reg; 
+    memset(&reg, 0, sizeof(reg)); 
+    reg.ring_addr = (unsigned long)pu->br; 
+    reg.ring_entries = URING_NBUFS; 
+    reg.bgid = URING_BGID; 
+    if(syscall(__NR_io_uring_register, pu->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(pu->br, pu->br_size); 
+        return -1; 
+    }
+    pu->bufs = malloc(URING_NBUFS * URING_BUFSIZE); 
+    for(int bid = 0; bid < URING_NBUFS; ++bid)
+        uring_recycle(pu, bid); 
+    return 0; 
+}
+
+PROTO_URING *proto_uring_create(int fd) {
+    PROTO_URING *pu = (PROTO_URING *)calloc(sizeof(PROTO_URING), 1); 
+    pu->fd = fd; 
+    pu->wakefd = -1; 
+    pu->chunk_bid = -1; 
+    if(uring_setup(&pu->ring, URING_ENTRIES)) {
+        debug("[%d] io_uring_setup: %s", fd, strerror(errno)); 
+        free(pu); 
+        return NULL; 
+    }
+    if(uring_register_bufs(pu)) {
+        debug("[%d] Failed to register receive buffers: %s", fd, strerror(errno)); 
+        uring_teardown(&pu->ring); 
+        free(pu); 
+        return NULL; 
+    }
+    return pu; 
+}
+
+void proto_uring_destroy(PROTO_URING *pu) {
+    // Closing the ring cancels the outstanding multishot receive and poll.
+    uring_teardown(&pu->ring); 
+    munmap(pu->br, pu->br_size); 
+    free(pu->bufs); 
+    free(pu); 
+}
+
+int proto_uring_recv_packet(PROTO_URING *pu, JEUX_PACKET_HEADER *hdr, void **payloadp) {
+    // initialize to default values
+    memset(hdr, 0, sizeof(JEUX_PACKET_HEADER)); 
+    *payloadp = NULL; 
+
+    // wait for data, unless woken up first
+    if(!pu->chunk_len && uring_next_chunk(pu, 1))
+        return -1; 
+
+    // read header from buffers
+    if(uring_read(pu, hdr, sizeof(JEUX_PACKET_HEADER)))
+        return -1; 
+
+    // read payload from buffers
+    uint16_t size = ntohs(hdr->size); 
+    if(size) {
+        *payloadp = ppool_alloc(size); 
+        if(uring_read(pu, *payloadp, size))
+            return -1; 
+        ((char *)*payloadp)[size] = '\0'; 
+    }
+
+    proto_debug_packet("<=", hdr, *payloadp); 
+    return 0; 
+}
+
+void proto_uring_set_wakefd(PROTO_URING *pu, int fd) {
+    pu->wakefd = fd; 
+}
+
+static void send_ring_free(void *arg) {
+    uring_teardown((URING *)arg); 
+    free(arg); 
+}
+
+static void send_ring_key_init(void) {
+    pthread_key_create(&send_ring_key, send_ring_free); 
+}
+
+/*
+ * Get the calling thread's send ring, creating it on first use.
+ * It is torn down when the thread exits.
+ */
+static URING *send_ring(void) {
+    pthread_once(&send_ring_once, send_ring_key_init); 
+    URING *r = pthread_getspecific(send_ring_key); 
+    if(!r) {
+        r = (URING *)malloc(sizeof(URING)); 
+        if(uring_setup(r, URING_ENTRIES)) {
+            free(r); 
+            return NULL; 
+        }
+        pthread_setspecific(send_ring_key, r); 
+    }
+    return r; 
+}
+
+int proto_uring_sendv(int fd, struct iovec *iov, int iovcnt) {
+    URING *r = send_ring(); 
+    if(!r)
+        return proto_sendv(fd, iov, iovcnt); 
+
+    // The buffers are sent as a chain of linked sends, so that each one
+    // only goes out once the one before it has gone out in full.  A short
+    // send breaks the chain, in which case whatever is left is submitted
+    // again.
+    int first = 0; 
+    while(first < iovcnt) {
+        int n = 0; 
+        for(int i = first; i < iovcnt && n < URING_ENTRIES; ++i, ++n) {
+            struct io_uring_sqe *sqe = uring_get_sqe(r); 
+            sqe->opcode = IORING_OP_SEND; 
+            sqe->fd = fd; 
+            sqe->addr = (unsigned long)iov[i].iov_base; 
+            sqe->len = iov[i].iov_len; 
+            sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL; 
+            sqe->user_data = i; 
+            if(i < iovcnt-1 && n < URING_ENTRIES-1)
+                sqe->flags = IOSQE_IO_LINK; 
+        }
+        if(uring_enter(r, n))
+            return -1; 
+        int err = 0; 
+        for(int i = 0; i < n; ++i) {
+            struct io_uring_cqe *cqe = uring_wait_cqe(r); 
+            if(!cqe)
+                return -1; 
+            int part = cqe->user_data; 
+            int res = cqe->res; 
+            uring_cqe_seen(r); 
+            if(res > 0) {
+                iov[part].iov_base += res; 
+                iov[part].iov_len -= res; 
+            }
+            else if(res == 0 && iov[part].iov_len)
+                err = EPIPE; 
+            else if(res < 0 && res != -ECANCELED && res != -EINTR && res != -EAGAIN)
+                err = -res; 
+        }
+        if(err) {
+            errno = err; 
+            return -1; 
+        }
+        while(first < iovcnt && !iov[first].iov_len)
+            first++; 
+    }
+    return 0; 
+}
+
+int proto_uring_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data) {
+    proto_debug_packet("=>", hdr, data); 
+
+    struct iovec iov[2]; 
+    iov[0].iov_base = hdr; 
+    iov[0].iov_len = sizeof(JEUX_PACKET_HEADER); 
+    iov[1].iov_base = data; 
+    iov[1].iov_len = data ? ntohs(hdr->size) : 0; 
+    return proto_uring_sendv(fd, iov, iov[1].iov_len ? 2 : 1); 
+}
+
+/*
+ * Check that the kernel supports each of the opcodes that the backend
+ * submits.
+ */
+static int uring_probe_ops(URING *r) {
+    static const int ops[] = {IORING_OP_RECV, IORING_OP_SEND, IORING_OP_POLL_ADD}; 
+    size_t size = sizeof(struct io_uring_probe) + (IORING_OP_LAST+1) * sizeof(struct io_uring_probe_op); 
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(size, 1); 
+    int ret = 0; 
+    if(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST+1) < 0) {
+        debug("IORING_REGISTER_PROBE: %s", strerror(errno)); 
+        ret = -1; 
+    }
+    for(int i = 0; !ret && i < sizeof(ops) / sizeof(ops[0]); ++i) {
+        if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            debug("io_uring opcode %d is not supported", ops[i]); 
+            ret = -1; 
+        }
+    }
+    free(probe); 
+    return ret; 
+}
+
+/*
+ * Check that a multishot receive works, by receiving on one end of a
+ * socket pair something sent from the other.  The opcode probe cannot
+ * tell this: kernels without multishot receives either fail the receive
+ * or complete it once, without IORING_CQE_F_MORE.
+ */
+static int uring_probe_multishot(void) {
+    int sv[2]; 
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return -1; 
+    int ret = -1; 
+    PROTO_URING *pu = proto_uring_create(sv[0]); 
+    if(pu) {
+        if(write(sv[1], "x", 1) == 1 && !uring_next_chunk(pu, 0)
+           && pu->chunk_len == 1 && pu->armed)
+            ret = 0; 
+        else
+            debug("Multishot receive is not supported"); 
+        proto_uring_destroy(pu); 
+    }
+    close(sv[0]); 
+    close(sv[1]); 
+    return ret; 
+}
+
+int proto_uring_init(void) {
+    URING r; 
+    if(uring_setup(&r, URING_ENTRIES)) {
+        debug("io_uring_setup: %s", strerror(errno)); 
+        return -1; 
+    }
+    int ret = uring_probe_ops(&r); 
+    uring_teardown(&r); 
+    if(ret || uring_probe_multishot())
+        return -1; 
+    proto_uring_enabled = 1; 
+    return 0; 
+}
@@ -1,8 +1,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
 
+#include "csapp.h"
 #include "protocol.h"
+#include "protocol_ext.h"
+#include "payload_pool.h"
 #include "jeux_globals_ext.h"
 #include "debug.h"
 
@@ -25,12 +30,18 @@ const char *JEUX_PACKET_TYPE_NAME[] = {
     "MOVED",
     "RESIGNED",
     "ENDED",
+    "SUBSCRIBE",
+    "UNSUBSCRIBE",
+    "ONLINE",
+    "OFFLINE",
+    "RATING",
+    "CHUNK",
+    "EXTIDS",
 };
 
-int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data) {
-
 #ifdef DEBUG
-    fprintf(stderr, "=> %u.%u: type=%s, size=%hu, id=%hhu, role=%hhu",
+void proto_debug_packet(char *dir, JEUX_PACKET_HEADER *hdr, void *data) {
+    fprintf(stderr, "%s %u.%u: type=%s, size=%hu, id=%hhu, role=%hhu", dir, 
         ntohl(hdr->timestamp_sec), ntohl(hdr->timestamp_nsec), 
         JEUX_PACKET_TYPE_NAME[hdr->type], ntohs(hdr->size), hdr->id, hdr->role); 
     if(data) {
@@ -41,32 +52,77 @@ int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data) {
     else
         fprintf(stderr, " (no payload)\n"); 
     fflush(stderr); 
+}
 #endif
 
-    // write header to wire  
-    uint16_t hdr_size = sizeof(JEUX_PACKET_HEADER); 
-    void *hdr_ptr = (void *)hdr;  
-    while(hdr_size) {
-        ssize_t wbytes = send(fd, hdr_ptr, hdr_size, 0); 
-        if(wbytes <= 0)
-            return -1;
-        hdr_size -= wbytes; 
-        hdr_ptr += wbytes; 
+/*
+ * Sockets serviced by the event loop are non-blocking.  When the send
+ * buffer fills up, wait for it to drain rather than abandoning a packet
+ * half-written.
+ */
+static int proto_wait_writable(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT}; 
+    while(poll(&pfd, 1, -1) < 0) {
+        if(errno != EINTR)
+            return -1; 
     }
+    return 0; 
+}
 
-    // write payload to wire
-    uint16_t size = ntohs(hdr->size);  
-    void *ptr = data; 
-    while(size) {
-        ssize_t wbytes = send(fd, ptr, size, 0);  
-        if(wbytes <= 0)
+int proto_sendv(int fd, struct iovec *iov, int iovcnt) {
+    struct msghdr msg = {0}; 
+    msg.msg_iov = iov; 
+    msg.msg_iovlen = iovcnt; 
+    while(msg.msg_iovlen) {
+        ssize_t wbytes = sendmsg(fd, &msg, MSG_NOSIGNAL); 
+        if(wbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if(proto_wait_writable(fd))
+                return -1; 
+            continue; 
+        }
+        if(wbytes < 0)
             return -1; 
-        size -= wbytes; 
-        ptr += wbytes; 
+        // skip over whatever went out, leaving the iovecs at the first unsent byte
+        while(msg.msg_iovlen && wbytes >= msg.msg_iov->iov_len) {
+            wbytes -= msg.msg_iov->iov_len; 
+            msg.msg_iov++; 
+            msg.msg_iovlen--; 
+        }
+        if(msg.msg_iovlen) {
+            msg.msg_iov->iov_base += wbytes; 
+            msg.msg_iov->iov_len -= wbytes; 
+        }
     }
     return 0; 
 }
 
+ssize_t proto_trysendv(int fd, struct iovec *iov, int iovcnt) {
+    struct msghdr msg = {0}; 
+    msg.msg_iov = iov; 
+    msg.msg_iovlen = iovcnt; 
+    while(1) {
+        ssize_t wbytes = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT); 
+        if(wbytes >= 0)
+            return wbytes; 
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0; 
+        if(errno != EINTR)
+            return -1; 
+    }
+}
+
+int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data) {
+    proto_debug_packet("=>", hdr, data); 
+
+    // write header and payload to wire together
+    struct iovec iov[2]; 
+    iov[0].iov_base = hdr; 
+    iov[0].iov_len = sizeof(JEUX_PACKET_HEADER); 
+    iov[1].iov_base = data; 
+    iov[1].iov_len = data ? ntohs(hdr->size) : 0; 
+    return proto_sendv(fd, iov, iov[1].iov_len ? 2 : 1); 
+}
+
 int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp) {
     // initialize to default values
     memset(hdr, 0, sizeof(JEUX_PACKET_HEADER)); 
@@ -95,19 +151,126 @@ int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp) {
         ptr += rbytes; 
     }
 
-#ifdef DEBUG
-    fprintf(stderr, "<= %u.%u: type=%s, size=%hu, id=%hhu, role=%hhu",
-        ntohl(hdr->timestamp_sec), ntohl(hdr->timestamp_nsec), 
-        JEUX_PACKET_TYPE_NAME[hdr->type], ntohs(hdr->size), hdr->id, hdr->role); 
-    if(*payloadp) {
-        char *cpy = strndup(*payloadp, ntohs(hdr->size)); 
-        fprintf(stderr, ", payload=[%s]\n", cpy); 
-        free(cpy); 
+    proto_debug_packet("<=", hdr, *payloadp); 
+
+    return 0; 
+}
+
+typedef struct proto_reader {
+    rio_t rio; 
+    JEUX_PACKET_HEADER big_hdr; 
+    char *big; 
+    size_t big_len; 
+    char *done; 
+    char *nul; 
+    char nul_saved; 
+} PROTO_READER; 
+
+PROTO_READER *proto_reader_create(int fd) {
+    PROTO_READER *rp = (PROTO_READER *)calloc(sizeof(PROTO_READER), 1); 
+    rio_readinitb(&rp->rio, fd); 
+    return rp; 
+}
+
+void proto_reader_destroy(PROTO_READER *rp) {
+    ppool_free(rp->big); 
+    ppool_free(rp->done); 
+    free(rp); 
+}
+
+int proto_reader_buffered(PROTO_READER *rp) {
+    return rp->rio.rio_cnt > 0; 
+}
+
+static ssize_t proto_reader_fill(PROTO_READER *rp, char *dst, size_t len) {
+    while(1) {
+        ssize_t rbytes = read(rp->rio.rio_fd, dst, len); 
+        if(rbytes < 0 && errno == EINTR)
+            continue; 
+        if(rbytes == 0)
+            errno = 0; 
+        return rbytes; 
     }
-    else
-        fprintf(stderr, " (no payload)\n"); 
-    fflush(stderr); 
-#endif
+}
+
+int proto_reader_next(PROTO_READER *rp, JEUX_PACKET_HEADER *hdr, void **payloadp) {
+    rio_t *rio = &rp->rio; 
+    // a payload handed out from a pooled buffer lives until this call
+    if(rp->done) {
+        ppool_free(rp->done); 
+        rp->done = NULL; 
+    }
+    // as does the terminating NUL written over the byte after a payload
+    // handed out in place
+    if(rp->nul) {
+        *rp->nul = rp->nul_saved; 
+        rp->nul = NULL; 
+    }
+    while(1) {
+        // a payload too large for the buffer is read into its own storage
+        if(rp->big) {
+            size_t size = ntohs(rp->big_hdr.size); 
+            while(rp->big_len < size) {
+                ssize_t rbytes = proto_reader_fill(rp, rp->big + rp->big_len, size - rp->big_len); 
+                if(rbytes <= 0)
+                    return -1; 
+                rp->big_len += rbytes; 
+            }
+            memcpy(hdr, &rp->big_hdr, sizeof(JEUX_PACKET_HEADER)); 
+            rp->big[size] = '\0'; 
+            *payloadp = rp->done = rp->big; 
+            rp->big = NULL; 
+            break; 
+        }
+
+        // hand out a complete packet in place
+        if(rio->rio_cnt >= sizeof(JEUX_PACKET_HEADER)) {
+            memcpy(hdr, rio->rio_bufptr, sizeof(JEUX_PACKET_HEADER)); 
+            size_t len = sizeof(JEUX_PACKET_HEADER) + ntohs(hdr->size); 
+            if(len <= rio->rio_cnt) {
+                char *payload = rio->rio_bufptr + sizeof(JEUX_PACKET_HEADER); 
+                rio->rio_bufptr += len; 
+                rio->rio_cnt -= len; 
+                if(!hdr->size) {
+                    *payloadp = NULL; 
+                }
+                else if(rio->rio_bufptr < rio->rio_buf + sizeof(rio->rio_buf)) {
+                    rp->nul = rio->rio_bufptr; 
+                    rp->nul_saved = *rp->nul; 
+                    *rp->nul = '\0'; 
+                    *payloadp = payload; 
+                }
+                else {
+                    // no room for the NUL at the very end of the buffer
+                    rp->done = ppool_alloc(ntohs(hdr->size)); 
+                    memcpy(rp->done, payload, ntohs(hdr->size)); 
+                    rp->done[ntohs(hdr->size)] = '\0'; 
+                    *payloadp = rp->done; 
+                }
+                break; 
+            }
+            if(len > sizeof(rio->rio_buf)) {
+                memcpy(&rp->big_hdr, hdr, sizeof(JEUX_PACKET_HEADER)); 
+                rp->big = ppool_alloc(ntohs(hdr->size)); 
+                rp->big_len = rio->rio_cnt - sizeof(JEUX_PACKET_HEADER); 
+                memcpy(rp->big, rio->rio_bufptr + sizeof(JEUX_PACKET_HEADER), rp->big_len); 
+                rio->rio_cnt = 0; 
+                continue; 
+            }
+        }
 
+        // otherwise read as much as will fit behind what is buffered
+        if(rio->rio_bufptr != rio->rio_buf) {
+            memmove(rio->rio_buf, rio->rio_bufptr, rio->rio_cnt); 
+            rio->rio_bufptr = rio->rio_buf; 
+        }
+        ssize_t rbytes = proto_reader_fill(rp, rio->rio_buf + rio->rio_cnt, 
+            sizeof(rio->rio_buf) - rio->rio_cnt); 
+        if(rbytes <= 0)
+            return -1; 
+        rio->rio_cnt += rbytes; 
+    }
+
+    proto_debug_packet("<=", hdr, *payloadp); 
     return 0; 
-}
\ No newline at end of file
+}
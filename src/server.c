@@ -4,203 +4,369 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "server.h"
+#include "server_ext.h"
 #include "protocol.h"
+#include "protocol_ext.h"
+#include "proto_uring.h"
+#include "payload_pool.h"
 #include "client_registry.h"
+#include "client_ext.h"
+#include "game_ext.h"
 #include "player_registry.h"    
+#include "user_list.h"
 #include "jeux_globals.h"
 #include "debug.h"
 
-void *jeux_client_service(void *arg) {
-    int connfd; 
-    CLIENT *client; 
-    PLAYER *player; 
-    JEUX_PACKET_HEADER header; 
-    void *data; 
-    size_t datalen; 
-    struct timespec time; 
-
-    // Initialize
-    pthread_detach(pthread_self()); 
-    connfd = *((int *)arg); 
-    free(arg); 
-    debug("[%d] Starting client service", connfd); 
-    client = creg_register(client_registry, connfd); 
-    player = NULL; 
-    if(!client) {
-        debug("[%d] Failed to register client", connfd); 
-        close(connfd); 
-        pthread_exit(NULL);
+/*
+ * Parse the payload of a USERS query, "<prefix>[\t<offset>[\t<limit>]]",
+ * in place.  Returns 0 if it is well formed, otherwise -1.
+ */
+static int parse_users_query(char *data, char **prefixp, size_t *offsetp, size_t *limitp) {
+    size_t *fields[] = {offsetp, limitp}; 
+    char *cp = strchr(data, '\t'); 
+    *prefixp = data; 
+    *offsetp = *limitp = 0; 
+    for(int i = 0; cp && i < 2; ++i) {
+        char *end; 
+        *cp++ = '\0'; 
+        if(*cp < '0' || *cp > '9')
+            return -1; 
+        errno = 0; 
+        *fields[i] = strtoul(cp, &end, 10); 
+        if(errno || (*end && *end != '\t'))
+            return -1; 
+        cp = *end ? end : NULL; 
     }
+    return cp ? -1 : 0; 
+}
 
-    // Main Loop
-    while(proto_recv_packet(connfd, &header, &data) != -1) {
-        switch(header.type) {
-            case JEUX_LOGIN_PKT: 
-                debug("[%d] LOGIN packet recieved", connfd); 
-                if(!player && data) {
-                    char *name = strndup(data, ntohs(header.size)); 
-                    debug("[%d] Login '%s'", connfd, name); 
-                    player = preg_register(player_registry, name); 
-                    if(client_login(client, player) != -1) {
-                        client_send_ack(client, NULL, 0); 
-                    }
-                    else {
-                        debug("[%d] Already logged in (player %p [%s])", 
-                            connfd, player, player_get_name(player));
-                        player_unref(player, "after login attempt"); 
-                        player = NULL; 
-                        client_send_nack(client);        
-                    }
-                    free(name); 
+void jeux_client_dispatch(CLIENT *client, PLAYER **playerp, 
+                JEUX_PACKET_HEADER *hdr, void *data) {
+    size_t resplen; 
+    int invid = (int)proto_get_id(hdr, client_has_extended_ids(client)); 
+
+    client_cork(); 
+    switch(hdr->type) {
+        case JEUX_LOGIN_PKT: 
+            debug("[%d] LOGIN packet recieved", client_get_fd(client)); 
+            if(!*playerp && data) {
+                char *name = (char *)data; 
+                debug("[%d] Login '%s'", client_get_fd(client), name); 
+                *playerp = preg_register(player_registry, name); 
+                if(client_login(client, *playerp) != -1) {
+                    client_send_ack(client, NULL, 0); 
                 }
                 else {
                     debug("[%d] Already logged in (player %p [%s])", 
-                        connfd, player, player_get_name(player));
-                    client_send_nack(client); 
+                        client_get_fd(client), *playerp, player_get_name(*playerp));
+                    player_unref(*playerp, "after login attempt"); 
+                    *playerp = NULL; 
+                    client_send_nack(client);        
                 }
-                break; 
-            case JEUX_USERS_PKT: 
-                debug("[%d] USERS packet recieved", connfd); 
-                if(player && !data) {
-                    debug("[%d] Users", connfd); 
-                    FILE *stream = open_memstream((char **)&data, &datalen); 
-                    PLAYER **plist = creg_all_players(client_registry); 
-                    PLAYER **pp = plist;  
-                    while(*pp) {
-                        fprintf(stream, "%s\t%d\n", player_get_name(*pp), player_get_rating(*pp));  
-                        player_unref(*pp, "for player removed from players list"); 
-                        pp++; 
-                    }  
-                    free(plist); 
-                    fclose(stream);  
-                    client_send_ack(client, data, datalen);
+            }
+            else {
+                debug("[%d] Already logged in (player %p [%s])", 
+                    client_get_fd(client), *playerp, player_get_name(*playerp));
+                client_send_nack(client); 
+            }
+            break; 
+        case JEUX_USERS_PKT: 
+            debug("[%d] USERS packet recieved", client_get_fd(client)); 
+            if(*playerp && !data) {
+                debug("[%d] Users", client_get_fd(client)); 
+                char *users = ulist_acquire(&resplen); 
+                client_stream_ack(client, users, resplen, ulist_release); 
+            }
+            else if(*playerp) {
+                char *prefix; 
+                size_t offset, limit; 
+                if(parse_users_query((char *)data, &prefix, &offset, &limit) != -1) {
+                    debug("[%d] Users '%s' from %lu (limit %lu)", client_get_fd(client), prefix, offset, limit); 
+                    char *users = ulist_query(prefix, offset, limit, &resplen); 
+                    client_stream_ack(client, users, resplen, ulist_release); 
                 }
                 else {
-                    debug("[%d] Login required", connfd); 
+                    debug("[%d] Malformed USERS query", client_get_fd(client)); 
                     client_send_nack(client); 
                 }
-                break;
-            case JEUX_INVITE_PKT: 
-                debug("[%d] INVITE packet recieved", connfd); 
-                if(player && data) {
-                    char *name = strndup(data, ntohs(header.size)); 
-                    debug("[%d] Invite '%s'", connfd, name); 
-                    CLIENT *dest = creg_lookup(client_registry, name);  
-                    if(dest) {
-                        int id = client_make_invitation(client, dest, header.role%2+1, header.role); 
-                        if(id >= 0) {
-                            memset(&header, 0, sizeof(JEUX_PACKET_HEADER)); 
-                            header.type = JEUX_ACK_PKT; 
-                            header.id = id;  
-                            clock_gettime(CLOCK_MONOTONIC, &time); 
-                            header.timestamp_sec = htonl((uint32_t)time.tv_sec); 
-                            header.timestamp_nsec = htonl((uint32_t)time.tv_nsec); 
-                            client_send_packet(client, &header, NULL);  
-                        }  
-                        else {
-                            debug("[%d] Failed to create invitation", connfd); 
-                            client_send_nack(client); 
-                        }
-                        client_unref(dest, "after invitation attempt"); 
-                    }
+            }
+            else {
+                debug("[%d] Login required", client_get_fd(client)); 
+                client_send_nack(client); 
+            }
+            break;
+        case JEUX_INVITE_PKT: 
+            debug("[%d] INVITE packet recieved", client_get_fd(client)); 
+            if(*playerp && data) {
+                char *name = (char *)data; 
+                debug("[%d] Invite '%s'", client_get_fd(client), name); 
+                CLIENT *dest = creg_lookup(client_registry, name);  
+                if(dest) {
+                    int id = client_make_invitation(client, dest, hdr->role%2+1, hdr->role); 
+                    if(id >= 0) {
+                        JEUX_PACKET_HEADER header = {0}; 
+                        struct timespec time; 
+                        header.type = JEUX_ACK_PKT; 
+                        proto_set_id(&header, id, client_has_extended_ids(client)); 
+                        clock_gettime(CLOCK_MONOTONIC, &time); 
+                        header.timestamp_sec = htonl((uint32_t)time.tv_sec); 
+                        header.timestamp_nsec = htonl((uint32_t)time.tv_nsec); 
+                        client_send_packet(client, &header, NULL);  
+                    }  
                     else {
-                        debug("[%d] No client logged in as '%s'", connfd, name); 
+                        debug("[%d] Failed to create invitation", client_get_fd(client)); 
                         client_send_nack(client); 
                     }
-                    free(name); 
+                    client_unref(dest, "after invitation attempt"); 
                 }
                 else {
-                    debug("[%d] Login required", connfd); 
+                    debug("[%d] No client logged in as '%s'", client_get_fd(client), name); 
                     client_send_nack(client); 
                 }
-                break;
-            case JEUX_REVOKE_PKT: 
-                debug("[%d] REVOKE packet recieved", connfd); 
-                if(player && !data) {
-                    debug("[%d] Revoke '%hhu'", connfd, header.id); 
-                    if(client_revoke_invitation(client, header.id) != -1)
-                        client_send_ack(client, NULL, 0); 
-                    else
-                        client_send_nack(client);  
-                }
-                else {
-                    debug("[%d] Login required", connfd);     
+            }
+            else {
+                debug("[%d] Login required", client_get_fd(client)); 
+                client_send_nack(client); 
+            }
+            break;
+        case JEUX_REVOKE_PKT: 
+            debug("[%d] REVOKE packet recieved", client_get_fd(client)); 
+            if(*playerp && !data) {
+                debug("[%d] Revoke '%d'", client_get_fd(client), invid); 
+                if(client_revoke_invitation(client, invid) != -1)
+                    client_send_ack(client, NULL, 0); 
+                else
+                    client_send_nack(client);  
+            }
+            else {
+                debug("[%d] Login required", client_get_fd(client));     
+                client_send_nack(client); 
+            }
+            break;
+        case JEUX_DECLINE_PKT:
+            debug("[%d] DECLINE packet recieved", client_get_fd(client)); 
+            if(*playerp && !data) {
+                debug("[%d] Decline '%d'", client_get_fd(client), invid); 
+                if(client_decline_invitation(client, invid) != -1)
+                    client_send_ack(client, NULL, 0); 
+                else
                     client_send_nack(client); 
-                }
-                break;
-            case JEUX_DECLINE_PKT:
-                debug("[%d] DECLINE packet recieved", connfd); 
-                if(player && !data) {
-                    debug("[%d] Decline '%hhu'", connfd, header.id); 
-                    if(client_decline_invitation(client, header.id) != -1)
-                        client_send_ack(client, NULL, 0); 
-                    else
-                        client_send_nack(client); 
-                }
-                else {
-                    debug("[%d] Login required", connfd); 
+            }
+            else {
+                debug("[%d] Login required", client_get_fd(client)); 
+                client_send_nack(client); 
+            }
+            break;
+        case JEUX_ACCEPT_PKT: 
+            debug("[%d] ACCEPT packet recieved", client_get_fd(client)); 
+            if(*playerp && !data) {
+                debug("[%d] Accept '%d'", client_get_fd(client), invid); 
+                char state[GAME_STATE_BUFSIZE]; 
+                int len = client_accept_invitation_into(client, invid, state); 
+                if(len != -1) 
+                    client_send_ack(client, len ? state : NULL, len); 
+                else
                     client_send_nack(client); 
-                }
-                break;
-            case JEUX_ACCEPT_PKT: 
-                debug("[%d] ACCEPT packet recieved", connfd); 
-                if(player && !data) {
-                    debug("[%d] Accept '%hhu'", connfd, header.id); 
-                    if(client_accept_invitation(client, header.id, (char **)&data) != -1) 
-                        client_send_ack(client, data, data ? strlen(data) : 0); 
-                    else
-                        client_send_nack(client); 
-                }
-                else {
-                    debug("[%d] Login required", connfd); 
-                    client_send_nack(client); 
-                }
-                break;
-            case JEUX_MOVE_PKT: 
-                debug("[%d] MOVE packet recieved", connfd); 
-                if(player && data) {
-                    char *move = strndup(data, ntohs(header.size)); 
-                    debug("[%d] Move '%hhu' (%s)", connfd, header.id, move); 
-                    if(client_make_move(client, header.id, move) != -1)
-                        client_send_ack(client, NULL, 0); 
-                    else
-                        client_send_nack(client); 
-                    free(move); 
-                }
-                else {
-                    debug("[%d] Login required", connfd); 
+            }
+            else {
+                debug("[%d] Login required", client_get_fd(client)); 
+                client_send_nack(client); 
+            }
+            break;
+        case JEUX_MOVE_PKT: 
+            debug("[%d] MOVE packet recieved", client_get_fd(client)); 
+            if(*playerp && data) {
+                char *move = (char *)data; 
+                debug("[%d] Move '%d' (%s)", client_get_fd(client), invid, move); 
+                if(client_make_move(client, invid, move) != -1)
+                    client_send_ack(client, NULL, 0); 
+                else
                     client_send_nack(client); 
-                }
-                break;
-            case JEUX_RESIGN_PKT:
-                debug("[%d] RESIGN packet recieved", connfd); 
-                if(player && !data) {
-                    debug("[%d] Resign '%hhu'", connfd, header.id); 
-                    if(client_resign_game(client, header.id) != -1)
-                        client_send_ack(client, NULL, 0); 
-                    else
-                        client_send_nack(client); 
-                }
-                else {
-                    debug("[%d] Login required", connfd); 
+            }
+            else {
+                debug("[%d] Login required", client_get_fd(client)); 
+                client_send_nack(client); 
+            }
+            break;
+        case JEUX_EXTIDS_PKT: 
+            debug("[%d] EXTIDS packet recieved", client_get_fd(client)); 
+            if(!*playerp && !data && client_use_extended_ids(client) != -1)
+                client_send_ack(client, NULL, 0); 
+            else
+                client_send_nack(client); 
+            break; 
+        case JEUX_SUBSCRIBE_PKT: 
+            debug("[%d] SUBSCRIBE packet recieved", client_get_fd(client)); 
+            if(!*playerp || data || client_subscribe(client) == -1)
+                client_send_nack(client); 
+            break; 
+        case JEUX_UNSUBSCRIBE_PKT: 
+            debug("[%d] UNSUBSCRIBE packet recieved", client_get_fd(client)); 
+            if(!data && client_unsubscribe(client) != -1)
+                client_send_ack(client, NULL, 0); 
+            else
+                client_send_nack(client); 
+            break; 
+        case JEUX_RESIGN_PKT:
+            debug("[%d] RESIGN packet recieved", client_get_fd(client)); 
+            if(*playerp && !data) {
+                debug("[%d] Resign '%d'", client_get_fd(client), invid); 
+                if(client_resign_game(client, invid) != -1)
+                    client_send_ack(client, NULL, 0); 
+                else
                     client_send_nack(client); 
-                }
-                break;
-        }           
-        if(data)
-            free(data); 
-    }    
-    
-    // Cleanup
+            }
+            else {
+                debug("[%d] Login required", client_get_fd(client)); 
+                client_send_nack(client); 
+            }
+            break;
+    }
+    client_uncork(); 
+}
+
+void jeux_client_finish(CLIENT *client, PLAYER *player) {
+    int connfd = client_get_fd(client); 
     if(player) {
         player_unref(player, "becuase server thread is discarding reference to logged in player"); 
         debug("[%d] Logging out of client", connfd); 
+        client_cork(); 
         client_logout(client); 
+        client_uncork(); 
     }
+#ifdef DEBUG
+    CLIENT_OUTPUT_STATS stats; 
+    client_get_output_stats(client, &stats); 
+    debug("[%d] Output peaked at %lu bytes / %lu packets, %lu dropped%s", connfd, 
+        stats.peak_bytes, stats.peak_packets, stats.dropped, stats.evicted ? ", evicted" : ""); 
+#endif
     debug("[%d] Ending client service", connfd); 
+    client_set_wakeup(client, NULL, NULL); 
     creg_unregister(client_registry, client);
     close(connfd); 
-    pthread_exit(NULL); 
-}
\ No newline at end of file
+}
+
+/*
+ * A client serviced by its own thread is woken up through an eventfd that
+ * the thread waits on along with its socket.  Output that the thread
+ * queues for its own client is written out after each request, so it
+ * does not need to wake itself up.
+ */
+typedef struct jeux_wakeup {
+    int fd; 
+    pthread_t owner; 
+} JEUX_WAKEUP; 
+
+static void jeux_client_wakeup(void *arg) {
+    JEUX_WAKEUP *wake = (JEUX_WAKEUP *)arg; 
+    uint64_t one = 1; 
+    if(!pthread_equal(wake->owner, pthread_self()) && write(wake->fd, &one, sizeof(one)) < 0)
+        debug("Failed to wake up client service thread"); 
+}
+
+static void jeux_client_wakeup_clear(JEUX_WAKEUP *wake) {
+    uint64_t count; 
+    if(read(wake->fd, &count, sizeof(count)) < 0)
+        debug("Failed to clear client wakeup"); 
+}
+
+void jeux_client_serve(int connfd) {
+    CLIENT *client; 
+    PLAYER *player; 
+    JEUX_PACKET_HEADER header; 
+    void *data; 
+    PROTO_READER *rp = NULL; 
+    PROTO_URING *pu; 
+    JEUX_WAKEUP wake; 
+    struct pollfd pfd[2]; 
+    int out = 0; 
+
+    // Initialize
+    debug("[%d] Starting client service", connfd); 
+    client = creg_register(client_registry, connfd); 
+    player = NULL; 
+    if(!client) {
+        debug("[%d] Failed to register client", connfd); 
+        close(connfd); 
+        return; 
+    }
+    wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); 
+    wake.owner = pthread_self(); 
+    if(wake.fd < 0) {
+        debug("[%d] Failed to create wakeup descriptor", connfd); 
+        jeux_client_finish(client, NULL); 
+        return; 
+    }
+    client_set_wakeup(client, jeux_client_wakeup, &wake); 
+
+    pu = proto_uring_enabled ? proto_uring_create(connfd) : NULL; 
+    if(!pu)
+        rp = proto_reader_create(connfd); 
+
+    // Main Loop
+    if(pu) {
+        proto_uring_set_wakefd(pu, wake.fd); 
+        while(1) {
+            if(proto_uring_recv_packet(pu, &header, &data) == -1) {
+                if(errno != EINTR)
+                    break; 
+                jeux_client_wakeup_clear(&wake); 
+            }
+            else {
+                jeux_client_dispatch(client, &player, &header, data); 
+                ppool_free(data); 
+                data = NULL; 
+            }
+            if(client_flush_output(client) < 0)
+                break; 
+        }
+        ppool_free(data); 
+        proto_uring_destroy(pu); 
+    }
+    else {
+        // The socket is made non-blocking, so that the thread can wait for
+        // requests, wakeups and room to write all at once.
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK); 
+        pfd[0].fd = connfd; 
+        pfd[1].fd = wake.fd; 
+        pfd[1].events = POLLIN; 
+        while(1) {
+            if(proto_reader_next(rp, &header, &data) == 0) {
+                jeux_client_dispatch(client, &player, &header, data); 
+                // Responses to pipelined requests are written out together.
+                if(!proto_reader_buffered(rp) && (out = client_flush_output(client)) < 0)
+                    break; 
+                continue; 
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                break; 
+            if((out = client_flush_output(client)) < 0)
+                break; 
+            pfd[0].events = out ? POLLIN | POLLOUT : POLLIN; 
+            if(poll(pfd, 2, -1) < 0 && errno != EINTR)
+                break; 
+            if(pfd[1].revents & POLLIN)
+                jeux_client_wakeup_clear(&wake); 
+        }
+        proto_reader_destroy(rp); 
+    }
+    
+    // Cleanup
+    jeux_client_finish(client, player); 
+    close(wake.fd); 
+}
+
+void *jeux_client_service(void *arg) {
+    int connfd; 
+    pthread_detach(pthread_self()); 
+    connfd = *((int *)arg); 
+    free(arg); 
+    jeux_client_serve(connfd); 
+    return NULL; 
+}
@@ -0,0 +1,131 @@
+#include <stdlib.h>
+
+#include "slot_map.h"
+
+#define SMAP_MIN 4
+
+/*
+ * A slot holds its current ID, if it is in use, or the ID it will give
+ * out next, if it is free.  Free slots are linked, by position, into a
+ * queue.
+ */
+typedef struct smap_slot {
+    unsigned int id; 
+    int next; 
+    void *item; 
+} SMAP_SLOT; 
+
+struct slot_map {
+    SMAP_SLOT *slots; 
+    size_t cap, count; 
+    unsigned int idmask; 
+    int head, tail; 
+}; 
+
+SLOT_MAP *smap_create(int idbits) {
+    SLOT_MAP *map = (SLOT_MAP *)calloc(sizeof(SLOT_MAP), 1); 
+    map->idmask = (1U << idbits) - 1; 
+    map->head = map->tail = -1; 
+    return map; 
+}
+
+void smap_free(SLOT_MAP *map) {
+    free(map->slots); 
+    free(map); 
+}
+
+static void smap_push_free(SLOT_MAP *map, int pos) {
+    map->slots[pos].next = -1; 
+    if(map->tail >= 0)
+        map->slots[map->tail].next = pos; 
+    else
+        map->head = pos; 
+    map->tail = pos; 
+}
+
+/*
+ * Double the table.  Each slot moves to the position its ID now selects,
+ * which is either where it was or that plus the old size, and the slot
+ * it leaves free at the other position takes the corresponding ID.
+ */
+static int smap_grow(SLOT_MAP *map) {
+    if(map->cap > map->idmask)
+        return -1; 
+    size_t cap = map->cap ? 2 * map->cap : SMAP_MIN; 
+    if(cap > (size_t)map->idmask + 1)
+        cap = (size_t)map->idmask + 1; 
+    SMAP_SLOT *slots = (SMAP_SLOT *)calloc(sizeof(SMAP_SLOT), cap); 
+    if(!slots)
+        return -1; 
+    if(!map->cap) {
+        for(size_t pos = 0; pos < cap; ++pos)
+            slots[pos].id = pos; 
+    }
+    for(size_t pos = 0; pos < map->cap; ++pos) {
+        SMAP_SLOT *from = &map->slots[pos]; 
+        size_t to = from->id & (cap - 1); 
+        slots[to] = *from; 
+        slots[to ^ map->cap].id = from->id ^ map->cap; 
+    }
+    free(map->slots); 
+    map->slots = slots; 
+    map->cap = cap; 
+    map->head = map->tail = -1; 
+    for(size_t pos = 0; pos < cap; ++pos) {
+        if(!slots[pos].item)
+            smap_push_free(map, pos); 
+    }
+    return 0; 
+}
+
+static SMAP_SLOT *smap_slot(SLOT_MAP *map, int id) {
+    if(id < 0 || (unsigned int)id > map->idmask || !map->cap)
+        return NULL; 
+    SMAP_SLOT *slot = &map->slots[id & (map->cap - 1)]; 
+    return slot->item && slot->id == (unsigned int)id ? slot : NULL; 
+}
+
+int smap_insert(SLOT_MAP *map, void *item) {
+    if(map->head < 0 && smap_grow(map))
+        return -1; 
+    SMAP_SLOT *slot = &map->slots[map->head]; 
+    map->head = slot->next; 
+    if(map->head < 0)
+        map->tail = -1; 
+    slot->item = item; 
+    map->count++; 
+    return slot->id; 
+}
+
+void *smap_get(SLOT_MAP *map, int id) {
+    SMAP_SLOT *slot = smap_slot(map, id); 
+    return slot ? slot->item : NULL; 
+}
+
+void *smap_remove(SLOT_MAP *map, int id) {
+    SMAP_SLOT *slot = smap_slot(map, id); 
+    if(!slot)
+        return NULL; 
+    void *item = slot->item; 
+    slot->item = NULL; 
+    map->count--; 
+    // The next ID with the same position, wrapping around the ID space.
+    slot->id = (slot->id + map->cap) & map->idmask; 
+    smap_push_free(map, slot - map->slots); 
+    return item; 
+}
+
+size_t smap_count(SLOT_MAP *map) {
+    return map->count; 
+}
+
+size_t smap_capacity(SLOT_MAP *map) {
+    return map->cap; 
+}
+
+void *smap_at(SLOT_MAP *map, size_t pos, int *idp) {
+    SMAP_SLOT *slot = &map->slots[pos]; 
+    if(slot->item)
+        *idp = slot->id; 
+    return slot->item; 
+}
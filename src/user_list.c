@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "user_list.h"
+#include "client_registry.h"
+#include "client_registry_ext.h"
+#include "jeux_globals.h"
+#include "debug.h"
+
+typedef struct user_list {
+    size_t refs; 
+    unsigned long version; 
+    size_t len; 
+    char data[]; 
+} USER_LIST; 
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER; 
+static USER_LIST *current; 
+static unsigned long version = 1; 
+
+void ulist_invalidate(void) {
+    __atomic_add_fetch(&version, 1, __ATOMIC_RELEASE); 
+}
+
+/*
+ * Longest line for a player, apart from the name: a tab, a rating, which
+ * is an int, and a newline.
+ */
+#define ULIST_LINE_EXTRA (sizeof("\t-2147483648\n") - 1)
+
+/*
+ * Build a list of players, in the format of the response to USERS, and
+ * release the list.  The text is written straight into the USER_LIST,
+ * which is allocated once, large enough for the longest line each player
+ * could have: names do not change, but ratings may change while the list
+ * is built.
+ */
+static USER_LIST *ulist_build(PLAYER **plist, unsigned long version) {
+    size_t size = 0; 
+    for(PLAYER **pp = plist; *pp; pp++)
+        size += strlen(player_get_name(*pp)) + ULIST_LINE_EXTRA; 
+    USER_LIST *list = (USER_LIST *)malloc(sizeof(USER_LIST) + size + 1); 
+    list->refs = 1; 
+    list->version = version; 
+    char *bp = list->data; 
+    for(PLAYER **pp = plist; *pp; pp++) {
+        char *name = player_get_name(*pp); 
+        size_t nlen = strlen(name); 
+        memcpy(bp, name, nlen); 
+        bp += nlen; 
+        bp += sprintf(bp, "\t%d\n", player_get_rating(*pp)); 
+        player_unref(*pp, "for player removed from players list"); 
+    }
+    free(plist); 
+    list->len = bp - list->data; 
+    return list; 
+}
+
+char *ulist_acquire(size_t *lenp) {
+    // The version is read before the list is built, so that a change
+    // made while it is being built leaves it out of date.
+    unsigned long v = __atomic_load_n(&version, __ATOMIC_ACQUIRE); 
+    pthread_mutex_lock(&mutex); 
+    if(!current || current->version < v) {
+        USER_LIST *list = ulist_build(creg_all_players(client_registry), v); 
+        debug("Built user list version %lu (%lu bytes)", v, list->len); 
+        if(current)
+            ulist_release(current->data); 
+        current = list; 
+    }
+    USER_LIST *list = current; 
+    __atomic_add_fetch(&list->refs, 1, __ATOMIC_RELAXED); 
+    pthread_mutex_unlock(&mutex); 
+    *lenp = list->len; 
+    return list->data; 
+}
+
+void ulist_release(char *data) {
+    USER_LIST *list = (USER_LIST *)(data - offsetof(USER_LIST, data)); 
+    if(!__atomic_sub_fetch(&list->refs, 1, __ATOMIC_ACQ_REL))
+        free(list); 
+}
+
+char *ulist_query(char *prefix, size_t offset, size_t limit, size_t *lenp) {
+    USER_LIST *list = ulist_build(creg_find_players(client_registry, prefix, offset, limit), 0); 
+    *lenp = list->len; 
+    return list->data; 
+}
+
+void ulist_fini(void) {
+    pthread_mutex_lock(&mutex); 
+    if(current)
+        ulist_release(current->data); 
+    current = NULL; 
+    pthread_mutex_unlock(&mutex); 
+}
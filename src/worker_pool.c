@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "worker_pool.h"
+#include "server_ext.h"
+#include "debug.h"
+
+#define WPOOL_QUEUE_MIN 64
+#define WPOOL_IDLE_SECS 10
+
+typedef struct wpool {
+    pthread_mutex_t mutex; 
+    pthread_cond_t cond; 
+    pthread_attr_t attr; 
+    int *fds; 
+    size_t head, count, cap; 
+    int nworkers, nidle, minworkers; 
+} WPOOL; 
+
+static WPOOL pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+}; 
+
+/*
+ * Wait for a connection to be queued.  Workers beyond the number the pool
+ * was started with only wait so long, so that those started for a burst
+ * of connections go away again once it is over.
+ *
+ * @return 0 if there is a connection, or -1 if the worker is to exit.
+ */
+static int wpool_wait(void) {
+    struct timespec deadline; 
+    clock_gettime(CLOCK_MONOTONIC, &deadline); 
+    deadline.tv_sec += WPOOL_IDLE_SECS; 
+    while(!pool.count) {
+        if(pool.nworkers <= pool.minworkers)
+            pthread_cond_wait(&pool.cond, &pool.mutex); 
+        else if(pthread_cond_timedwait(&pool.cond, &pool.mutex, &deadline) == ETIMEDOUT
+                && !pool.count && pool.nworkers > pool.minworkers)
+            return -1; 
+    }
+    return 0; 
+}
+
+static void *wpool_worker(void *arg) {
+    pthread_mutex_lock(&pool.mutex); 
+    while(1) {
+        pool.nidle++; 
+        int status = wpool_wait(); 
+        pool.nidle--; 
+        if(status)
+            break; 
+        int fd = pool.fds[pool.head]; 
+        pool.head = (pool.head + 1) % pool.cap; 
+        pool.count--; 
+        pthread_mutex_unlock(&pool.mutex); 
+        jeux_client_serve(fd); 
+        pthread_mutex_lock(&pool.mutex); 
+    }
+    pool.nworkers--; 
+    debug("Idle worker exits (%d left)", pool.nworkers); 
+    pthread_mutex_unlock(&pool.mutex); 
+    return NULL; 
+}
+
+/*
+ * Start one more worker.  Workers must not take SIGHUP, since the handler
+ * waits for all clients (including the ones the workers serve) to go away.
+ */
+static int wpool_spawn(void) {
+    pthread_t tid; 
+    sigset_t mask, omask; 
+    // The worker is counted before it starts, so that an idle one deciding
+    // whether to exit sees it.
+    pthread_mutex_lock(&pool.mutex); 
+    pool.nworkers++; 
+    pthread_mutex_unlock(&pool.mutex); 
+    sigfillset(&mask); 
+    pthread_sigmask(SIG_BLOCK, &mask, &omask); 
+    int status = pthread_create(&tid, &pool.attr, wpool_worker, NULL); 
+    pthread_sigmask(SIG_SETMASK, &omask, NULL); 
+    if(status != 0) {
+        debug("pthread_create: %s", strerror(status)); 
+        pthread_mutex_lock(&pool.mutex); 
+        pool.nworkers--; 
+        pthread_mutex_unlock(&pool.mutex); 
+        return -1; 
+    }
+    return 0; 
+}
+
+int wpool_init(int nworkers, size_t stacksize) {
+    pthread_attr_init(&pool.attr); 
+    pthread_attr_setdetachstate(&pool.attr, PTHREAD_CREATE_DETACHED); 
+    if(stacksize && (errno = pthread_attr_setstacksize(&pool.attr, stacksize))) {
+        debug("pthread_attr_setstacksize: %s", strerror(errno)); 
+        return -1; 
+    }
+    // Idle workers time out against the monotonic clock, which setting
+    // the time of day does not disturb.
+    pthread_condattr_t cattr; 
+    pthread_condattr_init(&cattr); 
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC); 
+    pthread_cond_init(&pool.cond, &cattr); 
+    pthread_condattr_destroy(&cattr); 
+    pool.cap = WPOOL_QUEUE_MIN; 
+    pool.fds = (int *)malloc(pool.cap * sizeof(int)); 
+    pool.minworkers = nworkers; 
+    for(int i = 0; i < nworkers; ++i) {
+        if(wpool_spawn())
+            break; 
+    }
+    pthread_mutex_lock(&pool.mutex); 
+    pool.minworkers = pool.nworkers; 
+    pthread_mutex_unlock(&pool.mutex); 
+    debug("Started %d of %d workers", pool.nworkers, nworkers); 
+    return pool.nworkers ? 0 : -1; 
+}
+
+void wpool_submit(int fd) {
+    pthread_mutex_lock(&pool.mutex); 
+    if(pool.count == pool.cap) {
+        int *fds = (int *)malloc(2 * pool.cap * sizeof(int)); 
+        for(size_t i = 0; i < pool.count; ++i)
+            fds[i] = pool.fds[(pool.head + i) % pool.cap]; 
+        free(pool.fds); 
+        pool.fds = fds; 
+        pool.head = 0; 
+        pool.cap *= 2; 
+    }
+    pool.fds[(pool.head + pool.count++) % pool.cap] = fd; 
+    // Every queued connection needs an idle worker of its own.
+    int spawn = pool.nidle < pool.count; 
+    pthread_cond_signal(&pool.cond); 
+    pthread_mutex_unlock(&pool.mutex); 
+    if(spawn && wpool_spawn())
+        debug("[%d] Connection waits for a worker to become free", fd); 
+}
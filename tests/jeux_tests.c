@@ -5,6 +5,23 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <wait.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/prctl.h>
+#include <poll.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "game.h"
+#include "game_ext.h"
+#include "player_registry.h"
+#include "client_registry_ext.h"
+#include "arraylist.h"
+#include "obj_pool.h"
 
 /* Directory in which to create test output files. */
 #define TEST_OUTPUT "test_output/"
@@ -74,3 +91,945 @@ Test(student_suite, 01_connect, .init = init, .fini = fini, .timeout = 5) {
     int ret = system("util/jclient -p 9999 </dev/null | grep 'Connected to server'");
     cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
 }
+
+/*
+ * Helpers for the tests below, which talk to the server directly so as
+ * to exercise the packet types that util/jclient does not know about.
+ */
+static int connect_to_server(int port) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert_neq(fd, -1, "socket() failed");
+    cr_assert_eq(connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0, "Failed to connect to server");
+    return fd;
+}
+
+static void send_packet(int fd, int type, uint32_t id, int extended, int role, char *data) {
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = type;
+    proto_set_id(&hdr, id, extended);
+    hdr.role = role;
+    hdr.size = htons(data ? strlen(data) : 0);
+    cr_assert_eq(proto_send_packet(fd, &hdr, data), 0, "Failed to send packet");
+}
+
+/*
+ * Receive a packet, returning its payload as a NUL-terminated string
+ * that the caller must free.
+ */
+static char *recv_packet(int fd, JEUX_PACKET_HEADER *hdr) {
+    void *payload = NULL;
+    cr_assert_eq(proto_recv_packet(fd, hdr, &payload), 0, "Failed to receive packet");
+    size_t size = ntohs(hdr->size);
+    char *str = calloc(size + 1, 1);
+    if(payload)
+        memcpy(str, payload, size);
+    free(payload);
+    return str;
+}
+
+/*
+ * Receive packets until one of the specified type arrives, passing over
+ * notifications caused by tests running at the same time.
+ */
+static char *expect_packet(int fd, int type, JEUX_PACKET_HEADER *hdr) {
+    while(1) {
+        char *str = recv_packet(fd, hdr);
+        if(hdr->type == type)
+            return str;
+        free(str);
+    }
+}
+
+/*
+ * Receive packets until a presence notification of the specified type
+ * arrives for the named player.
+ */
+static char *expect_notice(int fd, int type, char *name) {
+    JEUX_PACKET_HEADER hdr;
+    size_t len = strlen(name);
+    while(1) {
+        char *str = expect_packet(fd, type, &hdr);
+        if(!strncmp(str, name, len) && (str[len] == '\t' || str[len] == '\0'))
+            return str;
+        free(str);
+    }
+}
+
+/*
+ * Receive the response to a request: the payloads of any CHUNK packets
+ * followed by that of the ACK or NACK, which leaves its header in hdr.
+ */
+static char *recv_response(int fd, JEUX_PACKET_HEADER *hdr, int *nchunksp) {
+    char *body = calloc(1, 1);
+    size_t len = 0;
+    int nchunks = 0;
+    while(1) {
+        char *str = recv_packet(fd, hdr);
+        if(hdr->type == JEUX_CHUNK_PKT || hdr->type == JEUX_ACK_PKT || hdr->type == JEUX_NACK_PKT) {
+            size_t size = ntohs(hdr->size);
+            cr_assert(hdr->type != JEUX_CHUNK_PKT || size == JEUX_CHUNK_MAX,
+                      "CHUNK carried %lu bytes, not %d", size, JEUX_CHUNK_MAX);
+            body = realloc(body, len + size + 1);
+            memcpy(body + len, str, size + 1);
+            len += size;
+        }
+        free(str);
+        if(hdr->type == JEUX_CHUNK_PKT)
+            nchunks++;
+        else if(hdr->type == JEUX_ACK_PKT || hdr->type == JEUX_NACK_PKT)
+            break;
+    }
+    if(nchunksp)
+        *nchunksp = nchunks;
+    return body;
+}
+
+static int login(int port, char *name) {
+    JEUX_PACKET_HEADER hdr;
+    int fd = connect_to_server(port);
+    send_packet(fd, JEUX_LOGIN_PKT, 0, 0, 0, name);
+    free(recv_response(fd, &hdr, NULL));
+    cr_assert_eq(hdr.type, JEUX_ACK_PKT, "Login of '%s' was not ACKed", name);
+    return fd;
+}
+
+/*
+ * Send a request and check whether it was ACKed, returning the response.
+ */
+static char *request(int fd, int type, uint32_t id, int extended, int role, char *data,
+                     int ack, JEUX_PACKET_HEADER *hdr) {
+    send_packet(fd, type, id, extended, role, data);
+    char *body = recv_response(fd, hdr, NULL);
+    cr_assert_eq(hdr->type, ack ? JEUX_ACK_PKT : JEUX_NACK_PKT,
+                 "Request type %d was %s, expected %s", type,
+                 hdr->type == JEUX_ACK_PKT ? "ACKed" : "NACKed", ack ? "ACK" : "NACK");
+    return body;
+}
+
+Test(student_suite, 02_presence, .init = init, .fini = fini, .timeout = 5) {
+    fprintf(stderr, "server_suite/02_presence\n");
+    JEUX_PACKET_HEADER hdr;
+    int watcher = login(9999, "pres_watcher");
+    char *users = request(watcher, JEUX_SUBSCRIBE_PKT, 0, 0, 0, NULL, 1, &hdr);
+    cr_assert_not_null(strstr(users, "pres_watcher\t1500\n"), "Baseline does not list the subscriber");
+    free(users);
+    free(request(watcher, JEUX_SUBSCRIBE_PKT, 0, 0, 0, NULL, 0, &hdr));
+
+    int a = login(9999, "pres_a");
+    char *str = expect_notice(watcher, JEUX_ONLINE_PKT, "pres_a");
+    cr_assert_str_eq(str, "pres_a\t1500", "ONLINE payload was '%s'", str);
+    free(str);
+    int b = login(9999, "pres_b");
+    free(expect_notice(watcher, JEUX_ONLINE_PKT, "pres_b"));
+
+    // A game that ends changes both players' ratings.
+    free(request(a, JEUX_INVITE_PKT, 0, 0, SECOND_PLAYER_ROLE, "pres_b", 1, &hdr));
+    int aid = hdr.id;
+    free(expect_packet(b, JEUX_INVITED_PKT, &hdr));
+    free(request(b, JEUX_ACCEPT_PKT, hdr.id, 0, 0, NULL, 1, &hdr));
+    free(expect_packet(a, JEUX_ACCEPTED_PKT, &hdr));
+    free(request(a, JEUX_RESIGN_PKT, aid, 0, 0, NULL, 1, &hdr));
+    int rated = 0;
+    while(rated != 3) {
+        str = expect_packet(watcher, JEUX_RATING_PKT, &hdr);
+        if(!strncmp(str, "pres_a\t", 7) || !strncmp(str, "pres_b\t", 7)) {
+            cr_assert_neq(atoi(str + 7), 1500, "RATING payload was '%s'", str);
+            rated |= str[5] == 'a' ? 1 : 2;
+        }
+        free(str);
+    }
+
+    close(a);
+    str = expect_notice(watcher, JEUX_OFFLINE_PKT, "pres_a");
+    cr_assert_str_eq(str, "pres_a", "OFFLINE payload was '%s'", str);
+    free(str);
+    free(request(watcher, JEUX_UNSUBSCRIBE_PKT, 0, 0, 0, NULL, 1, &hdr));
+    free(request(watcher, JEUX_UNSUBSCRIBE_PKT, 0, 0, 0, NULL, 0, &hdr));
+    close(b);
+    close(watcher);
+}
+
+Test(student_suite, 03_chunked_users, .init = init, .fini = fini, .timeout = 5) {
+    fprintf(stderr, "server_suite/03_chunked_users\n");
+    JEUX_PACKET_HEADER hdr;
+    // Enough long names that the list of users needs more than one packet.
+    char names[20][4096];
+    int fds[20];
+    for(int i = 0; i < 20; ++i) {
+        sprintf(names[i], "chunk_%02d_", i);
+        memset(names[i] + 9, 'x', sizeof(names[i]) - 10);
+        names[i][sizeof(names[i]) - 1] = '\0';
+        fds[i] = login(9999, names[i]);
+    }
+    // Responses queued behind a streamed one come after all of it.
+    int nchunks[2];
+    send_packet(fds[0], JEUX_USERS_PKT, 0, 0, 0, NULL);
+    send_packet(fds[0], JEUX_USERS_PKT, 0, 0, 0, NULL);
+    send_packet(fds[0], JEUX_LOGIN_PKT, 0, 0, 0, "chunk_again");
+    char *users[2];
+    for(int i = 0; i < 2; ++i) {
+        users[i] = recv_response(fds[0], &hdr, &nchunks[i]);
+        cr_assert_eq(hdr.type, JEUX_ACK_PKT, "USERS was not ACKed");
+        cr_assert_gt(nchunks[i], 0, "USERS response was not sent in chunks");
+    }
+    free(recv_response(fds[0], &hdr, NULL));
+    cr_assert_eq(hdr.type, JEUX_NACK_PKT, "Second LOGIN was not NACKed");
+    for(int i = 0; i < 20; ++i) {
+        char *line = strstr(users[0], names[i]);
+        cr_assert_not_null(line, "Player %d is missing from USERS", i);
+        cr_assert(!strncmp(line + strlen(names[i]), "\t1500\n", 6), "Player %d is listed incorrectly", i);
+        cr_assert_not_null(strstr(users[1], names[i]), "Player %d is missing from second USERS", i);
+    }
+    free(users[0]);
+    free(users[1]);
+    for(int i = 0; i < 20; ++i)
+        close(fds[i]);
+}
+
+Test(student_suite, 04_users_query, .init = init, .fini = fini, .timeout = 5) {
+    fprintf(stderr, "server_suite/04_users_query\n");
+    JEUX_PACKET_HEADER hdr;
+    char *names[] = {"query_c", "query_a", "query_e", "query_b", "query_d"};
+    int fds[5];
+    for(int i = 0; i < 5; ++i)
+        fds[i] = login(9999, names[i]);
+    struct {
+        char *query;
+        char *result;
+    } tests[] = {
+        {"query_", "query_a\t1500\nquery_b\t1500\nquery_c\t1500\nquery_d\t1500\nquery_e\t1500\n"},
+        {"query_b", "query_b\t1500\n"},
+        {"query_\t1\t2", "query_b\t1500\nquery_c\t1500\n"},
+        {"query_\t3", "query_d\t1500\nquery_e\t1500\n"},
+        {"query_\t4\t0", "query_e\t1500\n"},
+        {"query_\t9\t1", ""},
+        {"query_z", ""}
+    };
+    for(int i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+        char *users = request(fds[0], JEUX_USERS_PKT, 0, 0, 0, tests[i].query, 1, &hdr);
+        cr_assert_str_eq(users, tests[i].result, "Query %d returned '%s'", i, users);
+        free(users);
+    }
+    char *bad[] = {"query_\tx", "query_\t1\t2\t3", "query_\t-1", "query_\t"};
+    for(int i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+        free(request(fds[0], JEUX_USERS_PKT, 0, 0, 0, bad[i], 0, &hdr));
+    for(int i = 0; i < 5; ++i)
+        close(fds[i]);
+}
+
+Test(student_suite, 05_extended_ids, .init = init, .fini = fini, .timeout = 5) {
+    fprintf(stderr, "server_suite/05_extended_ids\n");
+    JEUX_PACKET_HEADER hdr;
+    int bot = connect_to_server(9999);
+    free(request(bot, JEUX_EXTIDS_PKT, 0, 0, 0, NULL, 1, &hdr));
+    free(request(bot, JEUX_LOGIN_PKT, 0, 1, 0, "ext_bot", 1, &hdr));
+    free(request(bot, JEUX_EXTIDS_PKT, 0, 1, 0, NULL, 0, &hdr));
+    int targets[2] = {login(9999, "ext_t0"), login(9999, "ext_t1")};
+
+    // More invitations than 8-bit IDs allow, split over two ordinary
+    // clients, which each stay within their own 256 IDs.
+    uint32_t ids[300], tids[300];
+    int max = 0;
+    for(int i = 0; i < 300; ++i) {
+        free(request(bot, JEUX_INVITE_PKT, 0, 1, SECOND_PLAYER_ROLE, i % 2 ? "ext_t1" : "ext_t0", 1, &hdr));
+        ids[i] = proto_get_id(&hdr, 1);
+        free(expect_packet(targets[i % 2], JEUX_INVITED_PKT, &hdr));
+        tids[i] = proto_get_id(&hdr, 0);
+        for(int j = 0; j < i; ++j)
+            cr_assert_neq(ids[i], ids[j], "Invitations %d and %d have the same ID", j, i);
+        if(ids[i] > ids[max])
+            max = i;
+    }
+    cr_assert_gt(ids[max], 255, "No invitation ID was wider than 8 bits");
+
+    // Packets about the invitation carry the whole ID.
+    free(request(targets[max % 2], JEUX_ACCEPT_PKT, tids[max], 0, 0, NULL, 1, &hdr));
+    free(expect_packet(bot, JEUX_ACCEPTED_PKT, &hdr));
+    cr_assert_eq(proto_get_id(&hdr, 1), ids[max], "ACCEPTED has ID %u, expected %u",
+                 proto_get_id(&hdr, 1), ids[max]);
+    free(request(bot, JEUX_MOVE_PKT, ids[max], 1, 0, "5", 1, &hdr));
+    free(expect_packet(targets[max % 2], JEUX_MOVED_PKT, &hdr));
+    cr_assert_eq(hdr.id, tids[max], "MOVED has ID %u, expected %u", hdr.id, tids[max]);
+    close(bot);
+    close(targets[0]);
+    close(targets[1]);
+}
+
+Test(student_suite, 06_stale_id, .init = init, .fini = fini, .timeout = 5) {
+    fprintf(stderr, "server_suite/06_stale_id\n");
+    JEUX_PACKET_HEADER hdr;
+    int a = login(9999, "stale_a");
+    int b = login(9999, "stale_b");
+    free(request(a, JEUX_INVITE_PKT, 0, 0, SECOND_PLAYER_ROLE, "stale_b", 1, &hdr));
+    int aid = hdr.id;
+    free(expect_packet(b, JEUX_INVITED_PKT, &hdr));
+    int bid = hdr.id;
+    free(request(a, JEUX_REVOKE_PKT, aid, 0, 0, NULL, 1, &hdr));
+    free(expect_packet(b, JEUX_REVOKED_PKT, &hdr));
+    cr_assert_eq(hdr.id, bid, "REVOKED has ID %d, expected %d", hdr.id, bid);
+
+    // The IDs of the revoked invitation no longer refer to anything, and
+    // are not handed out again straight away.
+    free(request(a, JEUX_REVOKE_PKT, aid, 0, 0, NULL, 0, &hdr));
+    free(request(b, JEUX_ACCEPT_PKT, bid, 0, 0, NULL, 0, &hdr));
+    free(request(a, JEUX_INVITE_PKT, 0, 0, SECOND_PLAYER_ROLE, "stale_b", 1, &hdr));
+    cr_assert_neq(hdr.id, aid, "Stale ID %d was reused", aid);
+    free(expect_packet(b, JEUX_INVITED_PKT, &hdr));
+    cr_assert_neq(hdr.id, bid, "Stale ID %d was reused", bid);
+    free(request(b, JEUX_ACCEPT_PKT, bid, 0, 0, NULL, 0, &hdr));
+    close(a);
+    close(b);
+}
+
+Test(student_suite, 07_evict_slow_client, .init = init, .fini = fini, .timeout = 5) {
+    fprintf(stderr, "server_suite/07_evict_slow_client\n");
+    JEUX_PACKET_HEADER hdr;
+    // A client that never reads, with a small receive buffer.
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(9999);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int slow = socket(AF_INET, SOCK_STREAM, 0);
+    int rcvbuf = 4096;
+    setsockopt(slow, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    cr_assert_eq(connect(slow, (struct sockaddr *)&addr, sizeof(addr)), 0, "Failed to connect to server");
+    send_packet(slow, JEUX_LOGIN_PKT, 0, 0, 0, "evict_slow");
+    usleep(200000);
+
+    // Each INVITED carries the sender's name, so a long one fills the
+    // socket buffers and then the output budget in a few round trips.
+    char name[60000];
+    memset(name, 's', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    int sender = login(9999, name);
+    int i;
+    for(i = 0; i < 10000; ++i) {
+        send_packet(sender, JEUX_INVITE_PKT, 0, 0, FIRST_PLAYER_ROLE, "evict_slow");
+        free(recv_response(sender, &hdr, NULL));
+        if(hdr.type == JEUX_NACK_PKT)
+            break;
+        send_packet(sender, JEUX_REVOKE_PKT, hdr.id, 0, 0, NULL);
+        free(recv_response(sender, &hdr, NULL));
+        if(hdr.type == JEUX_NACK_PKT)
+            break;
+    }
+    cr_assert_lt(i, 10000, "Client that does not read was not evicted");
+    char *users = request(sender, JEUX_USERS_PKT, 0, 0, 0, "evict_", 1, &hdr);
+    cr_assert_str_eq(users, "", "Evicted client is still logged in");
+    free(users);
+    close(slow);
+    close(sender);
+}
+
+/*
+ * Threads that register the same names in different orders, checking
+ * that each registration returns the player with the requested name.
+ */
+#define PREG_TEST_THREADS 4
+#define PREG_TEST_NAMES 5000
+
+static PLAYER_REGISTRY *preg_test_registry;
+
+static void *preg_test_thread(void *arg) {
+    long stride = 2 * (long)arg + 1;
+    char name[32];
+    for(long i = 0; i < PREG_TEST_NAMES; ++i) {
+        sprintf(name, "preg_%ld", i * stride % PREG_TEST_NAMES);
+        PLAYER *player = preg_register(preg_test_registry, name);
+        int wrong = strcmp(player_get_name(player), name);
+        player_unref(player, "after registration test");
+        if(wrong)
+            return (void *)1;
+    }
+    return NULL;
+}
+
+Test(student_suite, 08_player_registry, .timeout = 30) {
+    fprintf(stderr, "server_suite/08_player_registry\n");
+    preg_test_registry = preg_init();
+    pthread_t tids[PREG_TEST_THREADS];
+    for(long i = 0; i < PREG_TEST_THREADS; ++i)
+        pthread_create(&tids[i], NULL, preg_test_thread, (void *)(3 * i));
+    for(int i = 0; i < PREG_TEST_THREADS; ++i) {
+        void *ret;
+        pthread_join(tids[i], &ret);
+        cr_assert_null(ret, "A registration returned a player with a different name");
+    }
+    char name[32];
+    for(int i = 0; i < PREG_TEST_NAMES; ++i) {
+        sprintf(name, "preg_%d", i);
+        PLAYER *player = preg_register(preg_test_registry, name);
+        PLAYER *again = preg_register(preg_test_registry, name);
+        cr_assert_eq(player, again, "Name '%s' was registered twice", name);
+        cr_assert_str_eq(player_get_name(player), name, "Name '%s' maps to '%s'", name, player_get_name(player));
+        player_unref(player, "after registration test");
+        player_unref(again, "after registration test");
+    }
+    preg_fini(preg_test_registry);
+}
+
+/*
+ * Names whose FNV-1a hashes, the hash the client registry uses for its
+ * stripes, rise in the same order as the names.  If the sorted index
+ * took its priorities from that hash, it would be a list of these
+ * names, and unbinding them would recurse once per name.
+ */
+#define INDEX_TEST_NAMES 2000
+
+static char index_test_names[INDEX_TEST_NAMES][24];
+
+static void *index_test_thread(void *arg) {
+    CLIENT_REGISTRY *cr = creg_init();
+    for(int i = 0; i < INDEX_TEST_NAMES; ++i)
+        creg_bind_name(cr, index_test_names[i], NULL);
+    for(int i = 0; i < INDEX_TEST_NAMES; ++i)
+        creg_unbind_name(cr, index_test_names[i], NULL);
+    creg_fini(cr);
+    return arg;
+}
+
+Test(student_suite, 09_name_index, .timeout = 30) {
+    fprintf(stderr, "server_suite/09_name_index\n");
+    uint64_t step = UINT64_MAX / INDEX_TEST_NAMES;
+    for(int i = 0; i < INDEX_TEST_NAMES; ++i) {
+        char *name = index_test_names[i];
+        int len = sprintf(name, "idx%05d_", i);
+        uint64_t prefix = 14695981039346656037UL;
+        for(int j = 0; j < len; ++j)
+            prefix = (prefix ^ (unsigned char)name[j]) * 1099511628211UL;
+        for(unsigned long n = 0; ; ++n) {
+            uint64_t hash = prefix;
+            int k = len;
+            for(unsigned long m = n; ; m /= 16) {
+                name[k] = "0123456789abcdef"[m % 16];
+                hash = (hash ^ (unsigned char)name[k++]) * 1099511628211UL;
+                if(m < 16)
+                    break;
+            }
+            if(hash / step == i) {
+                name[k] = '\0';
+                break;
+            }
+        }
+    }
+    // A small stack, as with -s, so that deep recursion would overflow it.
+    pthread_attr_t attr;
+    pthread_t tid;
+    void *ret = NULL;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    pthread_create(&tid, &attr, index_test_thread, index_test_names);
+    pthread_join(tid, &ret);
+    cr_assert_eq(ret, index_test_names, "Binding and unbinding names failed");
+}
+
+/*
+ * Popping returns the items last in, first out, and then NULL.  Filling
+ * the list to its capacity first means that reading the slot past the
+ * end, as arraylist_pop() once did, reads past the allocation.
+ */
+Test(student_suite, 10_arraylist_pop, .timeout = 5) {
+    fprintf(stderr, "server_suite/10_arraylist_pop\n");
+    ARRAYLIST *list = arraylist_create();
+    long n = list->capacity;
+    for(long i = 1; i <= n; ++i)
+        arraylist_push(list, (void *)i);
+    for(long i = n; i >= 1; --i) {
+        cr_assert_eq(arraylist_pop(list), (void *)i, "Pop did not return the last item pushed");
+        cr_assert_eq(list->size, i - 1, "Pop did not remove the item");
+    }
+    cr_assert_null(arraylist_pop(list), "Pop from an empty list did not return NULL");
+    cr_assert_eq(list->size, 0, "Pop from an empty list changed its size");
+    arraylist_free(list);
+}
+
+/*
+ * Start a server of our own on the given port, with the given options,
+ * and wait until it accepts connections.  The options select the mode
+ * under test, which the server started by 00_start_server does not.
+ * The server is killed if the test exits without stopping it, as it does
+ * when an assertion fails.
+ */
+static pid_t start_server(int port, char *const opts[]) {
+    char portstr[8];
+    char *argv[16] = {"bin/jeux", "-p", portstr};
+    int argc = 3;
+    sprintf(portstr, "%d", port);
+    while(*opts && argc < 15)
+        argv[argc++] = *opts++;
+    argv[argc] = NULL;
+    pid_t pid = fork();
+    if(pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        execv(argv[0], argv);
+        abort();
+    }
+    cr_assert_neq(pid, -1, "Failed to fork server");
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+        close(fd);
+        if(ret == 0)
+            return pid;
+        usleep(50000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    cr_assert_fail("Server on port %d did not start", port);
+    return -1;
+}
+
+static void stop_server(pid_t pid) {
+    int status;
+    kill(pid, SIGHUP);
+    cr_assert_eq(waitpid(pid, &status, 0), pid, "Failed to wait for server");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+              "Server did not exit cleanly after SIGHUP (status 0x%x)", status);
+}
+
+/*
+ * Make a move and check that the opponent is shown the resulting board,
+ * whose first row is given.
+ */
+static void play_move(int fd, int id, int opp, char *move, char *row) {
+    JEUX_PACKET_HEADER hdr;
+    free(request(fd, JEUX_MOVE_PKT, id, 0, 0, move, 1, &hdr));
+    char *state = expect_packet(opp, JEUX_MOVED_PKT, &hdr);
+    cr_assert(!strncmp(state, row, strlen(row)), "MOVED state was '%s'", state);
+    free(state);
+}
+
+/*
+ * Play a whole game between two new players, which the first wins with
+ * the top row, and check that illegal moves are refused on the way and
+ * that both players' ratings change at the end.
+ */
+static void play_game(int port, char *x_name, char *o_name) {
+    JEUX_PACKET_HEADER hdr;
+    int x = login(port, x_name);
+    int o = login(port, o_name);
+    free(request(x, JEUX_INVITE_PKT, 0, 0, SECOND_PLAYER_ROLE, o_name, 1, &hdr));
+    int xid = hdr.id;
+    free(expect_packet(o, JEUX_INVITED_PKT, &hdr));
+    int oid = hdr.id;
+    free(request(o, JEUX_ACCEPT_PKT, oid, 0, 0, NULL, 1, &hdr));
+    char *state = expect_packet(x, JEUX_ACCEPTED_PKT, &hdr);
+    cr_assert(!strncmp(state, " | | \n", 6), "Initial state was '%s'", state);
+    free(state);
+
+    free(request(o, JEUX_MOVE_PKT, oid, 0, 0, "5", 0, &hdr));     // out of turn
+    play_move(x, xid, o, "1", "X| | \n");
+    free(request(o, JEUX_MOVE_PKT, oid, 0, 0, "1", 0, &hdr));     // occupied
+    free(request(o, JEUX_MOVE_PKT, oid, 0, 0, "10", 0, &hdr));    // off the board
+    play_move(o, oid, x, "4", "X| | \n");
+    play_move(x, xid, o, "2", "X|X| \n");
+    play_move(o, oid, x, "5", "X|X| \n");
+
+    // The winning move ends the game for both players before it is ACKed.
+    send_packet(x, JEUX_MOVE_PKT, xid, 0, 0, "3");
+    int ended = 0, acked = 0;
+    while(!acked) {
+        free(recv_packet(x, &hdr));
+        if(hdr.type == JEUX_ENDED_PKT) {
+            cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "ENDED named role %d as winner", hdr.role);
+            ended = 1;
+        }
+        cr_assert_neq(hdr.type, JEUX_NACK_PKT, "Winning move was NACKed");
+        acked = hdr.type == JEUX_ACK_PKT;
+    }
+    cr_assert(ended, "Winner was not sent ENDED before the ACK");
+    free(expect_packet(o, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "ENDED named role %d as winner", hdr.role);
+    free(request(o, JEUX_MOVE_PKT, oid, 0, 0, "6", 0, &hdr));     // game over
+
+    char *users = request(x, JEUX_USERS_PKT, 0, 0, 0, NULL, 1, &hdr);
+    char *xline = strstr(users, x_name), *oline = strstr(users, o_name);
+    cr_assert(xline && oline, "USERS does not list both players");
+    cr_assert_gt(atoi(xline + strlen(x_name) + 1), 1500, "Winner's rating did not rise");
+    cr_assert_lt(atoi(oline + strlen(o_name) + 1), 1500, "Loser's rating did not fall");
+    free(users);
+    close(x);
+    close(o);
+}
+
+Test(student_suite, 11_event_loop_game, .timeout = 20) {
+    fprintf(stderr, "server_suite/11_event_loop_game\n");
+    pid_t pid = start_server(9998, (char *const []){"-e", "-n", "2", NULL});
+    play_game(9998, "loop_x", "loop_o");
+    stop_server(pid);
+}
+
+/*
+ * With a pool of two workers, both are taken by idle clients before the
+ * first game, so that its players need workers started for them.  The
+ * second game is played once those clients have gone, on workers that
+ * have served a connection before.
+ */
+Test(student_suite, 12_worker_pool_game, .timeout = 20) {
+    fprintf(stderr, "server_suite/12_worker_pool_game\n");
+    pid_t pid = start_server(9997, (char *const []){"-w", "2", NULL});
+    int idle[3];
+    for(int i = 0; i < 3; ++i) {
+        char name[16];
+        sprintf(name, "pool_idle%d", i);
+        idle[i] = login(9997, name);
+    }
+    play_game(9997, "pool_x", "pool_o");
+    for(int i = 0; i < 3; ++i)
+        close(idle[i]);
+    play_game(9997, "pool2_x", "pool2_o");
+    stop_server(pid);
+}
+
+/*
+ * With -u, service threads receive and send through io_uring, or, if the
+ * kernel lacks what that needs, through the blocking calls as before.
+ */
+Test(student_suite, 13_uring_game, .timeout = 20) {
+    fprintf(stderr, "server_suite/13_uring_game\n");
+    pid_t pid = start_server(9996, (char *const []){"-u", NULL});
+    play_game(9996, "uring_x", "uring_o");
+    stop_server(pid);
+}
+
+/*
+ * With -a, connections are accepted on several listening sockets bound
+ * to the same port, each with a thread of its own, and handed to the
+ * event loops here.  Two games are played, one after the other, while
+ * another client stays connected, so that over the five connections
+ * more than one acceptor is likely to be used.
+ */
+Test(student_suite, 14_acceptors_game, .timeout = 20) {
+    fprintf(stderr, "server_suite/14_acceptors_game\n");
+    pid_t pid = start_server(9995, (char *const []){"-a", "4", "-e", NULL});
+    int idle = login(9995, "acc_idle");
+    play_game(9995, "acc_x", "acc_o");
+    play_game(9995, "acc2_x", "acc2_o");
+    close(idle);
+    stop_server(pid);
+}
+
+/*
+ * The registry once held at most MAX_CLIENTS (64) clients.  Now that it
+ * is sharded and grows, its only limit is the one set with -c: a client
+ * beyond it is disconnected at once, and one is let in again as soon as
+ * another has gone.
+ */
+#define MANY_CLIENTS 200
+
+/*
+ * Whether the server closes a new connection, which it does at once if
+ * the connection is beyond the limit.  Nothing is sent on it first, so
+ * as not to write to a closed socket.
+ */
+static int refused(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    char c;
+    return poll(&pfd, 1, 100) == 1 && read(fd, &c, 1) == 0;
+}
+
+Test(student_suite, 15_many_clients, .timeout = 30) {
+    fprintf(stderr, "server_suite/15_many_clients\n");
+    JEUX_PACKET_HEADER hdr;
+    pid_t pid = start_server(9994, (char *const []){"-c", "200", NULL});
+    int fds[MANY_CLIENTS];
+    char name[16];
+    for(int i = 0; i < MANY_CLIENTS; ++i) {
+        sprintf(name, "many%03d", i);
+        fds[i] = login(9994, name);
+    }
+    char *users = request(fds[0], JEUX_USERS_PKT, 0, 0, 0, NULL, 1, &hdr);
+    int nlines = 0;
+    for(char *p = users; (p = strchr(p, '\n')); ++p)
+        nlines++;
+    cr_assert_eq(nlines, MANY_CLIENTS, "USERS listed %d players, not %d", nlines, MANY_CLIENTS);
+    for(int i = 0; i < MANY_CLIENTS; ++i) {
+        sprintf(name, "many%03d\t", i);
+        cr_assert_not_null(strstr(users, name), "USERS does not list 'many%03d'", i);
+    }
+    free(users);
+
+    int fd = connect_to_server(9994);
+    cr_assert(refused(fd), "Client beyond the limit was not disconnected");
+    close(fd);
+    close(fds[0]);
+    int in = 0;
+    for(int i = 0; i < 50 && !in; ++i) {
+        fd = connect_to_server(9994);
+        if(!refused(fd)) {
+            free(request(fd, JEUX_LOGIN_PKT, 0, 0, 0, "many_late", 1, &hdr));
+            in = 1;
+        }
+        close(fd);
+    }
+    cr_assert(in, "No client was let in after one left");
+    for(int i = 1; i < MANY_CLIENTS; ++i)
+        close(fds[i]);
+    stop_server(pid);
+}
+
+/*
+ * A pool whose caches and depot are small enough to overflow, with its
+ * objects counted as they are created and destroyed.
+ */
+#define POOL_TEST_MAX 4
+
+static int pool_test_inits, pool_test_finis;
+
+static void pool_test_init(void *obj) {
+    __atomic_add_fetch(&pool_test_inits, 1, __ATOMIC_RELAXED);
+    *(long *)obj = 0;
+}
+
+static void pool_test_fini(void *obj) {
+    __atomic_add_fetch(&pool_test_finis, 1, __ATOMIC_RELAXED);
+}
+
+static OBJ_POOL pool_test_pool = OPOOL_LIMITED_INITIALIZER("TEST", sizeof(long),
+    pool_test_init, pool_test_fini, POOL_TEST_MAX, POOL_TEST_MAX);
+
+/*
+ * Objects freed by a thread come back to it, still holding whatever they
+ * held, without being created again.  Then many more are taken and
+ * freed than the cache and the depot can hold, and the thread exits
+ * with its cache full.
+ */
+static void *pool_test_thread(void *arg) {
+    long *objs[4 * POOL_TEST_MAX];
+    for(long i = 0; i < POOL_TEST_MAX; ++i) {
+        objs[i] = opool_alloc(&pool_test_pool);
+        if(*objs[i])
+            return "New object was not initialized";
+        *objs[i] = i + 1;
+    }
+    for(int i = 0; i < POOL_TEST_MAX; ++i)
+        opool_free(&pool_test_pool, objs[i]);
+    long seen = 0;
+    for(int i = 0; i < POOL_TEST_MAX; ++i) {
+        long *obj = opool_alloc(&pool_test_pool);
+        if(*obj < 1 || *obj > POOL_TEST_MAX || obj != objs[*obj - 1])
+            return "Freed object did not come back from the cache";
+        seen |= 1 << *obj;
+    }
+    if(seen != (2 << POOL_TEST_MAX) - 2 || pool_test_inits != POOL_TEST_MAX)
+        return "Objects were created again instead of reused";
+    for(int i = 0; i < POOL_TEST_MAX; ++i)
+        opool_free(&pool_test_pool, objs[i]);
+    for(int i = 0; i < 4 * POOL_TEST_MAX; ++i)
+        objs[i] = opool_alloc(&pool_test_pool);
+    for(int i = 0; i < 4 * POOL_TEST_MAX; ++i)
+        opool_free(&pool_test_pool, objs[i]);
+    return NULL;
+}
+
+Test(student_suite, 16_object_pool, .timeout = 5) {
+    fprintf(stderr, "server_suite/16_object_pool\n");
+    OPOOL_STATS stats;
+    pthread_t tid;
+    void *ret;
+    pthread_create(&tid, NULL, pool_test_thread, NULL);
+    pthread_join(tid, &ret);
+    cr_assert_null(ret, "%s", (char *)ret);
+
+    // The exited thread's objects went to the depot, or were destroyed if
+    // it was full, and none are left in use.
+    opool_get_stats(&pool_test_pool, &stats);
+    cr_assert_eq(stats.allocs, stats.frees, "Allocations and frees do not match");
+    cr_assert_eq(stats.in_use, 0, "Objects are counted as in use");
+    cr_assert_eq(stats.mallocs, pool_test_inits, "Objects created were not all initialized");
+    cr_assert_eq(stats.destroys, pool_test_finis, "Objects destroyed were not all finalized");
+    cr_assert_gt(stats.destroys, 0, "Nothing was destroyed when the depot overflowed");
+    cr_assert_eq(stats.idle, POOL_TEST_MAX, "Depot holds %lu objects, not %d", stats.idle, POOL_TEST_MAX);
+
+    // Another thread takes them from the depot rather than creating more.
+    unsigned long mallocs = stats.mallocs;
+    long *objs[POOL_TEST_MAX];
+    for(int i = 0; i < POOL_TEST_MAX; ++i)
+        objs[i] = opool_alloc(&pool_test_pool);
+    opool_get_stats(&pool_test_pool, &stats);
+    cr_assert_eq(stats.mallocs, mallocs, "Objects were created while the depot held some");
+    cr_assert_gt(stats.depot_hits, 0, "No allocation was served from the depot");
+    cr_assert_eq(stats.in_use, POOL_TEST_MAX, "%lu objects are counted as in use", stats.in_use);
+    for(int i = 0; i < POOL_TEST_MAX; ++i)
+        opool_free(&pool_test_pool, objs[i]);
+}
+
+/*
+ * Every game of tic-tac-toe, checked against a plain scan of the lines on
+ * the board.  A position is reached by replaying its moves on a new game,
+ * and the board is tracked alongside as two masks, one per player, with
+ * square n as bit n-1.
+ */
+static const uint16_t game_test_lines[8] = {0x007, 0x038, 0x1c0, 0x049, 0x092, 0x124, 0x111, 0x054};
+
+static int game_test_won(uint16_t mask) {
+    for(int i = 0; i < 8; ++i) {
+        if((mask & game_test_lines[i]) == game_test_lines[i])
+            return 1;
+    }
+    return 0;
+}
+
+static GAME_ROLE game_test_winner(uint16_t x, uint16_t o) {
+    return game_test_won(x) ? FIRST_PLAYER_ROLE : game_test_won(o) ? SECOND_PLAYER_ROLE : NULL_ROLE;
+}
+
+typedef void game_test_visit(GAME *game, uint16_t x, uint16_t o, GAME_ROLE turn);
+
+/*
+ * Visit the position reached by the given moves, and then every position
+ * that can follow it.
+ */
+static void game_test_walk(int *moves, int nmoves, uint16_t x, uint16_t o, game_test_visit *visit) {
+    GAME *game = game_create();
+    GAME_ROLE turn = FIRST_PLAYER_ROLE;
+    for(int i = 0; i < nmoves; ++i) {
+        GAME_MOVE move = {turn, moves[i]};
+        cr_assert_eq(game_apply_move(game, &move), 0, "Legal move %d was refused", moves[i]);
+        turn = turn == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+    }
+    visit(game, x, o, turn);
+    game_unref(game, "after game test");
+    if(game_test_winner(x, o) || (x | o) == 0x1ff)
+        return;
+    for(int pos = 1; pos <= 9; ++pos) {
+        uint16_t square = 1 << (pos-1);
+        if((x | o) & square)
+            continue;
+        moves[nmoves] = pos;
+        if(turn == FIRST_PLAYER_ROLE)
+            game_test_walk(moves, nmoves + 1, x | square, o, visit);
+        else
+            game_test_walk(moves, nmoves + 1, x, o | square, visit);
+    }
+}
+
+static long game_test_positions, game_test_results[3];
+
+static void game_test_outcome(GAME *game, uint16_t x, uint16_t o, GAME_ROLE turn) {
+    GAME_ROLE winner = game_test_winner(x, o);
+    int over = winner || (x | o) == 0x1ff;
+    game_test_positions++;
+    cr_assert_eq(game_is_over(game), over, "Game over was %d with X %03x, O %03x", !over, x, o);
+    if(over) {
+        game_test_results[winner]++;
+        cr_assert_eq(game_get_winner(game), winner, "Winner was %d, not %d, with X %03x, O %03x",
+                     game_get_winner(game), winner, x, o);
+    }
+    GAME_ROLE other = turn == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+    for(int pos = 1; pos <= 9; ++pos) {
+        int taken = (x | o) & 1 << (pos-1);
+        GAME_MOVE move = {other, pos};
+        cr_assert_neq(game_apply_move(game, &move), 0, "Move out of turn was accepted");
+        if(over || taken) {
+            move.role = turn;
+            cr_assert_neq(game_apply_move(game, &move), 0, "Move on square %d was accepted "
+                          "with X %03x, O %03x", pos, x, o);
+        }
+    }
+}
+
+Test(student_suite, 17_game_outcomes, .timeout = 30) {
+    fprintf(stderr, "server_suite/17_game_outcomes\n");
+    int moves[9];
+    game_test_walk(moves, 0, 0, 0, game_test_outcome);
+    // The well-known counts for the game tree of tic-tac-toe.
+    cr_assert_eq(game_test_positions, 549946, "%ld positions were reached", game_test_positions);
+    cr_assert_eq(game_test_results[FIRST_PLAYER_ROLE], 131184, "X won %ld games", game_test_results[FIRST_PLAYER_ROLE]);
+    cr_assert_eq(game_test_results[SECOND_PLAYER_ROLE], 77904, "O won %ld games", game_test_results[SECOND_PLAYER_ROLE]);
+    cr_assert_eq(game_test_results[NULL_ROLE], 46080, "%ld games were drawn", game_test_results[NULL_ROLE]);
+
+    // Moves are squares 1 to 9 and nothing else, and resigning ends a game
+    // in favour of the other player.
+    GAME *game = game_create();
+    char *bad[] = {"0", "10", "-1", "1x", "x", ""};
+    for(int i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+        cr_assert_null(game_parse_move(game, FIRST_PLAYER_ROLE, bad[i]), "Move '%s' was parsed", bad[i]);
+    GAME_MOVE *move = game_parse_move(game, FIRST_PLAYER_ROLE, "9");
+    cr_assert_not_null(move, "Move '9' was not parsed");
+    cr_assert_eq(game_apply_move(game, move), 0, "Move '9' was refused");
+    free(move);
+    cr_assert_eq(game_resign(game, SECOND_PLAYER_ROLE), 0, "Resignation was refused");
+    cr_assert(game_is_over(game), "Game is not over after resignation");
+    cr_assert_eq(game_get_winner(game), FIRST_PLAYER_ROLE, "Resigning did not lose the game");
+    cr_assert_neq(game_resign(game, FIRST_PLAYER_ROLE), 0, "Resigning a finished game was accepted");
+    game_unref(game, "after game test");
+}
+
+/*
+ * The value of a position with best play on both sides (1 if X wins, -1
+ * if O wins, 0 for a draw), worked out by plain search and remembered by
+ * the base-3 key of the board.
+ */
+static int8_t game_test_values[19683];
+static char game_test_valued[19683];
+
+static int game_test_value(uint16_t x, uint16_t o, GAME_ROLE turn) {
+    int key = 0;
+    for(int pos = 8; pos >= 0; --pos)
+        key = 3 * key + (x >> pos & 1) + 2 * (o >> pos & 1);
+    if(game_test_valued[key])
+        return game_test_values[key];
+    GAME_ROLE winner = game_test_winner(x, o);
+    int value = winner == FIRST_PLAYER_ROLE ? 1 : winner == SECOND_PLAYER_ROLE ? -1 : 0;
+    if(!winner && (x | o) != 0x1ff) {
+        value = turn == FIRST_PLAYER_ROLE ? -1 : 1;
+        for(int pos = 0; pos < 9; ++pos) {
+            uint16_t square = 1 << pos;
+            if((x | o) & square)
+                continue;
+            int v = turn == FIRST_PLAYER_ROLE
+                ? game_test_value(x | square, o, SECOND_PLAYER_ROLE)
+                : game_test_value(x, o | square, FIRST_PLAYER_ROLE);
+            value = turn == FIRST_PLAYER_ROLE ? (v > value ? v : value) : (v < value ? v : value);
+        }
+    }
+    game_test_valued[key] = 1;
+    game_test_values[key] = value;
+    return value;
+}
+
+static long game_test_suggestions;
+
+static void game_test_suggest(GAME *game, uint16_t x, uint16_t o, GAME_ROLE turn) {
+    GAME_MOVE move;
+    GAME_ROLE other = turn == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+    cr_assert_neq(game_suggest_move(game, other, &move), 0, "A move was suggested out of turn");
+    if(game_test_winner(x, o) || (x | o) == 0x1ff) {
+        cr_assert_neq(game_suggest_move(game, turn, &move), 0, "A move was suggested after the end");
+        return;
+    }
+    cr_assert_eq(game_suggest_move(game, turn, &move), 0, "No move was suggested with X %03x, O %03x", x, o);
+    uint16_t square = 1 << (move.pos-1);
+    cr_assert(move.role == turn && 1 <= move.pos && move.pos <= 9 && !((x | o) & square),
+              "Suggested move %d is not legal with X %03x, O %03x", move.pos, x, o);
+    int value = turn == FIRST_PLAYER_ROLE
+        ? game_test_value(x | square, o, SECOND_PLAYER_ROLE)
+        : game_test_value(x, o | square, FIRST_PLAYER_ROLE);
+    cr_assert_eq(value, game_test_value(x, o, turn), "Suggested move %d throws away the value %d "
+                 "with X %03x, O %03x", move.pos, game_test_value(x, o, turn), x, o);
+    game_test_suggestions++;
+}
+
+/*
+ * From every position in the table, the suggested move keeps the value of
+ * the position: a won game stays won, and a drawn one is not lost.
+ */
+Test(student_suite, 18_game_suggestions, .timeout = 30) {
+    fprintf(stderr, "server_suite/18_game_suggestions\n");
+    int moves[9];
+    cr_assert_eq(game_test_value(0, 0, FIRST_PLAYER_ROLE), 0, "Reference search does not find a draw");
+    game_test_walk(moves, 0, 0, 0, game_test_suggest);
+    cr_assert_eq(game_test_suggestions, 549946 - 255168, "%ld moves were suggested", game_test_suggestions);
+}